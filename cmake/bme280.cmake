@@ -7,6 +7,9 @@ add_library(bme280 STATIC
 )
 
 target_include_directories(bme280 PUBLIC ${bme280_driver_SOURCE_DIR})
+# Integer compensation: 0.01 degC, 1 Pa and 1/1024 %RH, no soft-float double on the FPU-less Cortex-M3.
+# PUBLIC as it changes struct bme280_data for everyone including bme280_defs.h
+target_compile_definitions(bme280 PUBLIC BME280_32BIT_ENABLE)
 
 # Suppress known warnings in vendor code if needed
 target_compile_options(bme280 PRIVATE -Wno-missing-field-initializers)
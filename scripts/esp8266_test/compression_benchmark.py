@@ -0,0 +1,60 @@
+"""Compression ratio of the batch payload formats on recorded datasets.
+
+Usage: python compression_benchmark.py [--batch N] [--decimals D] [--topic T] recording.csv...
+
+A recording is a CSV of "time_ms,value[,topic]" rows, mqtt_subscribe.py writes them when RECORD_CSV is set.
+"""
+import argparse
+import csv
+
+import sample_batch
+
+
+def load(path, topic=None):
+    samples = []
+    with open(path, newline='') as file:
+        for row in csv.reader(file):
+            if topic is not None and (len(row) < 3 or row[2] != topic):
+                continue
+            try:
+                samples.append((int(row[0]), float(row[1])))
+            except (ValueError, IndexError):
+                continue  # Header or comment
+    return samples
+
+
+def benchmark(samples, batch, decimals):
+    raw = v1 = v2 = 0
+    for start in range(0, len(samples), batch):
+        chunk = samples[start:start + batch]
+        payload = sample_batch.encode_v2(chunk, decimals)
+        decoded = sample_batch.decode(payload)
+        if [t for t, _ in decoded] != [t for t, _ in chunk] or any(
+                abs(a - b) > 0.5 / 10 ** decimals for (_, a), (_, b) in zip(decoded, chunk)):
+            raise AssertionError(f"round trip failed in batch starting at sample {start}")
+        raw += 8 * len(chunk)
+        v1 += sample_batch.V1_HEADER.size + sample_batch.V1_SAMPLE.size * len(chunk)
+        v2 += len(payload)
+    return raw, v1, v2
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('recordings', nargs='+')
+    parser.add_argument('--batch', type=int, default=30, help="samples per PUBLISH")
+    parser.add_argument('--decimals', type=int, default=2, help="fixed point decimals of version 2")
+    parser.add_argument('--topic', help="only the samples of this topic, e.g. sensors/pressure with --decimals 0")
+    args = parser.parse_args()
+
+    print(f"{'recording':30} {'samples':>8} {'doubles':>8} {'v1':>8} {'v2':>8} {'vs doubles':>10} {'vs v1':>6}")
+    for path in args.recordings:
+        samples = load(path, args.topic)
+        if not samples:
+            print(f"{path:30} no samples")
+            continue
+        raw, v1, v2 = benchmark(samples, args.batch, args.decimals)
+        print(f"{path:30} {len(samples):8} {raw:8} {v1:8} {v2:8} {raw / v2:9.1f}x {v1 / v2:5.1f}x")
+
+
+if __name__ == '__main__':
+    main()
@@ -3,10 +3,13 @@ import logging
 import asyncio
 import os
 import struct
+import csv
 from datetime import datetime
 from amqtt.client import MQTTClient, ConnectException
 from amqtt.mqtt.constants import QOS_0
 
+import sample_batch
+
 logger = logging.getLogger(__name__)
 
 async def subscriber():
@@ -22,19 +25,31 @@ async def subscriber():
         logger.error("Connection failed: %s", ce)
         return
 
-    await client.subscribe([
-        ('sensors/temperature', QOS_0),
-    ])
-    logger.info(f"Subscribed to sensors/temperature on {url}")
+    topics = ['sensors/temperature', 'sensors/pressure', 'sensors/humidity']
+    await client.subscribe([(topic, QOS_0) for topic in topics])
+    logger.info(f"Subscribed to {', '.join(topics)} on {url}")
+
+    # Decoded samples are appended here as "time_ms,value,topic" rows for compression_benchmark.py
+    record_path = os.getenv("RECORD_CSV")
+    record_file = open(record_path, 'a', newline='') if record_path else None
+    recording = csv.writer(record_file) if record_file else None
 
     try:
         while True:
             message = await client.deliver_message()
             packet = message.publish_packet
             try:
-                if len(packet.payload.data) == 8:
-                   (val,) = struct.unpack('<d', packet.payload.data)
+                data = packet.payload.data
+                if len(data) == 8:
+                   (val,) = struct.unpack('<d', data)
                    payload = f"{val:.2f}"
+                elif data and data[0] in (1, 2):
+                   samples = sample_batch.decode(data)
+                   payload = ", ".join(f"{val:.2f} @ {time_ms / 1000:.3f} s" for time_ms, val in samples)
+                   if recording:
+                       topic = packet.variable_header.topic_name
+                       recording.writerows((time_ms, val, topic) for time_ms, val in samples)
+                       record_file.flush()
                 else:
                    payload = packet.payload.data.decode('utf-8')
             except Exception:
@@ -44,6 +59,8 @@ async def subscriber():
     except KeyboardInterrupt:
         pass
     finally:
+        if record_file:
+            record_file.close()
         await client.disconnect()
 
 if __name__ == '__main__':
@@ -0,0 +1,132 @@
+"""Reference codecs for the sample batch payloads published by the network task.
+
+Version 1 (plain, doubles) is only sent by older firmware, version 2 (src/CompressedSampleBatch.h) is Gorilla style
+compressed fixed point.
+"""
+import math
+import struct
+
+V1_HEADER = struct.Struct('<BBI')   # version, count, base time (ms since boot)
+V1_SAMPLE = struct.Struct('<Hd')    # offset (ms) from the base time, value
+V2_HEADER = struct.Struct('<BBBIi') # version, count, decimals, base time (ms since boot), first value (fixed point)
+
+# (prefix, prefix length, payload bits) of the version 2 prefix code, first match wins
+V2_BUCKETS = [
+    (0b0, 1, 0),
+    (0b10, 2, 4),
+    (0b110, 3, 12),
+    (0b1110, 4, 20),
+    (0b1111, 4, 32),
+]
+
+
+def _lround(value):
+    """std::lround, halves away from zero. round() would take them to even, 0.125 * 100 -> 12 instead of 13."""
+    magnitude = abs(value)
+    whole = math.floor(magnitude)
+    # Exact, unlike floor(magnitude + 0.5), which rounds 0.49999999999999994 up
+    rounded = whole + (1 if magnitude - whole >= 0.5 else 0)
+    return int(math.copysign(rounded, value))
+
+
+def _to_int32(value):
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+class _BitReader:
+    def __init__(self, data, position):
+        self.data = data
+        self.position = position * 8
+
+    def read(self, bits):
+        value = 0
+        for _ in range(bits):
+            byte = self.data[self.position // 8]
+            value = (value << 1) | ((byte >> (7 - self.position % 8)) & 1)
+            self.position += 1
+        return value
+
+    def read_signed(self):
+        # The prefix is the number of leading ones, at most 4
+        ones = 0
+        while ones < 4 and self.read(1):
+            ones += 1
+        bits = V2_BUCKETS[ones][2]
+        if bits == 0:
+            return 0
+        value = self.read(bits)
+        if value & (1 << (bits - 1)):
+            value -= 1 << bits
+        return value
+
+
+def decode_v1(data):
+    version, count, base_ms = V1_HEADER.unpack_from(data)
+    if len(data) != V1_HEADER.size + count * V1_SAMPLE.size:
+        raise ValueError(f"batch of {count} samples is {len(data)} bytes")
+    samples = []
+    for i in range(count):
+        offset_ms, value = V1_SAMPLE.unpack_from(data, V1_HEADER.size + i * V1_SAMPLE.size)
+        samples.append(((base_ms + offset_ms) & 0xFFFFFFFF, value))
+    return samples
+
+
+def decode_v2(data):
+    version, count, decimals, time_ms, value = V2_HEADER.unpack_from(data)
+    if count == 0:
+        return []
+    scale = 10 ** decimals
+    samples = [(time_ms, value / scale)]
+    reader = _BitReader(data, V2_HEADER.size)
+    delta_ms = 0
+    for _ in range(count - 1):
+        delta_ms = (delta_ms + reader.read_signed()) & 0xFFFFFFFF
+        time_ms = (time_ms + delta_ms) & 0xFFFFFFFF
+        value = _to_int32(value + reader.read_signed())
+        samples.append((time_ms, value / scale))
+    return samples
+
+
+def encode_v2(samples, decimals=2):
+    """Same output as CompressedSampleBatch::add() for every sample, without the payload size limit"""
+    bits = []
+
+    def write(value, length):
+        bits.extend((value >> i) & 1 for i in reversed(range(length)))
+
+    def write_signed(value):
+        if value == 0:
+            write(0b0, 1)
+            return
+        for code, length, payload_bits in V2_BUCKETS[1:]:
+            limit = 1 << (payload_bits - 1)
+            if -limit <= value < limit or payload_bits == 32:
+                write(code, length)
+                write(value & ((1 << payload_bits) - 1), payload_bits)
+                return
+
+    scale = 10 ** decimals
+    fixed = [_lround(value * scale) for _, value in samples]
+    base_ms = samples[0][0] if samples else 0
+    header = V2_HEADER.pack(2, len(samples), decimals, base_ms, fixed[0] if samples else 0)
+    previous_delta_ms = 0
+    for i in range(1, len(samples)):
+        delta_ms = (samples[i][0] - samples[i - 1][0]) & 0xFFFFFFFF
+        write_signed(_to_int32(delta_ms - previous_delta_ms))
+        write_signed(_to_int32(fixed[i] - fixed[i - 1]))
+        previous_delta_ms = delta_ms
+    bits.extend([0] * (-len(bits) % 8))
+    body = bytes(int(''.join(map(str, bits[i:i + 8])), 2) for i in range(0, len(bits), 8))
+    return header + body
+
+
+def decode(data):
+    """Decode any batch version into [(time_ms, value), ...]"""
+    if not data:
+        raise ValueError("empty batch")
+    if data[0] == 1:
+        return decode_v1(data)
+    if data[0] == 2:
+        return decode_v2(data)
+    raise ValueError(f"unknown batch version {data[0]}")
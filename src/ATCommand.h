@@ -43,8 +43,11 @@ namespace commands {
     constexpr ATCommand ECHO_OFF = AT_CMD("ATE0");
     constexpr ATCommand ECHO_ON = AT_CMD("ATE1");
     constexpr ATCommand TRANSPARENT_MODE = AT_CMD("AT+CIPMODE=1");
+    constexpr ATCommand NORMAL_MODE = AT_CMD("AT+CIPMODE=0");
+    constexpr ATCommand MULTIPLE_CONNECTIONS = AT_CMD("AT+CIPMUX=1");
     constexpr ATCommand START_SEND = AT_CMD("AT+CIPSEND");
     constexpr ATCommand QUERY_AP_DEF = AT_CMD("AT+CWJAP_DEF?");
+    constexpr ATCommand DEEP_SLEEP = AT_CMD("AT+GSLP=0"); // Until the reset pin is pulsed
 
 // ========== Parameterized Command Builders (flexible) ==========
 /// @brief Build AT+CWJAP command at compile time
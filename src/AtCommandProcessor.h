@@ -4,11 +4,13 @@
 #include <array>
 #include <cstdio>
 #include <functional>
+#include <optional>
 #include <ranges>
 #include <span>
 #include <string_view>
 
 #include "ATCommand.h"
+#include "AtResponseParser.h"
 #include "Logger.h"
 #include "System.h"
 #include "interfaces/IDmaSerial.h"
@@ -16,39 +18,58 @@
 #include "interrupts.h"
 #include "utils.h"
 
+/// @brief Sends AT commands to the ESP8266 and parses its responses, for a single task
+/// The USART2 interrupts notify the one task registered with set_network_task_handle_for_usart2_interrupts(), so
+/// nothing is locked: only that task may send or wait for a response. The TX queue is shared with the interrupt only.
 class AtCommandProcessor {
 public:
     explicit constexpr AtCommandProcessor(const IDmaSerial* usart, const IRTOS* rtos)
         : usart(usart)
         , rtos(rtos)
+        , parser(std::span<const volatile char>(rx_buf.data(), rx_buf.size()))
     {
     }
 
     void start_rx_dma()
     {
         utils::logger.info("Enabling RX DMA\n");
-        old_rx_dma_count = rx_buf.size();
+        parser.reset();
+        rx_read_count = 0;
+        rx_overflow = false;
         // TODO: This cast assumes TaskHandle_t is compatible with IRTOS::TaskHandle (void*)
         // This dependency on interrupts.h preventing full decoupling is known (Phase 2 refactor)
         set_network_task_handle_for_rx_dma_interrupts(static_cast<TaskHandle_t>(rtos->get_current_task_handle()));
         usart->error_interrupt(true);
-        usart->enable_rx_dma(reinterpret_cast<uintptr_t>(rx_buf.data()), rx_buf.size(), true, false, false, true);
+        // Wake up the network task whenever the ESP8266 stops sending (end of a response burst)
+        usart->idle_line_received_interrupt(true);
+        // Ping-pong: the half and complete transfer interrupts hand every filled half of the ring to the parser
+        usart->enable_rx_dma(reinterpret_cast<uintptr_t>(rx_buf.data()), rx_buf.size(), true, true, true, true);
     }
 
-    utils::ErrorCode send_raw(std::span<const std::byte> cmd, unsigned int timeout_ms = 10) const
+    /// @brief Queue data for sending and return right away
+    /// The data must stay alive until get_tx_done(token) returns true or the callback has been called.
+    /// The callback is called from the USART transfer complete interrupt.
+    [[nodiscard]] std::optional<TxToken> send_async(
+        std::span<const std::byte> data, TxCallback callback = nullptr, void* context = nullptr) const
     {
-        if (std::ranges::size(cmd) == 0) {
-            return utils::ErrorCode::OK;
-        }
+        return usart->send_async(TxRequest { .data = data, .callback = callback, .context = context });
+    }
 
-        // Enable TX DMA
-        // TODO: not thread safe, lock USART/TX DMA mutex
-        usart->enable_tx_dma(
-            reinterpret_cast<uintptr_t>(cmd.data()), cmd.size() * sizeof(std::byte), true, false, true);
+    [[nodiscard]] bool get_tx_done(TxToken token) const { return usart->get_tx_done(token); }
 
-        // Yield task until 1. USART transfer is complete or 2. timeout is reached
-        // The USART interrupt will xTaskNotify() the task when the transfer is complete
-        bool const timeout = !rtos->task_notify_wait(timeout_ms);
+    /// @brief Yield the task until the transmission is done or the timeout is reached
+    /// @return false on timeout, the transmission and everything queued after it is then cancelled
+    bool wait_tx(TxToken token, unsigned int timeout_ms) const
+    {
+        // The USART interrupt will xTaskNotify() the task when a transfer is complete
+        // The same notification is also used by the RX side (IDLE line), so a wake up does not
+        // necessarily mean that our transfer is done -> keep waiting until the deadline
+        const uint32_t start_ms = rtos->get_time_ms();
+        bool timeout = false;
+        while (!timeout && !usart->get_tx_done(token)) {
+            const uint32_t elapsed_ms = rtos->get_time_ms() - start_ms;
+            timeout = (elapsed_ms >= timeout_ms) || !rtos->task_notify_wait(timeout_ms - elapsed_ms);
+        }
 
         // TODO: Handle errors
         // DMA transfer error
@@ -58,41 +79,113 @@ public:
         // Timeout, TX timeout is an error!
         // It is possible that we timeout just before the transfer is complete
         // -> if we just check the timeout flag we get a false positive error
-        // -> check if the transfer is complete flag is set to be sure
-        if (!usart->get_tx_transfer_complete_flag()) {
-            // The other way around should not happen:
-            // We don't timeout, but neither is the transfer complete...
-            if (!timeout) {
-                utils::logger.error("Timeout flag NOT set, but transfer is NOT complete. Is there a bug in the "
-                                    "interrupt handler?\n");
-            } else {
-                utils::logger.error("USART TX transfer timeout!\n");
-            }
+        // -> check if the transfer is done to be sure
+        if (!usart->get_tx_done(token)) {
+            utils::logger.error("USART TX transfer timeout!\n");
+            usart->cancel_tx();
+            return false;
         }
+        return true;
+    }
 
-        // Cleanup, disable the TX DMA
-        usart->disable_tx_dma();
-        usart->clear_tx_transfer_complete_flag();
+    /// @brief Tell the processor the current link rate, the TX timeouts scale with it
+    void set_baudrate(unsigned int rate) { baudrate = rate; }
+
+    /// @param slack_ms Time allowed on top of the time it takes to clock the data out
+    /// @return MEMORY_ERROR if the TX queue stayed full, NETWORK_RESPONSE_TIMEOUT_ERROR if the data didn't go out
+    [[nodiscard]] utils::ErrorCode send_raw(std::span<const std::byte> cmd, unsigned int slack_ms = 10) const
+    {
+        if (std::ranges::size(cmd) == 0) {
+            return utils::ErrorCode::OK;
+        }
+
+        // TODO: not thread safe, lock USART/TX DMA mutex
+        const unsigned int timeout_ms = tx_timeout_ms(cmd.size(), slack_ms);
+        const auto token = queue_tx([this, cmd] { return send_async(cmd); }, timeout_ms);
+        if (!token) {
+            utils::logger.error("USART TX queue full!\n");
+            return utils::ErrorCode::MEMORY_ERROR;
+        }
+        if (!wait_tx(*token, timeout_ms)) {
+            return utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR;
+        }
         // TODO: not thread safe, release the USART/DMA mutex
 
         return utils::ErrorCode::OK;
     }
 
+    /// @brief Send the segments back to back in one go without copying them together (scatter-gather)
+    /// The TX complete interrupt chains the DMA transfers, the task only waits for the last one
+    utils::ErrorCode send_gather(std::span<const std::span<const std::byte>> segments, unsigned int slack_ms) const
+    {
+        std::array<TxRequest, max_gather_segments> requests {};
+        size_t count = 0;
+        size_t size = 0;
+        for (const auto& segment : segments) {
+            if (segment.empty()) {
+                continue;
+            }
+            if (count == requests.size()) {
+                return utils::ErrorCode::MEMORY_ERROR;
+            }
+            requests[count++].data = segment;
+            size += segment.size();
+        }
+        if (count == 0) {
+            return utils::ErrorCode::OK;
+        }
+
+        const unsigned int timeout_ms = tx_timeout_ms(size, slack_ms);
+        const auto gather = std::span<const TxRequest>(requests.data(), count);
+        const auto token = queue_tx([this, gather] { return usart->send_gather_async(gather); }, timeout_ms);
+        if (!token) {
+            utils::logger.error("USART TX queue full!\n");
+            return utils::ErrorCode::MEMORY_ERROR;
+        }
+        if (!wait_tx(*token, timeout_ms)) {
+            return utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR;
+        }
+        return utils::ErrorCode::OK;
+    }
+
     [[nodiscard]] utils::ErrorCode send_command(
         esp8266::ATCommand cmd, std::string_view ok_response, unsigned int response_time_ms = 1000) const
     {
-        using namespace std::literals; // std::string_view literals
-
-        // Don't stack allocate, the stack is too small to fit this
-        // Use a static buffer instead
-        static std::array<char, 2048> wrap_case_concat_buffer;
+        // Nothing is sent if the parser can't look for the response
+        if (ok_response.size() > esp8266::AtResponseParser::max_expected_size) {
+            utils::logger.error("Expected response longer than %u characters!\n",
+                static_cast<unsigned>(esp8266::AtResponseParser::max_expected_size));
+            return utils::ErrorCode::MEMORY_ERROR;
+        }
+        // Whatever came in since the last command (URCs, +IPD data) can't be mistaken for the response
+        pump();
 
         // Send the command
-        send_raw(cmd);
+        if (const auto res = send_raw(cmd); res != utils::ErrorCode::OK) {
+            return res;
+        }
 
-        // Now we wait for a response
-        // Yield task until timeout is reached, or we have an error
-        (void)rtos->task_notify_wait(response_time_ms);
+        return wait_response(ok_response, response_time_ms);
+    }
+
+    /// @brief Wait for the response to something that was already sent, e.g. SEND OK after the data
+    [[nodiscard]] utils::ErrorCode wait_response(std::string_view ok_response, unsigned int response_time_ms) const
+    {
+        // The USART2 IDLE line interrupt wakes us up every time the ESP8266 stops talking, so we can check the
+        // response as soon as it has arrived instead of always sleeping for the full response time
+        parser.expect(ok_response);
+        const size_t response_start_idx = parser.get_read_index();
+        const uint32_t start_ms = rtos->get_time_ms();
+        bool timeout = false;
+        while (true) {
+            consume_rx();
+            if (parser.get_done() || timeout) {
+                break;
+            }
+            // Yield task until timeout is reached, or more data has arrived
+            const uint32_t elapsed_ms = rtos->get_time_ms() - start_ms;
+            timeout = (elapsed_ms >= response_time_ms) || !rtos->task_notify_wait(response_time_ms - elapsed_ms);
+        }
 
         auto res = utils::ErrorCode::OK;
         // DMA transfer error
@@ -101,6 +194,12 @@ public:
             utils::logger.error("USART RX DMA transfer error!\n");
             res = utils::ErrorCode::NETWORK_RESPONSE_DMA_ERROR;
         }
+        // The DMA wrapped around the ring over data we hadn't parsed yet
+        if (rx_overflow) {
+            utils::logger.error("USART RX buffer overflow!\n");
+            rx_overflow = false;
+            res = utils::ErrorCode::NETWORK_RESPONSE_RX_OVERFLOW_ERROR;
+        }
         // UART overrun error
         if (usart->get_overrun_error_flag()) {
             utils::logger.error("USART RX DMA transfer overrun error!\n");
@@ -110,46 +209,7 @@ public:
         // // RX timeout is NOT an error condition
 
         // Check the response
-        auto count = usart->get_dma_count();
-        // DMCNT counts down
-        bool wrapped = count > old_rx_dma_count;
-        // First new byte received, based on the previous last byte received
-        const size_t start_idx = rx_buf.size() - old_rx_dma_count;
-        // One past last new byte received or one past the last byte in the buffer if we wrapped
-        const size_t segment_end = rx_buf.size() - (wrapped ? 0 : count);
-
-        // These are only used in the wrapped case
-        const size_t wrapped_start_idx = 0;
-        // The last byte received in the wrapped case
-        const size_t wrapped_end_idx = wrapped ? rx_buf.size() - count : 0;
-
-        // How many bytes were received before the wrap
-        const unsigned int received_before_wrap = segment_end - start_idx;
-        // How many bytes were received after the wrap
-        const unsigned int received_after_wrap = wrapped_end_idx - wrapped_start_idx;
-        // How many bytes in total
-        const unsigned received = received_before_wrap + received_after_wrap; // Check how many bytes were received
-
-        std::string_view sv;
-        // TODO: Some fancy chaining of DMAs so that we don't need the CPU to copy the data?
-        if (wrapped) {
-            // Copy the bytes received before the wrap
-            std::copy(rx_buf.begin() + start_idx, rx_buf.end(), wrap_case_concat_buffer.begin());
-            // Copy the bytes received after the wrap
-            std::copy(rx_buf.begin(), rx_buf.begin() + wrapped_end_idx,
-                wrap_case_concat_buffer.begin() + received_before_wrap);
-            sv = std::string_view(const_cast<char*>(wrap_case_concat_buffer.data()), received);
-        } else {
-            // No wrap, just directly access the bytes received
-            sv = std::string_view(const_cast<char*>(rx_buf.data() + start_idx), received);
-        }
-
-        // Update the old rx dma count, so we know where we left off when the next DMA transfer starts
-        old_rx_dma_count = count;
-
-        // Split respone by line by line, check if any of the lines contains the OK response
-        if (!(std::ranges::any_of(sv | std::views::lazy_split("\r\n"sv),
-                [ok_response](auto const& line) { return !std::ranges::search(line, ok_response).empty(); }))) {
+        if (!parser.get_matched() || parser.get_error()) {
             res = utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
         }
 
@@ -160,19 +220,126 @@ public:
             } else {
                 utils::logger.info("Printing the received data (if any)...\n");
             }
-            if (received > 0) {
-                utils::logger.log(sv);
-            }
+            log_received(response_start_idx, parser.get_read_index());
             utils::logger.log("\n");
         }
 
         return res;
     }
 
+    /// @brief Parse everything received so far outside of a command, routes the +IPD data to the handler
+    void pump() const
+    {
+        parser.expect({});
+        consume_rx();
+    }
+
+    void set_ipd_handler(esp8266::IpdHandler handler, void* context) { parser.set_ipd_handler(handler, context); }
+
+    /// @brief The response to the last command said UNLINK, the link it closed was already gone
+    [[nodiscard]] bool get_unlinked() const { return parser.get_unlinked(); }
+
+    /// @brief Links closed by the remote end since the last call, one bit per link id
+    [[nodiscard]] uint8_t take_closed_links() const { return parser.take_closed_links(); }
+
+    /// @brief Largest amount of received but not yet parsed data seen so far
+    /// Use this to size the RX buffer from the measured peak burst, anything above the buffer size was lost
+    [[nodiscard]] size_t get_rx_high_water_mark() const { return rx_high_water_mark; }
+
 private:
     const IDmaSerial* usart;
     const IRTOS* rtos;
     static constexpr bool debug = true;
-    mutable size_t old_rx_dma_count = 0;
-    mutable std::array<volatile char, 2048> rx_buf {};
+    static constexpr size_t max_gather_segments = 4;
+    // How long the ESP8266 may hold off our TX with CTS, e.g. while its own buffers are full
+    static constexpr unsigned int flow_control_hold_ms = 1000;
+    unsigned int baudrate = bluepill::NETWORK_BAUDRATE;
+    // Size it from get_rx_high_water_mark() + margin, it has to hold the longest burst the parser can fall behind
+    static constexpr size_t rx_buffer_size = 2048;
+    static_assert(rx_buffer_size % 2 == 0, "RX buffer is handed to the parser in halves");
+    mutable std::array<volatile char, rx_buffer_size> rx_buf {};
+    mutable esp8266::AtResponseParser parser;
+    // Total number of bytes the DMA had written when the parser last caught up, wraps around at 2^32
+    mutable uint32_t rx_read_count = 0;
+    mutable size_t rx_high_water_mark = 0;
+    mutable bool rx_overflow = false;
+
+    // Time it takes to clock the bytes out (start + 8 data + stop bits) plus the slack
+    // With flow control CTS just pauses the transfer, so the ESP8266 may take a lot longer to accept everything
+    unsigned int tx_timeout_ms(size_t bytes, unsigned int slack_ms) const
+    {
+        const auto wire_ms = static_cast<unsigned int>((bytes * 10 * 1000 + baudrate - 1) / baudrate);
+        return wire_ms + slack_ms + (bluepill::NETWORK_FLOW_CONTROL ? flow_control_hold_ms : 0);
+    }
+
+    // The TX queue is full while the earlier transfers are still going out (or held off with CTS)
+    // -> back-pressure, wait for room instead of dropping the data
+    template <typename Queue> std::optional<TxToken> queue_tx(Queue queue, unsigned int timeout_ms) const
+    {
+        const uint32_t start_ms = rtos->get_time_ms();
+        auto token = queue();
+        while (!token) {
+            const uint32_t elapsed_ms = rtos->get_time_ms() - start_ms;
+            if ((elapsed_ms >= timeout_ms) || !rtos->task_notify_wait(timeout_ms - elapsed_ms)) {
+                break;
+            }
+            token = queue();
+        }
+        return token;
+    }
+
+    // Index of the next byte the RX DMA writes to, DMA count register counts down from the buffer size
+    size_t rx_write_index() const
+    {
+        const unsigned int count = usart->get_dma_count();
+        return (count >= rx_buf.size()) ? 0 : rx_buf.size() - count;
+    }
+
+    // Total number of bytes written by the DMA since the RX was started
+    // Every half/complete transfer interrupt means one more half of the ring is full, the DMA write index gives the
+    // position inside the half currently being filled. If the interrupt is still pending the write index is already
+    // in the next half, the offset then just goes past the half size and the total is still right.
+    uint32_t rx_write_count(size_t write_idx, uint32_t halves) const
+    {
+        constexpr size_t half_size = rx_buffer_size / 2;
+        const size_t half_start = (halves % 2) * half_size;
+        const size_t offset = (write_idx + rx_buf.size() - half_start) % rx_buf.size();
+        return (halves * half_size) + offset;
+    }
+
+    // Feed everything the DMA has written since the last call to the parser
+    void consume_rx() const
+    {
+        // A half/complete interrupt between reading the index and the half count would make the total a whole ring
+        // too high, read them again until no interrupt came in between
+        uint32_t halves = 0;
+        size_t write_idx = 0;
+        do {
+            halves = usart->get_rx_dma_half_count();
+            write_idx = rx_write_index();
+        } while (halves != usart->get_rx_dma_half_count());
+
+        const size_t unread = rx_write_count(write_idx, halves) - rx_read_count;
+        rx_high_water_mark = std::max(rx_high_water_mark, unread);
+        if (unread >= rx_buf.size()) {
+            // The DMA has lapped the parser, the oldest unread bytes have already been overwritten
+            rx_overflow = true;
+        }
+        parser.consume(write_idx);
+        rx_read_count += unread;
+    }
+
+    // Log the received bytes between start and end, the data may wrap around the end of the buffer
+    void log_received(size_t start_idx, size_t end_idx) const
+    {
+        auto segment = [this](size_t begin, size_t end) {
+            return std::string_view(const_cast<const char*>(rx_buf.data() + begin), end - begin);
+        };
+        if (end_idx >= start_idx) {
+            utils::logger.log(segment(start_idx, end_idx));
+        } else {
+            utils::logger.log(segment(start_idx, rx_buf.size()));
+            utils::logger.log(segment(0, end_idx));
+        }
+    }
 };
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <utility>
+
+namespace esp8266 {
+
+enum class LineType : uint8_t {
+    FINAL_RESULT, // OK, ERROR, FAIL, SEND OK, ready
+    UNSOLICITED, // Sent by the ESP8266 on its own, e.g. WIFI GOT IP, CLOSED, +IPD
+    DATA, // Everything else: command echo, information responses (+CWJAP_DEF:...)
+};
+
+enum class ResultCode : uint8_t { NONE, OK, ERROR, FAIL, SEND_OK, READY, PROMPT };
+
+// Called with the payload of the +IPD frames as it arrives, a frame may come in several pieces
+// The data is only valid during the call, it will be overwritten by the RX DMA later
+using IpdHandler = void (*)(void* context, unsigned int link_id, std::span<const volatile char> data);
+
+/// @brief Resumable line oriented parser for the ESP8266 AT command responses
+///
+/// Consumes the new bytes of the circular RX DMA buffer in place, one byte at a time.
+/// Lines are split on CRLF and may wrap around the end of the buffer, nothing is copied.
+/// The expected response is searched incrementally (KMP), so every received byte is only looked at once.
+/// The payload of the incoming +IPD frames is binary, it is skipped by the line parser and handed out as is.
+class AtResponseParser {
+public:
+    static constexpr size_t max_expected_size = 64;
+    static constexpr unsigned int max_links = 5; // AT+CIPMUX=1 link ids 0-4
+
+    explicit constexpr AtResponseParser(std::span<const volatile char> ring) noexcept
+        : ring(ring)
+    {
+    }
+
+    /// @brief Start over from the beginning of the buffer, e.g. when the RX DMA is restarted
+    void reset()
+    {
+        read_idx = 0;
+        line_start = 0;
+        line_length = 0;
+        previous_cr = false;
+        ipd_remaining = 0;
+        expect({});
+    }
+
+    void set_ipd_handler(IpdHandler handler, void* context)
+    {
+        ipd_handler = handler;
+        ipd_context = context;
+    }
+
+    /// @brief Start parsing the response to a new command
+    /// @param ok_response A line containing this marks the response as successful, longer than max_expected_size
+    /// fails the response right away rather than matching a truncated one
+    void expect(std::string_view ok_response)
+    {
+        const bool too_long = ok_response.size() > max_expected_size;
+        expected = too_long ? std::string_view {} : ok_response;
+        // KMP failure function: length of the longest proper prefix that is also a suffix of expected[0..i]
+        size_t k = 0;
+        for (size_t i = 1; i < expected.size(); ++i) {
+            while (k > 0 && expected[i] != expected[k]) {
+                k = failure[k - 1];
+            }
+            if (expected[i] == expected[k]) {
+                ++k;
+            }
+            failure[i] = static_cast<uint8_t>(k);
+        }
+        match_pos = 0;
+        line_matched = false;
+        matched = false;
+        error = too_long;
+        done = too_long;
+        unlinked = false;
+        result = ResultCode::NONE;
+    }
+
+    /// @brief Consume everything between the current read position and the DMA write position
+    /// @param write_idx Index of the next byte the DMA will write
+    void consume(size_t write_idx)
+    {
+        while (read_idx != write_idx) {
+            if (ipd_remaining > 0) {
+                consume_ipd_data(write_idx);
+                continue;
+            }
+            consume_byte(ring[read_idx]);
+            read_idx = next(read_idx);
+        }
+    }
+
+    /// @brief Links closed by the remote end (<id>,CLOSED) since the last call, one bit per link id
+    [[nodiscard]] uint8_t take_closed_links()
+    {
+        const uint8_t closed = closed_links;
+        closed_links = 0;
+        return closed;
+    }
+
+    [[nodiscard]] bool get_matched() const { return matched; }
+    [[nodiscard]] bool get_error() const { return error; }
+    [[nodiscard]] bool get_done() const { return done; }
+    /// @brief The response said UNLINK, AT+CIPCLOSE of a link that was already gone
+    [[nodiscard]] bool get_unlinked() const { return unlinked; }
+    [[nodiscard]] ResultCode get_result() const { return result; }
+    [[nodiscard]] size_t get_read_index() const { return read_idx; }
+    [[nodiscard]] LineType get_last_line_type() const { return last_line_type; }
+    [[nodiscard]] unsigned int get_unsolicited_count() const { return unsolicited_count; }
+    [[nodiscard]] bool get_in_ipd_data() const { return ipd_remaining > 0; }
+
+private:
+    static constexpr std::array<std::string_view, 6> unsolicited_prefixes
+        = { "+IPD", "WIFI ", "CLOSED", "CONNECT", "busy ", "link is not valid" };
+
+    std::span<const volatile char> ring;
+    size_t read_idx = 0;
+
+    // Current line
+    size_t line_start = 0;
+    size_t line_length = 0; // Includes a possible trailing CR
+    bool previous_cr = false;
+
+    // Expected response search state
+    std::string_view expected;
+    std::array<uint8_t, max_expected_size> failure {};
+    size_t match_pos = 0;
+    bool line_matched = false;
+
+    // Response state
+    bool matched = false;
+    bool error = false;
+    bool done = false;
+    bool unlinked = false;
+    ResultCode result = ResultCode::NONE;
+    LineType last_line_type = LineType::DATA;
+    unsigned int unsolicited_count = 0;
+    uint8_t closed_links = 0;
+
+    // Incoming +IPD frame
+    IpdHandler ipd_handler = nullptr;
+    void* ipd_context = nullptr;
+    unsigned int ipd_link = 0;
+    size_t ipd_remaining = 0;
+
+    [[nodiscard]] size_t next(size_t idx) const { return (idx + 1 == ring.size()) ? 0 : idx + 1; }
+
+    void consume_byte(char c)
+    {
+        // +IPD,<id>,<len>: (multiplexed) or +IPD,<len>: (single connection), the binary payload follows
+        if (c == ':' && line_starts_with(line_length, "+IPD,")) {
+            start_ipd_data();
+            return;
+        }
+
+        if (c == '\n' && previous_cr) {
+            end_line(line_length - 1);
+            line_start = next(read_idx);
+            line_length = 0;
+            previous_cr = false;
+            return;
+        }
+
+        ++line_length;
+        previous_cr = c == '\r';
+
+        if (expected.empty()) {
+            return;
+        }
+        while (match_pos > 0 && c != expected[match_pos]) {
+            match_pos = failure[match_pos - 1];
+        }
+        if (c == expected[match_pos]) {
+            ++match_pos;
+        }
+        if (match_pos == expected.size()) {
+            // Partial lines count too, the CRLF might still be on its way when the response times out
+            line_matched = true;
+            matched = true;
+            match_pos = failure[match_pos - 1];
+        }
+        // AT+CIPSEND prompt, no line ending after it
+        if (c == '>' && line_length == 1 && matched && !done) {
+            done = true;
+            result = ResultCode::PROMPT;
+        }
+    }
+
+    void start_ipd_data()
+    {
+        // Parse the comma separated numbers after "+IPD,"
+        std::array<size_t, 2> fields {};
+        size_t field_count = 1;
+        size_t idx = line_start;
+        for (size_t i = 0; i < line_length; ++i, idx = next(idx)) {
+            if (i < 5) {
+                continue;
+            }
+            const char c = ring[idx];
+            if (c == ',') {
+                if (field_count == fields.size()) {
+                    break; // AT+CIPDINFO=1 remote address, not used
+                }
+                ++field_count;
+            } else if (c >= '0' && c <= '9') {
+                fields[field_count - 1] = (fields[field_count - 1] * 10) + static_cast<size_t>(c - '0');
+            }
+        }
+        ipd_link = (field_count == 1) ? 0 : static_cast<unsigned int>(fields[0]);
+        ipd_remaining = fields[field_count - 1];
+
+        last_line_type = LineType::UNSOLICITED;
+        ++unsolicited_count;
+        line_start = next(read_idx);
+        line_length = 0;
+        previous_cr = false;
+        match_pos = 0;
+        line_matched = false;
+    }
+
+    void consume_ipd_data(size_t write_idx)
+    {
+        // Hand out the contiguous part, the rest comes on the next round if the frame wraps around the buffer
+        const size_t end = (write_idx > read_idx) ? write_idx : ring.size();
+        const size_t count = std::min(ipd_remaining, end - read_idx);
+        if (ipd_handler != nullptr) {
+            ipd_handler(ipd_context, ipd_link, ring.subspan(read_idx, count));
+        }
+        ipd_remaining -= count;
+        read_idx = (read_idx + count == ring.size()) ? 0 : read_idx + count;
+        line_start = read_idx;
+    }
+
+    // Connection status in multiplexed mode: <id>,CONNECT / <id>,CLOSED / <id>,CONNECT FAIL
+    [[nodiscard]] bool check_link_status(size_t length)
+    {
+        if (length < 3 || ring[next(line_start)] != ',') {
+            return false;
+        }
+        const char id = ring[line_start];
+        if (id < '0' || id >= static_cast<char>('0' + max_links)) {
+            return false;
+        }
+        // Compare the rest of the line after "<id>,"
+        auto rest_equals
+            = [this, length](std::string_view str) { return equals_at(next(next(line_start)), length - 2, str); };
+        if (rest_equals("CLOSED") || rest_equals("CONNECT FAIL")) {
+            closed_links |= static_cast<uint8_t>(1U << (id - '0'));
+            return true;
+        }
+        return rest_equals("CONNECT");
+    }
+
+    // Compare the line in the ring buffer against str, handles the wrap around the end of the buffer
+    [[nodiscard]] bool line_equals(size_t length, std::string_view str) const
+    {
+        return equals_at(line_start, length, str);
+    }
+
+    [[nodiscard]] bool equals_at(size_t start, size_t length, std::string_view str) const
+    {
+        if (length != str.size()) {
+            return false;
+        }
+        size_t idx = start;
+        for (char c : str) {
+            if (ring[idx] != c) {
+                return false;
+            }
+            idx = next(idx);
+        }
+        return true;
+    }
+
+    [[nodiscard]] bool line_starts_with(size_t length, std::string_view prefix) const
+    {
+        return (length >= prefix.size()) && line_equals(prefix.size(), prefix);
+    }
+
+    [[nodiscard]] ResultCode final_result(size_t length) const
+    {
+        constexpr std::array<std::pair<std::string_view, ResultCode>, 6> codes = { {
+            { "OK", ResultCode::OK },
+            { "ERROR", ResultCode::ERROR },
+            { "FAIL", ResultCode::FAIL },
+            { "SEND OK", ResultCode::SEND_OK },
+            { "SEND FAIL", ResultCode::FAIL },
+            { "ready", ResultCode::READY },
+        } };
+        for (const auto& [str, code] : codes) {
+            if (line_equals(length, str)) {
+                return code;
+            }
+        }
+        return ResultCode::NONE;
+    }
+
+    void end_line(size_t length)
+    {
+        const bool this_line_matched = line_matched;
+        line_matched = false;
+        match_pos = 0;
+
+        if (length == 0) {
+            return;
+        }
+
+        const auto code = final_result(length);
+        if (code == ResultCode::NONE) {
+            last_line_type = LineType::DATA;
+            unlinked = unlinked || line_equals(length, "UNLINK");
+            if (check_link_status(length)
+                || std::ranges::any_of(unsolicited_prefixes,
+                    [this, length](auto prefix) { return line_starts_with(length, prefix); })) {
+                last_line_type = LineType::UNSOLICITED;
+                ++unsolicited_count;
+            }
+            return;
+        }
+
+        last_line_type = LineType::FINAL_RESULT;
+        if (done) {
+            return;
+        }
+        if (!this_line_matched && (code == ResultCode::ERROR || code == ResultCode::FAIL)) {
+            error = true;
+            done = true;
+            result = code;
+        }
+        // Some commands respond OK before the line we are interested in (AT+RST -> OK ... ready)
+        // -> a final result code only ends the response after we've seen the expected line
+        if (matched) {
+            done = true;
+            result = code;
+        }
+    }
+};
+
+} // namespace esp8266
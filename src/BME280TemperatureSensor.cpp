@@ -1,6 +1,8 @@
+#include <array>
 #include <cstdio>
+#include <cstdlib>
 #include <span>
-#include <tuple>
+#include <type_traits>
 
 #include <bme280.h>
 
@@ -11,38 +13,92 @@
 utils::ErrorCode BME280TemperatureSensor::init() const
 {
     utils::logger.info("Initializing BME280...\n");
-    const int8_t res = bme280_init(&bme280);
-    if (res != BME280_OK) {
+    if (i2c->self_test(bme280_addr) != utils::ErrorCode::OK) {
+        utils::logger.error("BME280 does not answer on I2C!\n");
+        return utils::ErrorCode::TEMPERATURE_INIT_ERROR;
+    }
+    if (bme280_init(&bme280) != BME280_OK) {
         utils::logger.error("Failed to initialize BME280!\n");
         return utils::ErrorCode::TEMPERATURE_INIT_ERROR;
     }
+    // Weather monitoring settings of the datasheet, the sensor stays in sleep mode between forced conversions
+    const struct bme280_settings settings {
+        .osr_p = BME280_OVERSAMPLING_1X,
+        .osr_t = BME280_OVERSAMPLING_1X,
+        .osr_h = BME280_OVERSAMPLING_1X,
+        .filter = BME280_FILTER_COEFF_OFF,
+        .standby_time = BME280_STANDBY_TIME_0_5_MS,
+    };
+    uint32_t conversion_time_us = 0;
+    if (bme280_set_sensor_settings(BME280_SEL_ALL_SETTINGS, &settings, &bme280) != BME280_OK
+        || bme280_cal_meas_delay(&conversion_time_us, &settings) != BME280_OK) {
+        utils::logger.error("Failed to configure BME280!\n");
+        return utils::ErrorCode::TEMPERATURE_INIT_ERROR;
+    }
+    conversion_time_ms = (conversion_time_us + 999) / 1000;
     utils::logger.info("BME280 initialized!\n");
     return utils::ErrorCode::OK;
 }
 
-std::optional<double> BME280TemperatureSensor::read() const
+std::optional<centi_celsius_t> BME280TemperatureSensor::read() const
+{
+    if (start_conversion() != utils::ErrorCode::OK) {
+        return std::nullopt;
+    }
+    if (rtos != nullptr) {
+        rtos->delay(conversion_time_ms);
+    } else {
+        bluepill::busy_wait_ms(conversion_time_ms);
+    }
+    const auto reading = read_environment();
+    if (!reading) {
+        return std::nullopt;
+    }
+    return reading->temperature;
+}
+
+utils::ErrorCode BME280TemperatureSensor::start_conversion() const
+{
+    // A single write of ctrl_meas, the conversion runs on the sensor while we do something else
+    if (bme280_set_sensor_mode(BME280_POWERMODE_FORCED, &bme280) != BME280_OK) {
+        utils::logger.error("Failed to start BME280 conversion!\n");
+        return utils::ErrorCode::TEMPERATURE_READ_ERROR;
+    }
+    return utils::ErrorCode::OK;
+}
+
+std::optional<EnvironmentReading> BME280TemperatureSensor::read_environment() const
 {
     utils::logger.info("Reading BME280...\n");
     struct bme280_data read_data {};
-    const int8_t res = bme280_get_sensor_data(BME280_TEMP, &read_data, &bme280);
-    if (res != BME280_OK) {
-        utils::logger.error("Failed to read temperature!\n");
+    // One burst of press_msb..hum_lsb (0xF7..0xFE) and the compensation of all three
+    if (bme280_get_sensor_data(BME280_ALL, &read_data, &bme280) != BME280_OK) {
+        utils::logger.error("Failed to read BME280!\n");
         return std::nullopt;
     }
-    utils::logger.info("BME280 read, temperatue: %d!\n", static_cast<int>(read_data.temperature));
-    return read_data.temperature;
+    static_assert(std::is_same_v<decltype(read_data.temperature), centi_celsius_t>, "bme280 needs BME280_32BIT_ENABLE");
+    const EnvironmentReading reading {
+        .temperature = read_data.temperature,
+        .pressure = read_data.pressure,
+        .humidity = (read_data.humidity * 100 + humidity_q10_scale / 2) / humidity_q10_scale,
+    };
+    const char* sign = reading.temperature < 0 ? "-" : "";
+    utils::logger.info("BME280 read, temperature: %s%d.%02d, pressure: %u, humidity: %u.%02u!\n", sign,
+        std::abs(reading.temperature) / 100, std::abs(reading.temperature) % 100,
+        static_cast<unsigned>(reading.pressure), static_cast<unsigned>(reading.humidity / 100),
+        static_cast<unsigned>(reading.humidity % 100));
+    return reading;
 }
 
-void BME280TemperatureSensor::write_reg(const uint8_t addr, std::span<const uint8_t> data) const
+utils::ErrorCode BME280TemperatureSensor::write_reg(const uint8_t addr, std::span<const uint8_t> data) const
 {
-    // Write BME280 register file @addr
-    std::ignore = i2c->write(bme280_addr, std::span<const uint8_t>(&addr, 1));
-    std::ignore = i2c->write(bme280_addr, data);
+    // Write BME280 register file @addr, the Bosch driver interleaves any further register addresses into data
+    const std::array<std::span<const uint8_t>, 2> segments = { std::span<const uint8_t>(&addr, 1), data };
+    return i2c->write_gather(bme280_addr, segments);
 }
 
-void BME280TemperatureSensor::read_reg(const uint8_t addr, std::span<uint8_t> data) const
+utils::ErrorCode BME280TemperatureSensor::read_reg(const uint8_t addr, std::span<uint8_t> data) const
 {
-    // Read BME280 register file @addr
-    std::ignore = i2c->write(bme280_addr, std::span<const uint8_t>(&addr, 1));
-    std::ignore = i2c->read(bme280_addr, data);
+    // Read BME280 register file @addr, auto-increments for burst reads
+    return i2c->write_read(bme280_addr, std::span<const uint8_t>(&addr, 1), data);
 }
\ No newline at end of file
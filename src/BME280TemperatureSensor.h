@@ -10,6 +10,7 @@
 #include "Logger.h"
 #include "System.h"
 #include "interfaces/II2C.h"
+#include "interfaces/IRTOS.h"
 #include "utils.h"
 
 #include "interfaces/ITemperatureSensor.h"
@@ -18,8 +19,14 @@ enum class BME280I2CBusAddr : uint8_t { PRIMARY = BME280_I2C_ADDR_PRIM, SECONDAR
 
 class BME280TemperatureSensor final : public ITemperatureSensor {
 public:
-    constexpr BME280TemperatureSensor(const II2C* i2c, BME280I2CBusAddr bme280_addr) noexcept
+    // The driver compensates humidity to 1/1024 %RH
+    static constexpr uint32_t humidity_q10_scale = 1024;
+
+    // Without an RTOS the delays of the Bosch driver busy-wait
+    constexpr BME280TemperatureSensor(
+        const II2C* i2c, BME280I2CBusAddr bme280_addr, const IRTOS* rtos = nullptr) noexcept
         : i2c(i2c)
+        , rtos(rtos)
         , bme280_addr(static_cast<uint8_t>(bme280_addr))
         , bme280({ .chip_id = BME280_I2C_ADDR_SEC,
               .intf = BME280_I2C_INTF,
@@ -33,22 +40,32 @@ public:
     }
 
     utils::ErrorCode init() const override;
-    std::optional<double> read() const override;
-    void write_reg(const uint8_t addr, std::span<const uint8_t> data) const;
-    void read_reg(const uint8_t addr, std::span<uint8_t> data) const;
+    std::optional<centi_celsius_t> read() const override;
+    /// @brief One forced mode conversion of all three quantities, the sensor goes back to sleep after it
+    utils::ErrorCode start_conversion() const override;
+    /// @brief Datasheet maximum for the configured oversampling, rounded up
+    uint32_t get_conversion_time_ms() const override { return conversion_time_ms; }
+    /// @brief Temperature, pressure and humidity from one burst read of the data registers 0xF7..0xFE
+    std::optional<EnvironmentReading> read_environment() const override;
+    utils::ErrorCode write_reg(const uint8_t addr, std::span<const uint8_t> data) const;
+    utils::ErrorCode read_reg(const uint8_t addr, std::span<uint8_t> data) const;
 
 private:
-    const Logger* logger;
     const II2C* i2c;
+    const IRTOS* rtos;
     uint8_t bme280_addr;
     mutable struct bme280_dev bme280;
+    // Set by init()
+    mutable uint32_t conversion_time_ms = 0;
 
     // For the Bosch BME280 driver
     static BME280_INTF_RET_TYPE bme280_read(uint8_t reg_addr, uint8_t* reg_data, uint32_t len, void* intf_ptr)
     {
         auto* bme280_sensor = static_cast<BME280TemperatureSensor*>(intf_ptr);
         auto sp = std::span<uint8_t>(reg_data, len);
-        bme280_sensor->read_reg(reg_addr, sp);
+        if (bme280_sensor->read_reg(reg_addr, sp) != utils::ErrorCode::OK) {
+            return BME280_E_COMM_FAIL;
+        }
         return BME280_INTF_RET_SUCCESS;
     }
 
@@ -56,14 +73,23 @@ private:
     {
         auto* bme280_sensor = static_cast<BME280TemperatureSensor*>(intf_ptr);
         auto sp = std::span<const uint8_t>(reg_data, len);
-        bme280_sensor->write_reg(reg_addr, sp);
+        if (bme280_sensor->write_reg(reg_addr, sp) != utils::ErrorCode::OK) {
+            return BME280_E_COMM_FAIL;
+        }
         return BME280_INTF_RET_SUCCESS;
     }
 
-    static void bme280_delay_us(uint32_t period, [[maybe_unused]] void* intf_ptr)
+    static void bme280_delay_us(uint32_t period, void* intf_ptr)
     {
-        // This will only be called with period == 2000 from the BOSCH driver
-        // so this is OK as we don't need a more accurate sleep, but not ideal
-        bluepill::busy_wait_ms(period / 1000);
+        // The Bosch driver waits here after every soft reset: in bme280_init(), and in bme280_set_sensor_settings() and
+        // bme280_set_sensor_mode() whenever the sensor isn't asleep yet, e.g. start_conversion() catching a forced
+        // conversion that is still running. Round up to whole milliseconds.
+        const auto* bme280_sensor = static_cast<BME280TemperatureSensor*>(intf_ptr);
+        const uint32_t ms = (period + 999) / 1000;
+        if (bme280_sensor->rtos != nullptr) {
+            bme280_sensor->rtos->delay(ms);
+        } else {
+            bluepill::busy_wait_ms(ms);
+        }
     }
 };
\ No newline at end of file
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "System.h"
+#include "interfaces/IBackupRegisters.h"
+#include "interfaces/INetwork.h"
+#include "interfaces/ITemperatureSensor.h"
+
+/// @brief What the Standby duty cycle carries from one wake-up to the next, written through to the backup registers
+///
+/// Nine 16-bit registers are too few for whole readings, so the fields are bit packed across them, LSB first:
+///
+///  Bits | 0-7   | 8-11  | 12        | 13-15     | 16-23           | 24-55             | 56-102       | 103...
+///       | Magic | Count | AP joined | Baud rate | Packet id block | First sample (ms) | First sample | Deltas
+///
+/// The first sample is stored whole: temperature in 16 bits of centi-degrees, pressure in 17 bits of pascals and
+/// humidity in 14 bits of centi-%RH, which covers the BME280's range. Each following one is 19 bits of deltas from the
+/// previous reading: temperature 6, pressure 6 and humidity 7 bits. A reading that changed more than that doesn't fit,
+/// it goes out with a publish instead. The samples are taken one period apart, so only the first one needs a timestamp.
+/// A wake-up that didn't get a reading leaves a missing slot behind, marked by the lowest temperature delta.
+class BackupState {
+public:
+    // Bump when the layout changes, the old contents are thrown away then
+    static constexpr uint8_t magic = 0xC5;
+
+    BackupState(const IBackupRegisters& registers, uint32_t sample_period_ms)
+        : registers(registers)
+        , sample_period_ms(sample_period_ms)
+    {
+    }
+
+    /// @return false if the registers held something else, e.g. after a power loss, they are cleared then
+    [[nodiscard]] bool load() const
+    {
+        if (read_bits(magic_field) == magic) {
+            return true;
+        }
+        for (size_t i = 0; i < registers.size(); ++i) {
+            registers.write(i, 0);
+        }
+        write_bits(magic_field, magic);
+        return false;
+    }
+
+    /// @brief 3 with the nine registers of the STM32F103
+    [[nodiscard]] size_t capacity() const
+    {
+        const size_t bits = registers.size() * register_bits;
+        if (bits < deltas_position) {
+            return 0;
+        }
+        return std::min<size_t>(1 + (bits - deltas_position) / delta_bits, max_count);
+    }
+    [[nodiscard]] size_t size() const { return read_bits(count_field); }
+    [[nodiscard]] bool empty() const { return size() == 0; }
+    [[nodiscard]] bool full() const { return size() >= capacity(); }
+    [[nodiscard]] uint32_t get_first_time_ms() const { return read_bits(first_time_field); }
+    [[nodiscard]] uint32_t get_time_ms(size_t i) const
+    {
+        return get_first_time_ms() + static_cast<uint32_t>(i) * sample_period_ms;
+    }
+
+    /// @brief Stores the reading in the slot of its time, the ones skipped since the previous sample are missing
+    /// @return false if it doesn't fit, in time or in the deltas -> publish and clear first
+    [[nodiscard]] bool add(uint32_t time_ms, const EnvironmentReading& reading) const
+    {
+        if (capacity() == 0) {
+            return false;
+        }
+        if (empty()) {
+            write_bits(first_time_field, time_ms);
+            write_bits(first_temperature_field,
+                static_cast<uint32_t>(std::clamp<centi_celsius_t>(reading.temperature, INT16_MIN, INT16_MAX)));
+            write_bits(first_pressure_field, std::min(reading.pressure, max_value(first_pressure_field)));
+            write_bits(first_humidity_field, std::min(reading.humidity, max_value(first_humidity_field)));
+            write_bits(count_field, 1);
+            return true;
+        }
+
+        // Rounded, the wake-ups jitter by a few milliseconds around the period
+        const size_t slot = std::max<size_t>((time_ms - get_first_time_ms() + sample_period_ms / 2) / sample_period_ms,
+            size());
+        if (slot >= capacity()) {
+            return false;
+        }
+        const auto previous = last_reading();
+        const int32_t temperature = reading.temperature - previous.temperature;
+        const int32_t pressure = static_cast<int32_t>(reading.pressure) - static_cast<int32_t>(previous.pressure);
+        const int32_t humidity = static_cast<int32_t>(reading.humidity) - static_cast<int32_t>(previous.humidity);
+        if (!fits(temperature_delta_bits, temperature) || temperature == missing_delta
+            || !fits(pressure_delta_bits, pressure) || !fits(humidity_delta_bits, humidity)) {
+            return false;
+        }
+        for (size_t i = size(); i < slot; ++i) {
+            write_bits(delta_field(i, 0, temperature_delta_bits), static_cast<uint32_t>(missing_delta));
+        }
+        write_bits(delta_field(slot, 0, temperature_delta_bits), static_cast<uint32_t>(temperature));
+        write_bits(delta_field(slot, temperature_delta_bits, pressure_delta_bits), static_cast<uint32_t>(pressure));
+        write_bits(delta_field(slot, temperature_delta_bits + pressure_delta_bits, humidity_delta_bits),
+            static_cast<uint32_t>(humidity));
+        write_bits(count_field, static_cast<uint32_t>(slot + 1));
+        return true;
+    }
+
+    /// @return the reading in slot i, nullopt if that wake-up didn't get one
+    [[nodiscard]] std::optional<EnvironmentReading> get(size_t i) const
+    {
+        if (i >= size()) {
+            return std::nullopt;
+        }
+        EnvironmentReading reading = first_reading();
+        for (size_t slot = 1; slot <= i; ++slot) {
+            if (!apply_delta(slot, reading) && slot == i) {
+                return std::nullopt;
+            }
+        }
+        return reading;
+    }
+
+    /// @brief Forgets the samples, the rest stays
+    void clear() const { write_bits(count_field, 0); }
+
+    /// @brief Only the upper byte is kept: the ids continue at the next block of 256 after the ones the last wake-up
+    /// handed out, so none of them is reused while the broker may still hold it
+    [[nodiscard]] uint16_t get_next_packet_id() const
+    {
+        return static_cast<uint16_t>(read_bits(packet_id_block_field) << packet_id_block_shift);
+    }
+    void set_next_packet_id(uint16_t id) const
+    {
+        write_bits(packet_id_block_field, (static_cast<uint32_t>(id >> packet_id_block_shift) + 1));
+    }
+
+    /// @brief Baud rates other than NETWORK_BAUDRATE and the candidates are forgotten
+    [[nodiscard]] NetworkWarmHint get_network_hint() const
+    {
+        const uint32_t index = read_bits(baudrate_field);
+        unsigned int baudrate = 0;
+        if (index == 1) {
+            baudrate = bluepill::NETWORK_BAUDRATE;
+        } else if (index >= 2 && index - 2 < bluepill::NETWORK_BAUDRATE_CANDIDATES.size()) {
+            baudrate = bluepill::NETWORK_BAUDRATE_CANDIDATES[index - 2];
+        }
+        return { .baudrate = baudrate, .ap_joined = read_bits(ap_joined_field) != 0 };
+    }
+    void set_network_hint(const NetworkWarmHint& hint) const
+    {
+        const auto& candidates = bluepill::NETWORK_BAUDRATE_CANDIDATES;
+        uint32_t index = 0;
+        if (hint.baudrate == bluepill::NETWORK_BAUDRATE) {
+            index = 1;
+        } else if (const auto found = std::ranges::find(candidates, hint.baudrate); found != candidates.end()) {
+            index = static_cast<uint32_t>(2 + (found - candidates.begin()));
+        }
+        write_bits(baudrate_field, index);
+        write_bits(ap_joined_field, hint.ap_joined ? 1 : 0);
+    }
+
+private:
+    struct Field {
+        size_t position;
+        unsigned int width;
+    };
+
+    static constexpr unsigned int register_bits = 16;
+
+    static constexpr Field magic_field { 0, 8 };
+    static constexpr Field count_field { 8, 4 };
+    static constexpr Field ap_joined_field { 12, 1 };
+    static constexpr Field baudrate_field { 13, 3 };
+    static constexpr Field packet_id_block_field { 16, 8 };
+    static constexpr Field first_time_field { 24, 32 };
+    static constexpr Field first_temperature_field { 56, 16 };
+    static constexpr Field first_pressure_field { 72, 17 };
+    static constexpr Field first_humidity_field { 89, 14 };
+    static constexpr size_t deltas_position = 103;
+
+    static constexpr unsigned int temperature_delta_bits = 6;
+    static constexpr unsigned int pressure_delta_bits = 6;
+    static constexpr unsigned int humidity_delta_bits = 7;
+    static constexpr unsigned int delta_bits = temperature_delta_bits + pressure_delta_bits + humidity_delta_bits;
+    static constexpr int32_t missing_delta = -(1 << (temperature_delta_bits - 1));
+
+    static constexpr size_t max_count = (1U << 4) - 1;
+    static constexpr unsigned int packet_id_block_shift = 8;
+    static_assert(bluepill::NETWORK_BAUDRATE_CANDIDATES.size() + 2 <= (1U << 3));
+
+    const IBackupRegisters& registers;
+    uint32_t sample_period_ms;
+
+    [[nodiscard]] static constexpr uint32_t max_value(Field field)
+    {
+        return static_cast<uint32_t>((1ULL << field.width) - 1);
+    }
+    [[nodiscard]] static constexpr bool fits(unsigned int width, int32_t value)
+    {
+        return value >= -(1 << (width - 1)) && value < (1 << (width - 1));
+    }
+    [[nodiscard]] static constexpr int32_t sign_extend(unsigned int width, uint32_t value)
+    {
+        return static_cast<int32_t>(value << (32 - width)) >> (32 - width);
+    }
+    // Slot 0 is the first sample, the deltas start at slot 1
+    [[nodiscard]] static constexpr Field delta_field(size_t slot, unsigned int offset, unsigned int width)
+    {
+        return { deltas_position + (slot - 1) * delta_bits + offset, width };
+    }
+
+    [[nodiscard]] uint32_t read_bits(Field field) const
+    {
+        uint32_t value = 0;
+        for (unsigned int done = 0; done < field.width;) {
+            const size_t position = field.position + done;
+            const unsigned int shift = position % register_bits;
+            const unsigned int chunk = std::min(field.width - done, register_bits - shift);
+            const uint32_t bits = (registers.read(position / register_bits) >> shift) & ((1U << chunk) - 1);
+            value |= bits << done;
+            done += chunk;
+        }
+        return value;
+    }
+    void write_bits(Field field, uint32_t value) const
+    {
+        for (unsigned int done = 0; done < field.width;) {
+            const size_t position = field.position + done;
+            const size_t index = position / register_bits;
+            const unsigned int shift = position % register_bits;
+            const unsigned int chunk = std::min(field.width - done, register_bits - shift);
+            const uint32_t mask = ((1U << chunk) - 1) << shift;
+            const uint32_t bits = ((value >> done) << shift) & mask;
+            registers.write(index, static_cast<uint16_t>((registers.read(index) & ~mask) | bits));
+            done += chunk;
+        }
+    }
+
+    [[nodiscard]] EnvironmentReading first_reading() const
+    {
+        return { .temperature = sign_extend(16, read_bits(first_temperature_field)),
+            .pressure = read_bits(first_pressure_field),
+            .humidity = read_bits(first_humidity_field) };
+    }
+    /// @return false if the slot is missing, the reading stays as it was then
+    bool apply_delta(size_t slot, EnvironmentReading& reading) const
+    {
+        const auto delta = [&](unsigned int offset, unsigned int width) {
+            return sign_extend(width, read_bits(delta_field(slot, offset, width)));
+        };
+        const int32_t temperature = delta(0, temperature_delta_bits);
+        if (temperature == missing_delta) {
+            return false;
+        }
+        reading.temperature += temperature;
+        reading.pressure += static_cast<uint32_t>(delta(temperature_delta_bits, pressure_delta_bits));
+        reading.humidity
+            += static_cast<uint32_t>(delta(temperature_delta_bits + pressure_delta_bits, humidity_delta_bits));
+        return true;
+    }
+    // The deltas are taken from the previous reading that was there
+    [[nodiscard]] EnvironmentReading last_reading() const
+    {
+        EnvironmentReading reading = first_reading();
+        for (size_t slot = 1; slot < size(); ++slot) {
+            (void)apply_delta(slot, reading);
+        }
+        return reading;
+    }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/// @brief One measurement and the time it was taken
+struct Sample {
+    uint32_t time_ms;
+    // Fixed point in the units of the sensor, e.g. centi_celsius_t
+    int32_t value;
+};
+
+/*  Compressed batch payload, version 2, Gorilla style:
+ *
+ *          +---------+---------+----------+----------------+---------------------+
+ *  Header  | Version |  Count  | Decimals | Base time (ms) | First value (fixed) |
+ *          |   u8    |   u8    |    u8    |   u32 LE       |      i32 LE         |
+ *          +---------+---------+----------+----------------+---------------------+
+ *  Bits    | (Count - 1) * (time delta-of-delta, value delta), MSB first, zero padded |
+ *          +-----------------------------------------------------------------------+
+ *
+ *  Values are fixed point integers, decimals tells the decoder where the point is (2 for centi_celsius_t).
+ *  Both the delta-of-delta of the timestamps and the delta of the values are written with the same prefix code:
+ *
+ *      0                   -> 0
+ *      10   + 4 bits       -> [-8, 7]
+ *      110  + 12 bits      -> [-2048, 2047]
+ *      1110 + 20 bits      -> [-524288, 524287]
+ *      1111 + 32 bits      -> anything else
+ *
+ *  A steady sampling period costs 1 bit per timestamp and a slowly changing value mostly 1 or 6 bits.
+ *  The reference decoder is in scripts/esp8266_test/sample_batch.py.
+ */
+template <size_t max_payload_size, uint8_t decimals = 2> class CompressedSampleBatch {
+public:
+    static constexpr uint8_t version = 2;
+    static constexpr size_t header_size = 11;
+    // Room for the worst case sample, 2 x (4 + 32) bits
+    static constexpr size_t max_sample_bits = 72;
+    static_assert(max_payload_size >= header_size, "Payload must fit the header");
+
+    CompressedSampleBatch() { clear(); }
+
+    /// @return false if the batch is full -> publish and start over
+    [[nodiscard]] bool add(const Sample& sample)
+    {
+        const int32_t value = sample.value;
+        if (count == 0) {
+            base_ms = sample.time_ms;
+            write_le(3, base_ms);
+            write_le(7, static_cast<uint32_t>(value));
+        } else {
+            if (full()) {
+                return false;
+            }
+            // Unsigned arithmetic wraps like the decoder does
+            const uint32_t delta_ms = sample.time_ms - previous_ms;
+            write_signed(static_cast<int32_t>(delta_ms - previous_delta_ms));
+            write_signed(static_cast<int32_t>(static_cast<uint32_t>(value) - static_cast<uint32_t>(previous_value)));
+            previous_delta_ms = delta_ms;
+        }
+        previous_ms = sample.time_ms;
+        previous_value = value;
+        ++count;
+        payload[1] = static_cast<std::byte>(count);
+        return true;
+    }
+
+    [[nodiscard]] std::span<const std::byte> get_payload() const
+    {
+        return std::span<const std::byte>(payload.data(), (bit_position + 7) / 8);
+    }
+
+    [[nodiscard]] size_t size() const { return count; }
+    [[nodiscard]] bool empty() const { return count == 0; }
+    [[nodiscard]] bool full() const
+    {
+        return count == UINT8_MAX || bit_position + max_sample_bits > max_payload_size * 8;
+    }
+    /// @brief Time of the oldest sample in the batch
+    [[nodiscard]] uint32_t get_base_time_ms() const { return base_ms; }
+
+    void clear()
+    {
+        payload = {};
+        payload[0] = static_cast<std::byte>(version);
+        payload[2] = static_cast<std::byte>(decimals);
+        bit_position = header_size * 8;
+        count = 0;
+        previous_delta_ms = 0;
+    }
+
+private:
+    std::array<std::byte, max_payload_size> payload {};
+    size_t bit_position = 0;
+    size_t count = 0;
+    uint32_t base_ms = 0;
+    uint32_t previous_ms = 0;
+    uint32_t previous_delta_ms = 0;
+    int32_t previous_value = 0;
+
+    void write_le(size_t position, uint32_t value)
+    {
+        for (size_t i = 0; i < 4; ++i) {
+            payload[position + i] = static_cast<std::byte>((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    void write_bits(uint32_t value, unsigned bits)
+    {
+        for (unsigned i = bits; i > 0; --i) {
+            if ((value >> (i - 1)) & 1) {
+                payload[bit_position / 8] |= static_cast<std::byte>(0x80 >> (bit_position % 8));
+            }
+            ++bit_position;
+        }
+    }
+
+    void write_signed(int32_t value)
+    {
+        const auto bits = static_cast<uint32_t>(value);
+        if (value == 0) {
+            write_bits(0b0, 1);
+        } else if (value >= -8 && value <= 7) {
+            write_bits(0b10, 2);
+            write_bits(bits & 0xF, 4);
+        } else if (value >= -2048 && value <= 2047) {
+            write_bits(0b110, 3);
+            write_bits(bits & 0xFFF, 12);
+        } else if (value >= -524288 && value <= 524287) {
+            write_bits(0b1110, 4);
+            write_bits(bits & 0xFFFFF, 20);
+        } else {
+            write_bits(0b1111, 4);
+            write_bits(bits, 32);
+        }
+    }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+using TxToken = uint32_t;
+// Called from the transfer complete interrupt, keep it short
+using TxCallback = void (*)(void* context);
+
+struct TxRequest {
+    std::span<const std::byte> data;
+    TxCallback callback = nullptr;
+    void* context = nullptr;
+};
+
+/// @brief Queue of pending DMA transmissions
+///
+/// Single producer (the task sending data) and single consumer (the transfer complete interrupt).
+/// The task pushes requests and starts the transmitter if it was idle, after that the interrupt
+/// starts the next queued request straight away when the previous one has gone out.
+/// The data of a request must stay alive until the request is done.
+template <size_t capacity> class DmaTxQueue {
+    static_assert((capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    /// @brief Task side, add a request to the end of the queue
+    /// @return Token to check the completion with, false if the queue is full
+    [[nodiscard]] bool push(const TxRequest& request, TxToken& token)
+    {
+        const uint32_t h = head.load();
+        if (h - tail.load() >= capacity) {
+            return false;
+        }
+        slots[h % capacity] = request;
+        token = h;
+        head.store(h + 1);
+        return true;
+    }
+
+    /// @brief Task side, add several requests that go out back to back, all or nothing
+    /// @return Token of the last request, false if they don't all fit in the queue
+    [[nodiscard]] bool push(std::span<const TxRequest> requests, TxToken& token)
+    {
+        if (requests.empty() || (capacity - size() < requests.size())) {
+            return false;
+        }
+        for (const auto& request : requests) {
+            (void)push(request, token);
+        }
+        return true;
+    }
+
+    /// @brief Take ownership of the transmitter if it is idle and there is something to send
+    /// @return The request to start, nullptr if nothing to do or a transfer is already running
+    [[nodiscard]] const TxRequest* claim()
+    {
+        if (tail.load() == head.load() || busy.exchange(true)) {
+            return nullptr;
+        }
+        return &slots[tail.load() % capacity];
+    }
+
+    /// @brief Interrupt side, the running request has gone out
+    /// @return The next request to start, nullptr if the queue is empty
+    [[nodiscard]] const TxRequest* complete()
+    {
+        if (!busy.load()) {
+            return nullptr;
+        }
+        const uint32_t t = tail.load();
+        const TxRequest& done = slots[t % capacity];
+        if (done.callback != nullptr) {
+            done.callback(done.context);
+        }
+        // Free the slot only after the callback, the producer may reuse it right away
+        tail.store(t + 1);
+        busy.store(false);
+        return claim();
+    }
+
+    /// @brief Drop everything, e.g. after a transfer error or timeout. Callbacks are not called
+    void clear()
+    {
+        tail.store(head.load());
+        busy.store(false);
+    }
+
+    [[nodiscard]] bool is_done(TxToken token) const
+    {
+        // Wrap safe: done once the tail has moved past the token
+        return static_cast<int32_t>(tail.load() - token) > 0;
+    }
+    [[nodiscard]] bool is_busy() const { return busy.load(); }
+    [[nodiscard]] size_t size() const { return head.load() - tail.load(); }
+
+private:
+    std::array<TxRequest, capacity> slots {};
+    // Free running indices, the slot is index % capacity
+    std::atomic_uint32_t head = 0;
+    std::atomic_uint32_t tail = 0;
+    std::atomic_bool busy = false;
+};
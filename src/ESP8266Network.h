@@ -1,14 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstdio>
-#include <functional>
 #include <string_view>
 
 #include "ATCommand.h"
 #include "AtCommandProcessor.h"
 #include "GPIO.h"
 #include "Logger.h"
+#include "RadioPowerPolicy.h"
+#include "SocketRxQueue.h"
 #include "System.h"
 #include "interfaces/IDmaSerial.h"
 #include "interfaces/INetwork.h"
@@ -36,45 +38,53 @@ public:
 
     utils::ErrorCode init() override
     {
-        // Circular buffer RX DMA setup
+        // Circular buffer RX DMA setup, the +IPD data goes straight from the ring to the socket queues
+        at_processor.set_ipd_handler(&ESP8266Network::receive_ipd, this);
         at_processor.start_rx_dma();
-        // Echo AT commands off (default)
-        std::function<utils::ErrorCode()> echo_on_or_off = [this] { return echo_off(); };
-
-        // If we are debugging, enable command echo
-        if constexpr (debug) {
-            echo_on_or_off = [this] { return echo_on(); };
-        }
-
-        reset_pin->port->set_pins(reset_pin->pin_nro);
-        rtos->delay(reset_time); // Wait a bit so the ESP8266 has time to boot
 
-        // Enable the tx complete interrupt
+        // Enable the tx complete interrupt, before the reset so that the IDLE line interrupt wakes us up for "ready"
         usart->clear_tx_transfer_complete_flag();
         // TODO: Cast to TaskHandle_t (void* -> void* or struct ptr, depending on FreeRTOS config)
         set_network_task_handle_for_usart2_interrupts(static_cast<TaskHandle_t>(rtos->get_current_task_handle()));
         usart->clear_sr_tc_bit(); // Clear the TC bit before we enable the interrupt
         usart->tx_complete_interrupt(true);
 
-        while (test_msg() != utils::ErrorCode::OK || echo_on_or_off() != utils::ErrorCode::OK) {
-            reset();
+        // Back to the default rate of a freshly reset ESP8266, also wakes it up from deep sleep
+        baudrate = bluepill::NETWORK_BAUDRATE;
+        usart->set_baudrate(baudrate);
+        at_processor.set_baudrate(baudrate);
+        hard_reset();
+        radio.powered_up(rtos->get_time_ms());
+
+        wait_until_responsive();
+        negotiate_baudrate();
+        if (const auto res = set_multiplexed_mode(); res != utils::ErrorCode::OK) {
+            return res;
         }
 
+        // The radio stays at full power, whether it sleeps until the first window is up to the caller
         return connect_to_ap();
     }
 
     void disconnect_ap() const override
     {
         utils::logger.info("Disconnecting from AP...\n");
-        at_processor.send_raw(esp8266::commands::DISCONNECT_AP);
+        if (at_processor.send_raw(esp8266::commands::DISCONNECT_AP) != utils::ErrorCode::OK) {
+            utils::logger.error("Failed to send the AP disconnect!\n");
+        }
     }
 
     [[nodiscard]] utils::ErrorCode connect_to_ap() override
     {
         utils::logger.info("Connecting to AP...\n");
 
-        // Check if already connected
+        // Check if already connected, the ESP8266 joins the AP it has stored by itself after a reset. If it did so the
+        // last time, give it time to do that again rather than starting over with a slow join.
         auto res = at_processor.send_command(esp8266::commands::QUERY_AP_DEF, "+CWJAP_DEF:\"" WIFI_AP "\"");
+        for (unsigned int i = 0; warm_hint.ap_joined && res != utils::ErrorCode::OK && i < ap_rejoin_attempts; ++i) {
+            rtos->delay(ap_rejoin_poll_time);
+            res = at_processor.send_command(esp8266::commands::QUERY_AP_DEF, "+CWJAP_DEF:\"" WIFI_AP "\"");
+        }
         bool correct_ap_connected = res == utils::ErrorCode::OK;
 
         if (correct_ap_connected) {
@@ -100,6 +110,53 @@ public:
 
     [[nodiscard]] bool get_ap_connected() override { return ap_connected; }
 
+    [[nodiscard]] utils::ErrorCode wake_radio() override
+    {
+        if (radio.get_awake()) {
+            return utils::ErrorCode::OK;
+        }
+        const uint32_t start_ms = rtos->get_time_ms();
+        const auto res = set_sleep_mode(RadioSleepMode::NONE);
+        if (res == utils::ErrorCode::OK) {
+            const uint32_t now_ms = rtos->get_time_ms();
+            radio.woke(now_ms, now_ms - start_ms);
+        }
+        return res;
+    }
+
+    [[nodiscard]] utils::ErrorCode sleep_radio(uint32_t idle_ms) override
+    {
+        const auto mode = RadioPowerPolicy::choose(idle_ms);
+        if (!radio.get_awake() || (mode == RadioSleepMode::NONE)) {
+            return utils::ErrorCode::OK;
+        }
+        const auto res = set_sleep_mode(mode);
+        if (res == utils::ErrorCode::OK) {
+            radio.slept(rtos->get_time_ms());
+        }
+        return res;
+    }
+
+    [[nodiscard]] uint32_t get_radio_wake_latency_ms() const override { return radio.get_wake_latency_ms(); }
+    [[nodiscard]] uint32_t get_radio_on_ms() const override { return radio.get_on_ms(rtos->get_time_ms()); }
+
+    [[nodiscard]] utils::ErrorCode deep_sleep() override
+    {
+        utils::logger.info("Putting ESP8266 to deep sleep...\n");
+        // It sleeps until init() pulses the reset pin, nothing it had survives that
+        const auto res = at_processor.send_command(esp8266::commands::DEEP_SLEEP, "OK");
+        ap_connected = false;
+        socket_connections.fill(false);
+        radio.slept(rtos->get_time_ms());
+        return res;
+    }
+
+    [[nodiscard]] NetworkWarmHint get_warm_hint() const override
+    {
+        return { .baudrate = baudrate, .ap_joined = ap_connected };
+    }
+    void set_warm_hint(const NetworkWarmHint& hint) override { warm_hint = hint; }
+
     [[nodiscard]] utils::ErrorCode test_msg() const
     {
         utils::logger.info("Testing serial connection to ESP8266...\n");
@@ -112,6 +169,16 @@ public:
         return at_processor.send_command(esp8266::commands::ECHO_OFF, "OK");
     }
 
+    [[nodiscard]] utils::ErrorCode echo_on_or_off() const
+    {
+        // If we are debugging, enable command echo
+        if constexpr (debug) {
+            return echo_on();
+        }
+        // Echo AT commands off (default)
+        return echo_off();
+    }
+
     [[nodiscard]] utils::ErrorCode echo_on() const
     {
         utils::logger.info("Turning on AT command echo...\n");
@@ -121,55 +188,124 @@ public:
     [[nodiscard]] std::optional<unsigned int> connect_socket(
         SocketType type, std::string_view addr, std::string_view port) override
     {
-        std::optional<unsigned int> res = std::nullopt;
-        if (ap_connected && (connections < max_connections)) {
-            // Build command in a fixed-size rx_buffer to send in one DMA transaction
-            constexpr size_t max_cmd_size
-                = std::size(R"(AT+CIPSTART="UDP","255.255.255.255",65535)") + 2; // +2 for \r\n
-            char cmd[max_cmd_size];
-            const auto* type_str = (type == SocketType::UDP) ? "UDP" : "TCP";
-            std::snprintf(cmd, max_cmd_size, "AT+CIPSTART=\"%s\",\"%.*s\",%.*s\r\n", type_str,
-                static_cast<int>(addr.size()), addr.data(), static_cast<int>(port.size()), port.data());
-
-            if (at_processor.send_command(esp8266::ATCommand(std::string_view(cmd)), "OK") == utils::ErrorCode::OK) {
-                connections++;
-                unsigned int id = 0; // Only 1 connection at a time supported for now
-                socket_connections[id] = true;
-                res = id;
-            }
-
-            if ((at_processor.send_command(esp8266::commands::TRANSPARENT_MODE, "OK") != utils::ErrorCode::OK)
-                || (at_processor.send_command(esp8266::commands::START_SEND, "OK") != utils::ErrorCode::OK)) {
-                utils::logger.error("Failed to set ESP8266 to transparent mode!\n");
-                at_processor.send_raw(esp8266::commands::CLOSE_SOCKET);
-                res = std::nullopt;
-            }
+        update_closed_links();
+        if (!ap_connected) {
+            return std::nullopt;
         }
-        // Return socket id
-        return res;
+        const auto* free_link = std::ranges::find(socket_connections, false);
+        if (free_link == socket_connections.end()) {
+            utils::logger.error("No free ESP8266 links!\n");
+            return std::nullopt;
+        }
+        const auto id = static_cast<unsigned int>(free_link - socket_connections.begin());
+
+        // Build command in a fixed-size rx_buffer to send in one DMA transaction
+        constexpr size_t max_cmd_size
+            = std::size(R"(AT+CIPSTART=4,"UDP","255.255.255.255",65535)") + 2; // +2 for \r\n
+        char cmd[max_cmd_size];
+        const auto* type_str = (type == SocketType::UDP) ? "UDP" : "TCP";
+        std::snprintf(cmd, max_cmd_size, "AT+CIPSTART=%u,\"%s\",\"%.*s\",%.*s\r\n", id, type_str,
+            static_cast<int>(addr.size()), addr.data(), static_cast<int>(port.size()), port.data());
+
+        // <id>,CONNECT and then OK
+        if (at_processor.send_command(esp8266::ATCommand(std::string_view(cmd)), "OK", response_time)
+            != utils::ErrorCode::OK) {
+            return std::nullopt;
+        }
+        rx_queues[id].clear();
+        socket_connections[id] = true;
+        return id;
     }
 
     [[nodiscard]] utils::ErrorCode send_socket(unsigned int id, std::span<const std::byte> data) const override
     {
-        if (ap_connected && socket_connected(id)) {
-            at_processor.send_raw(data, 100);
+        const std::array<std::span<const std::byte>, 1> segments = { data };
+        return send_socket(id, segments);
+    }
+
+    [[nodiscard]] utils::ErrorCode send_socket(
+        unsigned int id, std::span<const std::span<const std::byte>> segments) const override
+    {
+        update_closed_links();
+        if (!ap_connected || !socket_connected(id)) {
+            return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
+        }
+
+        size_t size = 0;
+        for (const auto& segment : segments) {
+            size += segment.size();
+        }
+        if (size == 0) {
             return utils::ErrorCode::OK;
         }
+        if (size > max_send_size) {
+            return utils::ErrorCode::MEMORY_ERROR;
+        }
 
-        return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
+        // AT+CIPSEND=<id>,<length> -> wait for the > prompt -> data -> SEND OK
+        constexpr size_t max_cmd_size = std::size("AT+CIPSEND=4,2048") + 2; // +2 for \r\n
+        char cmd[max_cmd_size];
+        std::snprintf(cmd, max_cmd_size, "AT+CIPSEND=%u,%u\r\n", id, static_cast<unsigned int>(size));
+        if (at_processor.send_command(esp8266::ATCommand(std::string_view(cmd)), ">") != utils::ErrorCode::OK) {
+            utils::logger.error("ESP8266 link %u not ready for sending!\n", id);
+            return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
+        }
+        if (const auto res = at_processor.send_gather(segments, 100); res != utils::ErrorCode::OK) {
+            return res;
+        }
+        return at_processor.wait_response("SEND OK", response_time);
     }
 
     [[nodiscard]] utils::ErrorCode close_socket(unsigned int id) override
     {
+        update_closed_links();
         if (ap_connected && socket_connected(id)) {
-            at_processor.send_raw(esp8266::commands::CLOSE_SOCKET);
-            connections--;
-            socket_connections[id] = false;
-            return utils::ErrorCode::OK;
+            constexpr size_t max_cmd_size = std::size("AT+CIPCLOSE=4") + 2; // +2 for \r\n
+            char cmd[max_cmd_size];
+            std::snprintf(cmd, max_cmd_size, "AT+CIPCLOSE=%u\r\n", id);
+            const auto res = at_processor.send_command(esp8266::ATCommand(std::string_view(cmd)), "OK");
+            if (res == utils::ErrorCode::OK || at_processor.get_unlinked()) {
+                socket_connections[id] = false;
+                return utils::ErrorCode::OK;
+            }
+            // Without an answer the link may still be up, unless its <id>,CLOSED came in meanwhile
+            update_closed_links();
+            return res;
         }
         return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
     }
 
+    [[nodiscard]] std::optional<size_t> receive_socket(
+        unsigned int id, std::span<std::byte> buffer, unsigned int timeout_ms) override
+    {
+        if (id >= max_connections) {
+            return std::nullopt;
+        }
+        auto& queue = rx_queues[id];
+        // The IDLE line interrupt wakes us up when the ESP8266 has sent something
+        const uint32_t start_ms = rtos->get_time_ms();
+        while (true) {
+            at_processor.pump();
+            update_closed_links();
+            if (!queue.empty()) {
+                return queue.read(buffer);
+            }
+            if (!socket_connected(id)) {
+                return std::nullopt;
+            }
+            const uint32_t elapsed_ms = rtos->get_time_ms() - start_ms;
+            if ((elapsed_ms >= timeout_ms) || !rtos->task_notify_wait(timeout_ms - elapsed_ms)) {
+                return 0;
+            }
+        }
+    }
+
+    /// @brief Received bytes dropped because the reader of the socket fell behind
+    [[nodiscard]] uint32_t get_rx_dropped(unsigned int id) const
+    {
+        return (id < max_connections) ? rx_queues[id].get_dropped() : 0;
+    }
+
 private:
     const IDmaSerial* usart;
     const GPIOPin* reset_pin; // Reset when transitions from low -> high
@@ -178,26 +314,156 @@ private:
     static constexpr bool debug = true;
 
     constexpr static unsigned int response_time = 10'000;
-    constexpr static unsigned int reset_time = 10'000; // This thing is sometimes really slow to reset...
+    // Upper limit, it is up as soon as it says "ready". This thing is sometimes really slow to reset...
+    constexpr static unsigned int reset_time = 10'000;
     constexpr static unsigned int break_time = 5;
+    // Waiting for the stored AP to be joined again, a join from scratch takes several seconds
+    constexpr static unsigned int ap_rejoin_poll_time = 500;
+    constexpr static unsigned int ap_rejoin_attempts = 10;
 
     bool ap_connected = false;
-
-    static constexpr unsigned int max_connections = 1;
-    unsigned int connections = 0;
-    std::array<bool, max_connections> socket_connections = { false };
+    unsigned int baudrate = bluepill::NETWORK_BAUDRATE;
+    NetworkWarmHint warm_hint {};
+    RadioPowerPolicy radio;
+    constexpr static unsigned int baudrate_verify_attempts = 3;
+
+    // AT+CIPMUX=1 link ids 0-4
+    static constexpr unsigned int max_connections = esp8266::AtResponseParser::max_links;
+    static constexpr size_t max_send_size = 2048; // AT+CIPSEND limit
+    // Updated from the <id>,CLOSED messages when sending too
+    mutable std::array<bool, max_connections> socket_connections = {};
+    // Enough for the broker's acks, a bigger burst than this per link is dropped
+    static constexpr size_t rx_queue_size = 256;
+    std::array<SocketRxQueue<rx_queue_size>, max_connections> rx_queues {};
 
     AtCommandProcessor at_processor;
 
     bool socket_connected(unsigned int id) const { return (id < max_connections) && socket_connections[id]; }
 
+    // Called by the response parser for every contiguous piece of +IPD data in the RX ring
+    static void receive_ipd(void* context, unsigned int link_id, std::span<const volatile char> data)
+    {
+        auto* network = static_cast<ESP8266Network*>(context);
+        if (link_id < max_connections) {
+            (void)network->rx_queues[link_id].push(data);
+        }
+    }
+
+    // Forget the links the remote end has closed
+    void update_closed_links() const
+    {
+        const uint8_t closed = at_processor.take_closed_links();
+        for (unsigned int id = 0; id < max_connections; ++id) {
+            if ((closed & (1U << id)) != 0) {
+                utils::logger.info("ESP8266 link %u closed\n", id);
+                socket_connections[id] = false;
+            }
+        }
+    }
+
+    [[nodiscard]] utils::ErrorCode set_multiplexed_mode() const
+    {
+        // Multiple connections only work in the normal (not transparent) transfer mode
+        if ((at_processor.send_command(esp8266::commands::NORMAL_MODE, "OK") != utils::ErrorCode::OK)
+            || (at_processor.send_command(esp8266::commands::MULTIPLE_CONNECTIONS, "OK") != utils::ErrorCode::OK)) {
+            utils::logger.error("Failed to enable ESP8266 multiple connections!\n");
+            return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
+        }
+        return utils::ErrorCode::OK;
+    }
+
     void hard_reset() const
     {
         utils::logger.info("Hard resetting ESP8266...\n");
+        // A "ready" from before the reset mustn't end the wait
+        at_processor.pump();
         reset_pin->port->clear_pins(reset_pin->pin_nro);
         rtos->delay(100);
         reset_pin->port->set_pins(reset_pin->pin_nro);
-        rtos->delay(reset_time);
+        // The boot messages at 74880 baud come out as garbage before it. If "ready" gets lost in them, this is the old
+        // fixed delay, wait_until_responsive() finds out whether it's up either way.
+        if (at_processor.wait_response("ready", reset_time) == utils::ErrorCode::OK) {
+            utils::logger.info("ESP8266 ready\n");
+        }
+    }
+
+    void wait_until_responsive() const
+    {
+        while (test_msg() != utils::ErrorCode::OK || echo_on_or_off() != utils::ErrorCode::OK) {
+            reset();
+        }
+    }
+
+    [[nodiscard]] utils::ErrorCode set_uart_cur(unsigned int baudrate) const
+    {
+        // AT+UART_CUR=<baudrate>,<databits>,<stopbits>,<parity>,<flow control>, not stored to the ESP8266 flash
+        constexpr size_t max_cmd_size = std::size("AT+UART_CUR=4000000,8,1,0,0") + 2; // +2 for \r\n
+        char cmd[max_cmd_size];
+        // Flow control 3: RTS and CTS
+        const unsigned int flow_control = bluepill::NETWORK_FLOW_CONTROL ? 3 : 0;
+        std::snprintf(cmd, max_cmd_size, "AT+UART_CUR=%u,%u,1,0,%u\r\n", baudrate, bluepill::NETWORK_DATABITS,
+            flow_control);
+        return at_processor.send_command(esp8266::ATCommand(std::string_view(cmd)), "OK");
+    }
+
+    [[nodiscard]] utils::ErrorCode set_sleep_mode(RadioSleepMode mode) const
+    {
+        constexpr size_t max_cmd_size = std::size("AT+SLEEP=2") + 2; // +2 for \r\n
+        char cmd[max_cmd_size];
+        std::snprintf(cmd, max_cmd_size, "AT+SLEEP=%u\r\n", static_cast<unsigned int>(mode));
+        return at_processor.send_command(esp8266::ATCommand(std::string_view(cmd)), "OK");
+    }
+
+    // Escalate the link to the fastest baud rate both ends agree on
+    void negotiate_baudrate()
+    {
+        // Straight to what worked the last time, the faster ones failed then. Each failed candidate costs a reset.
+        const auto& candidates = bluepill::NETWORK_BAUDRATE_CANDIDATES;
+        const bool hint_known = (warm_hint.baudrate == bluepill::NETWORK_BAUDRATE)
+            || (std::ranges::find(candidates, warm_hint.baudrate) != candidates.end());
+        const unsigned int ceiling = hint_known ? warm_hint.baudrate : bluepill::NETWORK_MAX_BAUDRATE;
+        for (const auto candidate : candidates) {
+            if (candidate > bluepill::NETWORK_MAX_BAUDRATE || candidate > ceiling || candidate <= baudrate) {
+                continue;
+            }
+            if (try_baudrate(candidate)) {
+                baudrate = candidate;
+                break;
+            }
+        }
+        // Still at the default rate, the ESP8266 has to be told about the flow control anyway
+        if (bluepill::NETWORK_FLOW_CONTROL && (baudrate == bluepill::NETWORK_BAUDRATE)
+            && (set_uart_cur(baudrate) != utils::ErrorCode::OK)) {
+            utils::logger.error("Failed to enable ESP8266 flow control!\n");
+        }
+        utils::logger.info("ESP8266 link running at %u baud\n", baudrate);
+    }
+
+    [[nodiscard]] bool try_baudrate(unsigned int candidate)
+    {
+        utils::logger.info("Switching ESP8266 to %u baud...\n", candidate);
+        if (set_uart_cur(candidate) != utils::ErrorCode::OK) {
+            // The ESP8266 didn't accept it and stays at the current rate
+            return false;
+        }
+
+        // The OK still comes at the old rate, the ESP8266 switches right after it
+        rtos->delay(break_time);
+        usart->set_baudrate(candidate);
+        at_processor.set_baudrate(candidate);
+        for (unsigned int i = 0; i < baudrate_verify_attempts; ++i) {
+            if (test_msg() == utils::ErrorCode::OK) {
+                return true;
+            }
+        }
+
+        // Can't talk to it at the new rate, UART_CUR is not persistent -> reset brings it back to the default rate
+        utils::logger.error("No response at %u baud, falling back!\n", candidate);
+        usart->set_baudrate(bluepill::NETWORK_BAUDRATE);
+        at_processor.set_baudrate(bluepill::NETWORK_BAUDRATE);
+        hard_reset();
+        wait_until_responsive();
+        return false;
     }
 
     void reset() const
@@ -4,6 +4,7 @@
 
 #include "BlinkyLED.h"
 #include "FreeRTOSAdapter.h"
+#include "LowPower.h"
 #include "interfaces/II2C.h"
 #include "interfaces/ILED.h"
 #include "interfaces/INetwork.h"
@@ -21,7 +22,7 @@
 #include "System.h"
 #include "USART.h"
 
-inline std::unique_ptr<ITemperatureSensor> createTemperatureSensor()
+inline std::unique_ptr<ITemperatureSensor> createTemperatureSensor([[maybe_unused]] const IRTOS* rtos)
 {
 // Use higher level mocks when running firmware in QEMU
 // I can't be bothered to simulate the full behaviour of the BME280
@@ -29,7 +30,10 @@ inline std::unique_ptr<ITemperatureSensor> createTemperatureSensor()
 #ifdef QEMU_ENV
     return std::make_unique<MockTemperatureSensor>();
 #else // QEMU_ENV -> !QEMU_ENV
-    return std::make_unique<BME280TemperatureSensor>(&bluepill::peripherals::i2c1, BME280I2CBusAddr::SECONDARY);
+    // Let the I2C transfers sleep on the interrupts instead of polling
+    bluepill::peripherals::i2c1.set_rtos(rtos);
+    return std::make_unique<BME280TemperatureSensor>(
+        &bluepill::peripherals::i2c1, BME280I2CBusAddr::SECONDARY, rtos);
 #endif // QEMU_ENV
 }
 
@@ -45,4 +49,29 @@ inline std::unique_ptr<INetwork> createNetwork([[maybe_unused]] const IRTOS* rto
 #endif
 }
 
-inline std::unique_ptr<ILED> createLED() { return std::make_unique<BlinkyLED>(&bluepill::peripherals::led_pin); }
\ No newline at end of file
+inline std::unique_ptr<ILED> createLED() { return std::make_unique<BlinkyLED>(&bluepill::peripherals::led_pin); }
+
+#if CHILI_STATIC_ALLOCATION
+// The same devices constant initialized in static memory, nothing is constructed or allocated at boot
+namespace static_devices {
+inline constinit FreeRTOSAdapter rtos;
+#ifdef QEMU_ENV
+inline constinit MockTemperatureSensor temperature;
+inline constinit MockNetwork network;
+#else // QEMU_ENV -> !QEMU_ENV
+inline constinit BME280TemperatureSensor temperature(&bluepill::peripherals::i2c1, BME280I2CBusAddr::SECONDARY, &rtos);
+inline constinit ESP8266Network network(&bluepill::peripherals::usart2, &bluepill::peripherals::esp_reset_pin, &rtos);
+#endif // QEMU_ENV
+inline constinit BlinkyLED led(&bluepill::peripherals::led_pin);
+inline constinit bluepill::power::BackupRegisters backup;
+
+/// @brief The runtime part of the factories
+inline void setup()
+{
+#ifndef QEMU_ENV
+    // Let the I2C transfers sleep on the interrupts instead of polling
+    bluepill::peripherals::i2c1.set_rtos(&rtos);
+#endif // !QEMU_ENV
+}
+} // namespace static_devices
+#endif // CHILI_STATIC_ALLOCATION
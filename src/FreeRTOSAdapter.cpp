@@ -7,6 +7,8 @@ void FreeRTOSAdapter::delay(uint32_t ms) const { vTaskDelay(pdMS_TO_TICKS(ms));
 
 uint32_t FreeRTOSAdapter::get_tick_count() const { return xTaskGetTickCount(); }
 
+uint32_t FreeRTOSAdapter::get_time_ms() const { return xTaskGetTickCount() * portTICK_PERIOD_MS; }
+
 bool FreeRTOSAdapter::task_notify_wait(uint32_t timeout_ms) const
 {
     return xTaskNotifyWait(0, 0, nullptr, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
@@ -41,11 +41,23 @@
 
 #define configUSE_PREEMPTION 1
 #define configUSE_IDLE_HOOK 0
+/* Tickless idle with the Sleep/STOP portSUPPRESS_TICKS_AND_SLEEP of LowPower.cpp, 0 keeps the 1 kHz tick running.
+ * STOP needs CHILI_NETWORK_FLOW_CONTROL (System.h, default 0), the default build only ever reaches Sleep. */
+#ifndef CHILI_TICKLESS_IDLE
+#define CHILI_TICKLESS_IDLE 1
+#endif
+#if CHILI_TICKLESS_IDLE
+#define configUSE_TICKLESS_IDLE 2
+#define configEXPECTED_IDLE_TIME_BEFORE_SLEEP 2
+#else
+#define configUSE_TICKLESS_IDLE 0
+#endif
 #define configUSE_TICK_HOOK 0
 #define configCPU_CLOCK_HZ ((unsigned long)72000000)
 #define configTICK_RATE_HZ ((TickType_t)1000)
 #define configMAX_PRIORITIES (5)
 #define configMINIMAL_STACK_SIZE ((unsigned short)128)
+/* Not a reservation, heap_useNewlib_bluepill.c hands out whatever RAM is left between .bss and the ISR stack */
 #define configTOTAL_HEAP_SIZE ((size_t)(10 * 1024))
 #define configMAX_TASK_NAME_LEN (16)
 #define configUSE_TRACE_FACILITY 0
@@ -58,6 +70,15 @@
 #define configTIMER_QUEUE_LENGTH 4
 #define configTIMER_TASK_STACK_DEPTH 128
 
+/* Tasks, the queue and the device objects in static memory instead of the heap, see main.cpp. 0 allocates them at
+boot like before. */
+#ifndef CHILI_STATIC_ALLOCATION
+#define CHILI_STATIC_ALLOCATION 1
+#endif
+#define configSUPPORT_STATIC_ALLOCATION CHILI_STATIC_ALLOCATION
+/* newlib still mallocs for printf */
+#define configSUPPORT_DYNAMIC_ALLOCATION 1
+
 /* Co-routine definitions. */
 #define configUSE_CO_ROUTINES 0
 #define configMAX_CO_ROUTINE_PRIORITIES (2)
@@ -1,11 +1,25 @@
+#include <algorithm>
+#include <array>
+#include <numeric>
+
 #include <libopencm3/stm32/i2c.h>
 
 #include "I2C.h"
+#include "Logger.h"
+#include "LowPower.h"
+#include "System.h"
+#include "interrupts.h"
+
+namespace {
+constexpr uint32_t interrupt_enable_bits = I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_ITERREN;
+constexpr uint32_t error_bits = I2C_SR1_AF | I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_OVR | I2C_SR1_TIMEOUT;
+}
 
 void I2C::setup() const
 {
     I2C_CR1(i2c_dev) &= ~I2C_CR1_STOP; // Clear stop
-    i2c_set_speed(i2c_dev, i2c_speed_sm_100k, rcc_apb1_frequency / 1e6);
+    const auto bus_speed = (speed == I2CSpeed::FAST_400K) ? i2c_speed_fm_400k : i2c_speed_sm_100k;
+    i2c_set_speed(i2c_dev, bus_speed, rcc_apb1_frequency / 1'000'000);
     i2c_set_own_7bit_slave_address(i2c_dev, 0xff); // Why is this necessary???
 }
 
@@ -15,19 +29,295 @@ void I2C::disable() const { i2c_peripheral_disable(i2c_dev); }
 
 utils::ErrorCode I2C::write(uint8_t addr, std::span<const uint8_t> data) const
 {
-    i2c_transfer7(i2c_dev, addr, data.data(), data.size(), nullptr, 0);
+    const std::array<std::span<const uint8_t>, 1> segments = { data };
+    return transfer7(addr, segments, {});
+}
+
+utils::ErrorCode I2C::read(uint8_t addr, std::span<uint8_t> data) const { return transfer7(addr, {}, data); }
+
+utils::ErrorCode I2C::write(uint8_t addr, uint8_t data) const
+{
+    return write(addr, std::span<const uint8_t, 1>(&data, 1));
+}
+
+utils::ErrorCode I2C::read(uint8_t addr, uint8_t& data) const { return read(addr, std::span<uint8_t, 1>(&data, 1)); }
+
+utils::ErrorCode I2C::write_read(uint8_t addr, std::span<const uint8_t> tx, std::span<uint8_t> rx) const
+{
+    const std::array<std::span<const uint8_t>, 1> segments = { tx };
+    return transfer7(addr, segments, rx);
+}
+
+utils::ErrorCode I2C::write_gather(uint8_t addr, std::span<const std::span<const uint8_t>> segments) const
+{
+    return transfer7(addr, segments, {});
+}
+
+void I2C::set_speed(I2CSpeed new_speed) const
+{
+    // The clock control registers can only be written with the peripheral disabled
+    speed = new_speed;
+    disable();
+    setup();
+    enable();
+}
+
+utils::ErrorCode I2C::self_test(uint8_t addr) const
+{
+    if (rtos == nullptr) {
+        return utils::ErrorCode::OK;
+    }
+    while (true) {
+        const auto res = probe_timing(addr);
+        if (res == utils::ErrorCode::OK || speed == I2CSpeed::STANDARD_100K) {
+            return res;
+        }
+        utils::logger.error("I2C self-test failed at 400 kHz, falling back to 100 kHz\n");
+        set_speed(I2CSpeed::STANDARD_100K);
+    }
+}
+
+utils::ErrorCode I2C::probe_timing(uint8_t addr) const
+{
+    // START + address + ACK + STOP is ~11 SCL periods
+    const unsigned int bus_us = (speed == I2CSpeed::FAST_400K) ? 28 : 110;
+    const uint32_t max_cycles = ((2 * bus_us) + self_test_overhead_us) * bluepill::AHB_CLOCK_MHZ;
+    for (unsigned int i = 0; i < self_test_probes; ++i) {
+        if (const auto res = transfer7(addr, {}, {}); res != utils::ErrorCode::OK) {
+            return res;
+        }
+        // However late the task got to run again, that isn't the bus
+        if (transfer.end_cycles - transfer.start_cycles > max_cycles) {
+            // Slow edges or clock stretching, the bus doesn't really run at this speed
+            return utils::ErrorCode::I2C_TIMEOUT_ERROR;
+        }
+    }
     return utils::ErrorCode::OK;
 }
 
-utils::ErrorCode I2C::read(uint8_t addr, std::span<uint8_t> data) const
+utils::ErrorCode I2C::transfer7(
+    uint8_t addr, std::span<const std::span<const uint8_t>> tx, std::span<uint8_t> rx) const
 {
-    i2c_transfer7(i2c_dev, addr, nullptr, 0, data.data(), data.size());
+    if (rtos == nullptr) {
+        return polling_transfer7(addr, tx, rx);
+    }
+
+    const size_t tx_size = std::accumulate(
+        tx.begin(), tx.end(), size_t { 0 }, [](size_t sum, const auto& segment) { return sum + segment.size(); });
+    transfer = Transfer { .addr = addr,
+        .tx = tx,
+        .rx = rx,
+        .segment = 0,
+        .index = 0,
+        .reading = tx_size == 0 && !rx.empty(),
+        .result = utils::ErrorCode::OK };
+    // The transfer would freeze halfway with the peripheral clock stopped
+    const bluepill::power::StopModeInhibitor stay_awake;
+    set_task_handle_for_i2c1_interrupts(static_cast<TaskHandle_t>(rtos->get_current_task_handle()));
+    state = State::START;
+    I2C_CR2(i2c_dev) |= interrupt_enable_bits;
+    transfer.start_cycles = bluepill::cycle_count();
+    i2c_send_start(i2c_dev);
+
+    const uint32_t timeout_ms = timeout_base_ms + ((tx_size + rx.size()) / timeout_bytes_per_ms);
+    const uint32_t start_ms = rtos->get_time_ms();
+    while (state != State::DONE) {
+        const uint32_t elapsed_ms = rtos->get_time_ms() - start_ms;
+        if (elapsed_ms >= timeout_ms) {
+            abort();
+            return utils::ErrorCode::I2C_TIMEOUT_ERROR;
+        }
+        // Other notifications wake us up too, the state tells when the transfer is really over
+        (void)rtos->task_notify_wait(timeout_ms - elapsed_ms);
+    }
+    state = State::IDLE;
+    return transfer.result;
+}
+
+utils::ErrorCode I2C::polling_transfer7(
+    uint8_t addr, std::span<const std::span<const uint8_t>> tx, std::span<uint8_t> rx) const
+{
+    std::span<const uint8_t> data {};
+    std::array<uint8_t, max_polling_gather_size> gathered {};
+    if (tx.size() == 1) {
+        data = tx.front();
+    } else if (tx.size() > 1) {
+        size_t size = 0;
+        for (const auto& segment : tx) {
+            if (segment.size() > gathered.size() - size) {
+                return utils::ErrorCode::MEMORY_ERROR;
+            }
+            std::ranges::copy(segment, gathered.begin() + size);
+            size += segment.size();
+        }
+        data = std::span<const uint8_t>(gathered.data(), size);
+    }
+    // libopencm3 does the write, repeated start and read of a combined transfer too
+    i2c_transfer7(i2c_dev, addr, data.data(), data.size(), rx.data(), rx.size());
     return utils::ErrorCode::OK;
 }
 
-utils::ErrorCode I2C::write(uint8_t addr, uint8_t data) const
+bool I2C::event_isr() const
 {
-    return write(addr, std::span<const uint8_t, 1>(&data, 1));
+    const uint32_t sr1 = I2C_SR1(i2c_dev);
+    switch (state.load()) {
+    case State::START:
+        if ((sr1 & I2C_SR1_SB) != 0) {
+            // Reading SR1 followed by writing DR clears SB
+            I2C_DR(i2c_dev) = static_cast<uint8_t>((transfer.addr << 1) | (transfer.reading ? 1 : 0));
+            state = State::ADDRESS;
+        }
+        return false;
+    case State::ADDRESS:
+        if ((sr1 & I2C_SR1_ADDR) == 0) {
+            return false;
+        }
+        if (transfer.reading) {
+            start_read();
+            return false;
+        }
+        (void)I2C_SR2(i2c_dev); // Reading SR1 followed by SR2 clears ADDR
+        state = State::WRITE;
+        if (!tx_pending()) {
+            // Only the address, e.g. probing for a device
+            i2c_send_stop(i2c_dev);
+            finish(utils::ErrorCode::OK);
+            return true;
+        }
+        return false;
+    case State::WRITE:
+        if (tx_pending()) {
+            if ((sr1 & I2C_SR1_TxE) != 0) {
+                I2C_DR(i2c_dev) = transfer.tx[transfer.segment][transfer.index++];
+                if (!tx_pending()) {
+                    // The last byte is out when BTF is set, stop the TXE interrupts meanwhile
+                    I2C_CR2(i2c_dev) &= ~I2C_CR2_ITBUFEN;
+                }
+            }
+            return false;
+        }
+        if ((sr1 & I2C_SR1_BTF) == 0) {
+            return false;
+        }
+        if (!transfer.rx.empty()) {
+            // Repeated start, the read follows the write
+            transfer.reading = true;
+            state = State::START;
+            I2C_CR2(i2c_dev) |= I2C_CR2_ITBUFEN;
+            i2c_send_start(i2c_dev);
+            return false;
+        }
+        i2c_send_stop(i2c_dev);
+        finish(utils::ErrorCode::OK);
+        return true;
+    case State::READ:
+        read_isr(sr1);
+        return state == State::DONE;
+    default:
+        // Nothing running, e.g. a late event after a timeout
+        return false;
+    }
+}
+
+bool I2C::error_isr() const
+{
+    const uint32_t errors = I2C_SR1(i2c_dev) & error_bits;
+    I2C_SR1(i2c_dev) &= ~errors;
+    const State current = state.load();
+    if (errors == 0 || current == State::IDLE || current == State::DONE) {
+        return false;
+    }
+    if ((errors & I2C_SR1_ARLO) == 0) {
+        // Still the bus master, release the bus. Lost arbitration already made us a slave.
+        i2c_send_stop(i2c_dev);
+    }
+    finish(((errors & I2C_SR1_AF) != 0) ? utils::ErrorCode::I2C_NACK_ERROR : utils::ErrorCode::I2C_BUS_ERROR);
+    return true;
+}
+
+// Steps over finished and empty segments
+// @return false when everything has been written
+bool I2C::tx_pending() const
+{
+    while (transfer.segment < transfer.tx.size() && transfer.index == transfer.tx[transfer.segment].size()) {
+        ++transfer.segment;
+        transfer.index = 0;
+    }
+    return transfer.segment < transfer.tx.size();
+}
+
+// The end of a read depends on its length, see RM0008 26.3.3 "Master receiver"
+// The ACK and STOP of the last byte must be set up before the hardware starts receiving it.
+void I2C::start_read() const
+{
+    const size_t length = transfer.rx.size();
+    transfer.index = 0;
+    state = State::READ;
+    if (length == 1) {
+        i2c_disable_ack(i2c_dev);
+        (void)I2C_SR2(i2c_dev); // Clears ADDR
+        i2c_send_stop(i2c_dev);
+    } else if (length == 2) {
+        // NACK the byte after the next one, both end up in DR and the shift register -> BTF
+        I2C_CR1(i2c_dev) |= I2C_CR1_POS;
+        i2c_disable_ack(i2c_dev);
+        (void)I2C_SR2(i2c_dev);
+        I2C_CR2(i2c_dev) &= ~I2C_CR2_ITBUFEN;
+    } else {
+        i2c_enable_ack(i2c_dev);
+        (void)I2C_SR2(i2c_dev);
+        if (length == 3) {
+            I2C_CR2(i2c_dev) &= ~I2C_CR2_ITBUFEN;
+        }
+    }
+}
+
+void I2C::read_isr(uint32_t sr1) const
+{
+    const size_t remaining = transfer.rx.size() - transfer.index;
+    if (remaining > 3) {
+        if ((sr1 & I2C_SR1_RxNE) != 0) {
+            transfer.rx[transfer.index++] = I2C_DR(i2c_dev);
+            if (remaining == 4) {
+                // The last three bytes are handled on BTF
+                I2C_CR2(i2c_dev) &= ~I2C_CR2_ITBUFEN;
+            }
+        }
+    } else if (remaining == 3) {
+        if ((sr1 & I2C_SR1_BTF) != 0) {
+            // N-2 in DR, N-1 in the shift register -> NACK N
+            i2c_disable_ack(i2c_dev);
+            transfer.rx[transfer.index++] = I2C_DR(i2c_dev);
+        }
+    } else if (remaining == 2) {
+        if ((sr1 & I2C_SR1_BTF) != 0) {
+            // N-1 in DR, N in the shift register
+            i2c_send_stop(i2c_dev);
+            transfer.rx[transfer.index++] = I2C_DR(i2c_dev);
+            transfer.rx[transfer.index++] = I2C_DR(i2c_dev);
+            finish(utils::ErrorCode::OK);
+        }
+    } else if ((sr1 & I2C_SR1_RxNE) != 0) {
+        transfer.rx[transfer.index++] = I2C_DR(i2c_dev);
+        finish(utils::ErrorCode::OK);
+    }
+}
+
+void I2C::finish(utils::ErrorCode result) const
+{
+    transfer.end_cycles = bluepill::cycle_count();
+    I2C_CR2(i2c_dev) &= ~interrupt_enable_bits;
+    I2C_CR1(i2c_dev) &= ~I2C_CR1_POS;
+    transfer.result = result;
+    state = State::DONE;
 }
 
-utils::ErrorCode I2C::read(uint8_t addr, uint8_t& data) const { return read(addr, std::span<uint8_t, 1>(&data, 1)); }
\ No newline at end of file
+void I2C::abort() const
+{
+    I2C_CR2(i2c_dev) &= ~interrupt_enable_bits;
+    state = State::IDLE;
+    // Whatever the peripheral or the bus got stuck in, start over from a clean peripheral
+    reset_pulse();
+    setup();
+    enable();
+}
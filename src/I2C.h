@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <span>
 
@@ -8,27 +9,97 @@
 
 #include "Peripheral.h"
 #include "interfaces/II2C.h"
+#include "interfaces/IRTOS.h"
 #include "utils.h"
 
 class Logger;
 
 enum class BluePillI2C : unsigned int { _1 = I2C1, _2 = I2C2 };
+// The STM32F1 has no I2C high-speed mode, Fast mode is the limit
+enum class I2CSpeed : uint8_t { STANDARD_100K, FAST_400K };
 
+/// @brief Interrupt driven I2C master
+///
+/// A transfer is started from the task, then the event interrupt walks it through the address and data phases and
+/// the error interrupt ends it on a NACK or a bus error. The calling task sleeps on its task notification meanwhile and
+/// gives up after a timeout that grows with the transfer size, resetting the peripheral so that a stuck bus doesn't
+/// hang the caller. No DMA as DMA1 channels 6 and 7 are taken by USART2.
+/// Without an RTOS, e.g. before the scheduler runs, the polling libopencm3 transfer is used instead.
 class I2C final : public Peripheral, public II2C {
 public:
-    constexpr I2C(BluePillI2C i2c_dev, rcc_periph_clken clken, rcc_periph_rst rst) noexcept
+    // Without an RTOS the segments of write_gather are copied together for the polling transfer
+    static constexpr size_t max_polling_gather_size = 32;
+    // Address-only probes of the self-test, each one has to finish within twice the bus time + the interrupt overhead.
+    // Only the bus phase is timed, from the START to the interrupt that ends it, not waking up the task afterwards.
+    static constexpr unsigned int self_test_probes = 8;
+    static constexpr unsigned int self_test_overhead_us = 20;
+    // Transfer timeout = base + bytes / rate, 100 kHz moves ~11 bytes per ms, leave room for clock stretching
+    static constexpr unsigned int timeout_base_ms = 5;
+    static constexpr unsigned int timeout_bytes_per_ms = 5;
+
+    constexpr I2C(BluePillI2C i2c_dev, rcc_periph_clken clken, rcc_periph_rst rst,
+        I2CSpeed speed = I2CSpeed::STANDARD_100K) noexcept
         : Peripheral(clken, rst)
         , i2c_dev(static_cast<unsigned int>(i2c_dev))
+        , speed(speed)
     {
     }
     void disable() const override;
     void enable() const override;
     void setup() const;
+    /// @brief Transfers wait for the interrupts with this from now on, nullptr goes back to polling
+    void set_rtos(const IRTOS* rtos_ptr) { rtos = rtos_ptr; }
     [[nodiscard]] utils::ErrorCode read(uint8_t addr, std::span<uint8_t> data) const override;
     [[nodiscard]] utils::ErrorCode write(uint8_t addr, std::span<const uint8_t> data) const override;
+    [[nodiscard]] utils::ErrorCode write_read(
+        uint8_t addr, std::span<const uint8_t> tx, std::span<uint8_t> rx) const override;
+    [[nodiscard]] utils::ErrorCode write_gather(
+        uint8_t addr, std::span<const std::span<const uint8_t>> segments) const override;
+    /// @brief Probes the device at the configured speed, on failure drops to 100 kHz and tries again
+    /// Needs the RTOS, without it the speed is trusted as is.
+    [[nodiscard]] utils::ErrorCode self_test(uint8_t addr) const override;
+    [[nodiscard]] I2CSpeed get_speed() const { return speed; }
+    void set_speed(I2CSpeed new_speed) const;
     utils::ErrorCode read(uint8_t addr, uint8_t& data) const;
     [[nodiscard]] utils::ErrorCode write(uint8_t addr, uint8_t data) const;
 
+    // Call from the I2C1 event and error interrupts
+    // @return true if the transfer ended and the waiting task should be notified
+    bool event_isr() const;
+    bool error_isr() const;
+
 private:
+    enum class State : uint8_t { IDLE, START, ADDRESS, WRITE, READ, DONE };
+
+    struct Transfer {
+        uint8_t addr = 0;
+        std::span<const std::span<const uint8_t>> tx {};
+        std::span<uint8_t> rx {};
+        size_t segment = 0;
+        size_t index = 0;
+        bool reading = false;
+        utils::ErrorCode result = utils::ErrorCode::OK;
+        // Cycle counts at the START and in the interrupt that finished the transfer
+        uint32_t start_cycles = 0;
+        uint32_t end_cycles = 0;
+    };
+
     unsigned int i2c_dev;
-};
\ No newline at end of file
+    // Lowered by the self-test if the bus can't keep up
+    mutable I2CSpeed speed;
+    const IRTOS* rtos = nullptr;
+    // Written by the task only while no transfer is running, after that only the interrupts touch it until DONE
+    mutable Transfer transfer;
+    mutable std::atomic<State> state = State::IDLE;
+
+    [[nodiscard]] utils::ErrorCode transfer7(
+        uint8_t addr, std::span<const std::span<const uint8_t>> tx, std::span<uint8_t> rx) const;
+    [[nodiscard]] utils::ErrorCode polling_transfer7(
+        uint8_t addr, std::span<const std::span<const uint8_t>> tx, std::span<uint8_t> rx) const;
+    [[nodiscard]] bool tx_pending() const;
+    [[nodiscard]] utils::ErrorCode probe_timing(uint8_t addr) const;
+    void start_read() const;
+    void read_isr(uint32_t sr1) const;
+    void finish(utils::ErrorCode result) const;
+    void abort() const;
+};
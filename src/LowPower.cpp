@@ -0,0 +1,246 @@
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include "LowPower.h"
+
+#include <array>
+
+#if configUSE_TICKLESS_IDLE
+#include <algorithm>
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/bkp.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/rtc.h>
+
+#include "GPIO.h"
+#include "System.h"
+#include "USART.h"
+#endif // configUSE_TICKLESS_IDLE
+
+namespace bluepill::power {
+
+#if configUSE_TICKLESS_IDLE && !defined(QEMU_ENV)
+namespace {
+    SleepClock sleep_clock;
+    bool standby_wake = false;
+    constexpr size_t calibration_register = BACKUP_REGISTER_COUNT - 1;
+
+    // Two characters at the slowest baud rate, time for the ESP8266 to notice RTS and finish its current byte
+    constexpr uint32_t rts_settle_cycles = AHB_CLOCK_MHZ * 2 * 10 * 1'000'000 / NETWORK_BAUDRATE;
+
+    bool stop_mode_possible(TickType_t expected_idle_ticks)
+    {
+        // Without flow control the ESP8266 could start talking while USART2 has no clock and the bytes are lost
+        return NETWORK_FLOW_CONTROL && expected_idle_ticks * portTICK_PERIOD_MS >= STOP_MIN_IDLE_MS
+            && !StopModeInhibitor::any() && !peripherals::usart2.get_tx_busy();
+    }
+
+    // Holds the ESP8266 back with RTS, the USART can't drive it while stopped
+    // @return false if it sent something meanwhile -> stay awake for the network task
+    bool hold_network()
+    {
+        const unsigned int dma_count = peripherals::usart2.get_dma_count();
+        peripherals::gpio_a.set_pins(NETWORK_RTS_PIN_NRO);
+        peripherals::gpio_a.setup_pins(
+            NETWORK_RTS_PIN_NRO, GPIOMode::OUTPUT_50_MHZ, GPIOFunction::OUTPUT_PUSHPULL);
+        const uint32_t start = cycle_count();
+        while (cycle_count() - start < rts_settle_cycles) { }
+        return peripherals::usart2.get_dma_count() == dma_count;
+    }
+
+    void release_network()
+    {
+        peripherals::gpio_a.setup_pins(
+            NETWORK_RTS_PIN_NRO, GPIOMode::OUTPUT_50_MHZ, GPIOFunction::OUTPUT_ALTFN_PUSHPULL);
+    }
+
+    // The LSI is only good to +-50 %, time its counts with the cycle counter that runs from the HSE crystal
+    uint32_t measure_counter_hz()
+    {
+        const uint32_t first = rtc_get_counter_val();
+        while (rtc_get_counter_val() == first) { }
+        const uint32_t start = cycle_count();
+        while (rtc_get_counter_val() - first <= RTC_CALIBRATION_COUNTS) { }
+        return SleepClock::calibrated_hz(RTC_CALIBRATION_COUNTS, cycle_count() - start, AHB_CLOCK_MHZ * 1'000'000);
+    }
+
+    void wait_rtc_sync()
+    {
+        // The APB1 side of the RTC registers is stale after the clocks were stopped
+        RTC_CRL &= ~RTC_CRL_RSF;
+        while ((RTC_CRL & RTC_CRL_RSF) == 0) { }
+    }
+
+    // 16 bits in the low half of each word
+    volatile uint32_t& backup_register(size_t index) { return MMIO32(BACKUP_REGS_BASE + 0x04 + 4 * index); }
+}
+
+uint16_t BackupRegisters::read(size_t index) const
+{
+    return (index < size()) ? static_cast<uint16_t>(backup_register(index)) : 0;
+}
+
+void BackupRegisters::write(size_t index, uint16_t value) const
+{
+    if (index < size()) {
+        backup_register(index) = value;
+    }
+}
+
+void setup()
+{
+    // The RTC keeps running through resets and is only configured after a power loss, but every reset turns the LSI off
+    rcc_osc_on(RCC_LSI);
+    rcc_wait_for_osc_ready(RCC_LSI);
+    rtc_auto_awake(RCC_LSI, RTC_PRESCALER - 1);
+    // The RTC enabled the PWR clock and the writes to the backup domain
+    standby_wake = (PWR_CSR & PWR_CSR_SBF) != 0;
+    pwr_clear_standby_flag();
+
+    // Measuring the LSI on every wake-up from Standby would cost more than it sleeps, the duty cycle calls
+    // recalibrate() when it publishes instead
+    const auto stored_hz = static_cast<uint16_t>(backup_register(calibration_register));
+    if (standby_wake && stored_hz != 0) {
+        sleep_clock.set_counter_hz(stored_hz);
+    } else {
+        sleep_clock.set_counter_hz(measure_counter_hz());
+        backup_register(calibration_register) = sleep_clock.get_counter_hz();
+    }
+    rtc_clear_flag(RTC_ALR);
+    rtc_interrupt_enable(RTC_ALR);
+    // The alarm reaches the NVIC through EXTI line 17, which is also what wakes up from STOP
+    exti_set_trigger(EXTI17, EXTI_TRIGGER_RISING);
+    exti_enable_request(EXTI17);
+    nvic_enable_irq(NVIC_RTC_ALARM_IRQ);
+}
+
+void recalibrate()
+{
+    // Preempted, the cycle count would include the other task
+    vTaskSuspendAll();
+    const uint32_t hz = measure_counter_hz();
+    // Rescaled to the new rate, get_time_ms() carries on from where it is instead of jumping
+    const uint32_t now_ms = get_time_ms();
+    rtc_set_counter_val(static_cast<uint32_t>(static_cast<uint64_t>(now_ms) * hz / 1000));
+    sleep_clock.set_counter_hz(hz);
+    backup_register(calibration_register) = hz;
+    (void)xTaskResumeAll();
+}
+
+bool woke_from_standby() { return standby_wake; }
+
+uint32_t get_time_ms()
+{
+    return static_cast<uint32_t>(static_cast<uint64_t>(rtc_get_counter_val()) * 1000 / sleep_clock.get_counter_hz());
+}
+
+void enter_standby(uint32_t sleep_ms)
+{
+    cm_disable_interrupts();
+    // A flag left over from before would end the Standby right away. Cleared before the alarm is set, a close alarm
+    // could fire in between and its flag would be cleared with the old one.
+    rtc_clear_flag(RTC_ALR);
+    exti_reset_request(EXTI17);
+    pwr_clear_wakeup_flag();
+    rtc_set_alarm_time(rtc_get_counter_val() + sleep_clock.alarm_counts(sleep_ms));
+    pwr_set_standby_mode();
+    SCB_SCR |= SCB_SCR_SLEEPDEEP;
+    while (true) {
+        __asm__ volatile("dsb\n wfi" ::: "memory");
+    }
+}
+#else // configUSE_TICKLESS_IDLE && !QEMU_ENV -> the tick keeps running
+namespace {
+    std::array<uint16_t, BACKUP_REGISTER_COUNT - 1> ram_registers {};
+}
+
+uint16_t BackupRegisters::read(size_t index) const { return (index < size()) ? ram_registers[index] : 0; }
+
+void BackupRegisters::write(size_t index, uint16_t value) const
+{
+    if (index < size()) {
+        ram_registers[index] = value;
+    }
+}
+
+void setup() { }
+
+void recalibrate() { }
+
+bool woke_from_standby() { return false; }
+
+uint32_t get_time_ms() { return xTaskGetTickCount() * portTICK_PERIOD_MS; }
+
+void enter_standby(uint32_t sleep_ms) { vTaskDelay(pdMS_TO_TICKS(sleep_ms)); }
+#endif // configUSE_TICKLESS_IDLE && !QEMU_ENV
+
+}; // namespace bluepill::power
+
+#if configUSE_TICKLESS_IDLE
+/// @brief portSUPPRESS_TICKS_AND_SLEEP, called by the idle task with the scheduler suspended
+/// Stops the SysTick, sleeps until the RTC alarm at the next task deadline or any interrupt, then steps the tick count
+/// by the time the RTC says has passed. Sleep mode keeps the peripherals running, USART2 and its DMA keep receiving
+/// and wake the CPU. STOP also stops the peripheral clocks and needs RTS to hold the ESP8266 back.
+extern "C" void vPortSuppressTicksAndSleep(TickType_t expected_idle_ticks)
+{
+#ifdef QEMU_ENV
+    // No RTC to wake up with, keep ticking
+    (void)expected_idle_ticks;
+#else // QEMU_ENV -> !QEMU_ENV
+    using namespace bluepill;
+    using namespace bluepill::power;
+
+    cm_disable_interrupts();
+    __asm__ volatile("dsb\n isb" ::: "memory");
+    if (eTaskConfirmSleepModeStatus() == eAbortSleep) {
+        cm_enable_interrupts();
+        return;
+    }
+
+    systick_counter_disable();
+    const uint32_t start_counts = rtc_get_counter_val();
+    // The tick that was running is lost, the RTC is only accurate to its counts anyway
+    rtc_set_alarm_time(start_counts + sleep_clock.alarm_counts(expected_idle_ticks * portTICK_PERIOD_MS));
+
+    bool stop = stop_mode_possible(expected_idle_ticks);
+    if (stop && !hold_network()) {
+        release_network();
+        stop = false;
+    }
+    if (stop) {
+        pwr_set_stop_mode();
+        pwr_voltage_regulator_low_power_in_stop();
+        SCB_SCR |= SCB_SCR_SLEEPDEEP;
+    }
+    __asm__ volatile("dsb\n wfi\n isb" ::: "memory");
+    if (stop) {
+        SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+        // STOP leaves us running from the 8 MHz HSI
+        rcc_clock_setup_pll(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
+        release_network();
+        wait_rtc_sync();
+    }
+
+    // Let the interrupt that woke us up run before the tick count is corrected
+    cm_enable_interrupts();
+    __asm__ volatile("dsb\n isb" ::: "memory");
+    cm_disable_interrupts();
+
+    const uint32_t slept_ms = sleep_clock.counts_to_ms(rtc_get_counter_val() - start_counts);
+    const TickType_t slept_ticks = std::min<TickType_t>(slept_ms / portTICK_PERIOD_MS, expected_idle_ticks);
+    vTaskStepTick(slept_ticks);
+
+    // A tick that became pending before the SysTick was stopped has been accounted for by the RTC
+    SCB_ICSR = SCB_ICSR_PENDSTCLR;
+    STK_CVR = 0;
+    systick_counter_enable();
+    cm_enable_interrupts();
+#endif // QEMU_ENV
+}
+#endif // configUSE_TICKLESS_IDLE
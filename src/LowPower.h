@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "interfaces/IBackupRegisters.h"
+
+namespace bluepill::power {
+
+// The RTC runs from the ~40 kHz LSI and keeps counting in Sleep and STOP. Not from the LSE crystal, its OSC32_OUT pin
+// PC15 is the ESP8266 reset.
+constexpr uint32_t RTC_CLOCK_HZ = 40'000;
+constexpr uint32_t RTC_PRESCALER = 40;
+// Nominally 1 kHz, but the LSI is anything from 30 to 60 kHz
+constexpr uint32_t RTC_COUNTER_HZ = RTC_CLOCK_HZ / RTC_PRESCALER;
+// RTC counts timed against the HSE at boot and by recalibrate()
+constexpr uint32_t RTC_CALIBRATION_COUNTS = 64;
+// The LSI drifts by a few percent with temperature and supply voltage, the rate measured at boot doesn't stay right
+constexpr uint32_t RTC_RECALIBRATION_PERIOD_MS = 600'000;
+// Backup registers DR1...DR10, the last one keeps the measured LSI rate over Standby
+constexpr size_t BACKUP_REGISTER_COUNT = 10;
+// Restarting HSE and PLL after STOP costs ~2 ms, shorter idle periods only Sleep
+constexpr uint32_t STOP_MIN_IDLE_MS = 50;
+// The alarm only fires when the counter equals it. The counter may step once while the alarm is written, an alarm
+// that is already behind it would only fire after the 32-bit counter wraps, ~49 days later.
+constexpr uint32_t RTC_MIN_ALARM_COUNTS = 2;
+
+/// @return the time from now_ms until the next multiple of period_ms after start_ms, a late wake-up skips the periods
+/// it missed rather than wanting the next one right away
+[[nodiscard]] constexpr uint32_t until_next_period_ms(uint32_t start_ms, uint32_t now_ms, uint32_t period_ms)
+{
+    const uint32_t elapsed_ms = now_ms - start_ms;
+    return period_ms - (elapsed_ms % period_ms);
+}
+
+/// @brief Converts between RTC counts and milliseconds
+/// The RTC counts at the measured rate of the LSI, the remainder of every conversion is carried over so that the tick
+/// count doesn't drift over many short sleeps.
+class SleepClock {
+public:
+    constexpr explicit SleepClock(uint32_t counter_hz = RTC_COUNTER_HZ)
+        : counter_hz(counter_hz)
+    {
+    }
+
+    /// @return the counter rate from how many CPU cycles took how many RTC counts
+    [[nodiscard]] static constexpr uint32_t calibrated_hz(uint32_t counts, uint32_t cycles, uint32_t cpu_hz)
+    {
+        return static_cast<uint32_t>((static_cast<uint64_t>(counts) * cpu_hz + cycles / 2) / cycles);
+    }
+
+    void set_counter_hz(uint32_t hz)
+    {
+        counter_hz = hz;
+        remainder = 0;
+    }
+    [[nodiscard]] constexpr uint32_t get_counter_hz() const { return counter_hz; }
+
+    /// @return the RTC counts to wait for at least ms
+    [[nodiscard]] constexpr uint32_t ms_to_counts(uint32_t ms) const
+    {
+        return static_cast<uint32_t>((static_cast<uint64_t>(ms) * counter_hz + 999) / 1000);
+    }
+
+    /// @return the counts from now to set the alarm to for a sleep of ms, never so few that the alarm could be missed
+    [[nodiscard]] constexpr uint32_t alarm_counts(uint32_t ms) const
+    {
+        const uint32_t counts = ms_to_counts(ms);
+        return (counts < RTC_MIN_ALARM_COUNTS) ? RTC_MIN_ALARM_COUNTS : counts;
+    }
+
+    /// @return whole milliseconds of counts and what was left over from the previous calls
+    [[nodiscard]] constexpr uint32_t counts_to_ms(uint32_t counts)
+    {
+        const uint64_t scaled = static_cast<uint64_t>(counts) * 1000 + remainder;
+        remainder = static_cast<uint32_t>(scaled % counter_hz);
+        return static_cast<uint32_t>(scaled / counter_hz);
+    }
+
+private:
+    uint32_t counter_hz;
+    uint32_t remainder = 0;
+};
+
+/// @brief Keeps the MCU out of STOP while alive, e.g. during a transfer that stalls when the peripheral clocks stop
+/// Sleep mode keeps all clocks running and is always fine.
+class StopModeInhibitor {
+public:
+    StopModeInhibitor() { ++count; }
+    ~StopModeInhibitor() { --count; }
+    StopModeInhibitor(const StopModeInhibitor&) = delete;
+    StopModeInhibitor& operator=(const StopModeInhibitor&) = delete;
+
+    [[nodiscard]] static bool any() { return count.load() != 0; }
+
+private:
+    static inline std::atomic_uint32_t count = 0;
+};
+
+/// @brief The backup registers left for the application, plain RAM without CHILI_TICKLESS_IDLE and in QEMU
+class BackupRegisters final : public IBackupRegisters {
+public:
+    [[nodiscard]] size_t size() const override { return BACKUP_REGISTER_COUNT - 1; }
+    [[nodiscard]] uint16_t read(size_t index) const override;
+    void write(size_t index, uint16_t value) const override;
+};
+
+/// @brief Starts the RTC for the tickless idle and Standby, no-op without CHILI_TICKLESS_IDLE
+void setup();
+
+/// @brief Measures the LSI again, busy for RTC_CALIBRATION_COUNTS counts (~64 ms) with the scheduler suspended
+/// No-op without CHILI_TICKLESS_IDLE.
+void recalibrate();
+
+/// @return true if this boot is a wake-up from Standby rather than a power-on or a reset
+[[nodiscard]] bool woke_from_standby();
+
+/// @return the RTC time, it keeps counting through Standby and resets
+[[nodiscard]] uint32_t get_time_ms();
+
+/// @brief Standby for sleep_ms, waking up from it is a reset
+/// Without the RTC, e.g. in QEMU, it waits that long and returns.
+void enter_standby(uint32_t sleep_ms);
+
+}; // namespace bluepill::power
@@ -1,48 +1,377 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <optional>
 #include <span>
 #include <string_view>
 
 #include "interfaces/INetwork.h"
+#include "interfaces/IRTOS.h"
 #include "libs/SimpleMQTT/SimpleMQTT.h"
 
 class MQTTClient {
 public:
-    explicit MQTTClient(INetwork& network)
+    // Upper limit of the QoS 1 in-flight window, every slot keeps a copy of the payload for retransmission
+    static constexpr size_t max_in_flight = 8;
+    static constexpr size_t max_qos1_payload_size = 64;
+    // Unacknowledged QoS 1 publishes are sent again with the DUP flag after this
+    static constexpr unsigned int retransmit_ms = 5'000;
+    static constexpr unsigned int connack_timeout_ms = 5'000;
+    // Largest packet from the broker we look at, the acks are 4 bytes
+    static constexpr size_t max_rx_packet_size = 64;
+    static constexpr uint16_t default_keep_alive_s = 60;
+    // No PINGRESP within this -> the connection is dead
+    static constexpr unsigned int pingresp_timeout_ms = 10'000;
+
+    explicit MQTTClient(INetwork& network, const IRTOS& rtos, size_t in_flight_window = max_in_flight)
         : socket(&network)
+        , rtos(rtos)
+        , window(std::clamp<size_t>(in_flight_window, 1, max_in_flight))
+    {
+    }
+
+    /// @param keep_alive_s The broker drops the session after 1.5 times this without any packet from us, a long
+    /// interval means fewer PINGREQs and radio wake ups when we have nothing to publish. 0 turns keep-alive off.
+    utils::ErrorCode connect(std::string_view client_id, std::string_view host, std::string_view port,
+        uint16_t keep_alive_s = default_keep_alive_s)
+    {
+        // MQTT CONNECT calls
+        std::array<std::byte, 256> buffer = {};
+        const auto len = SimpleMQTT::make_connect_packet(buffer, client_id, keep_alive_s);
+        if (len == 0) {
+            return utils::ErrorCode::MEMORY_ERROR; // Buffer too small
+        }
+        return connect_with(std::span<const std::byte>(buffer.data(), len), host, port, keep_alive_s);
+    }
+
+    /// @brief Connect with a constant client id, the CONNECT packet is built at compile time
+    template <SimpleMQTT::FixedString client_id, uint16_t keep_alive_s = default_keep_alive_s>
+    utils::ErrorCode connect(std::string_view host, std::string_view port)
+    {
+        return connect_with(SimpleMQTT::connect_packet<client_id, keep_alive_s>, host, port, keep_alive_s);
+    }
+
+    /// @brief Publish with QoS 0, or QoS 1 pipelined up to the in-flight window
+    /// With QoS 1 the payload is copied for retransmission, the topic must stay alive until it is acknowledged.
+    /// A full window waits for acknowledgements first.
+    utils::ErrorCode publish(std::string_view topic, std::span<const std::byte> payload, bool qos1 = false)
+    {
+        return publish_to(Topic { .name = topic, .encoded = {} }, payload, qos1);
+    }
+
+    /// @brief Publish to a constant topic, the topic and its length are encoded at compile time
+    template <SimpleMQTT::FixedString topic>
+    utils::ErrorCode publish(std::span<const std::byte> payload, bool qos1 = false)
+    {
+        return publish_to(Topic { .name = topic.view(), .encoded = SimpleMQTT::encoded_topic<topic> }, payload, qos1);
+    }
+
+    /// @brief Handle what the broker has sent, retransmit the QoS 1 publishes that timed out and keep the session
+    /// alive. Call it at least every get_poll_interval_ms().
+    /// @param timeout_ms How long to wait for something to arrive, 0 just polls
+    utils::ErrorCode poll(unsigned int timeout_ms)
     {
+        std::array<std::byte, 64> buffer {};
+        auto received = socket.receive(buffer, timeout_ms);
+        while (received && *received > 0) {
+            decoder.feed(std::span<const std::byte>(buffer.data(), *received),
+                [this](const SimpleMQTT::Packet& packet) { packet_received(packet); });
+            received = socket.receive(buffer, 0);
+        }
+        if (!received) {
+            connected = false;
+            return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR; // Connection closed
+        }
+
+        auto res = utils::ErrorCode::OK;
+        const uint32_t now_ms = rtos.get_time_ms();
+        for (auto& entry : in_flight) {
+            if (connected && entry.used && (now_ms - entry.sent_ms >= retransmit_ms)) {
+                utils::logger.info("Retransmitting MQTT packet %u\n", static_cast<unsigned int>(entry.packet_id));
+                ++retransmit_count;
+                if (const auto send_res = send_in_flight(entry, true); send_res != utils::ErrorCode::OK) {
+                    res = send_res;
+                }
+            }
+        }
+        if (const auto keep_alive_res = keep_alive(now_ms); keep_alive_res != utils::ErrorCode::OK) {
+            res = keep_alive_res;
+        }
+        return res;
+    }
+
+    /// @brief How long the caller may sleep before the next poll() has something to do
+    /// Nothing is due without a connection, the unacknowledged publishes are parked until connect() drops them.
+    [[nodiscard]] uint32_t get_poll_interval_ms() const
+    {
+        if (!connected) {
+            return max_poll_interval_ms;
+        }
+        const uint32_t now_ms = rtos.get_time_ms();
+        auto until = [now_ms](uint32_t due_ms) {
+            return (static_cast<int32_t>(due_ms - now_ms) > 0) ? due_ms - now_ms : 0;
+        };
+        uint32_t interval_ms = max_poll_interval_ms;
+        for (const auto& entry : in_flight) {
+            if (entry.used) {
+                interval_ms = std::min(interval_ms, until(entry.sent_ms + retransmit_ms));
+            }
+        }
+        if (keep_alive_ms > 0) {
+            const uint32_t due_ms
+                = ping_outstanding ? ping_sent_ms + pingresp_timeout_ms : last_sent_ms + get_ping_interval_ms();
+            interval_ms = std::min(interval_ms, until(due_ms));
+        }
+        return interval_ms;
     }
 
-    utils::ErrorCode connect(std::string_view client_id, std::string_view host, std::string_view port)
+    /// @brief Idle time after which a PINGREQ is sent
+    /// Starts at half the keep-alive and stretches towards the full keep-alive as the measured PINGRESP latency
+    /// shows how much margin the broker really needs.
+    [[nodiscard]] uint32_t get_ping_interval_ms() const
+    {
+        uint32_t margin_ms = keep_alive_ms / 2;
+        if (max_ping_latency_ms) {
+            margin_ms = std::min(margin_ms, std::max(min_ping_margin_ms, 2 * *max_ping_latency_ms));
+        }
+        return keep_alive_ms - margin_ms;
+    }
+    /// @brief Round trip time of the last PINGREQ
+    [[nodiscard]] std::optional<uint32_t> get_ping_latency_ms() const { return ping_latency_ms; }
+
+    /// @brief QoS 1 publishes waiting for a PUBACK
+    [[nodiscard]] size_t get_in_flight() const
+    {
+        return std::ranges::count_if(in_flight, [](const InFlight& entry) { return entry.used; });
+    }
+    [[nodiscard]] uint32_t get_retransmit_count() const { return retransmit_count; }
+    /// @brief Where the packet ids continue, carried over a Standby so that a new session doesn't reuse the ids the
+    /// broker may still remember from the previous one
+    [[nodiscard]] uint16_t get_next_packet_id() const { return next_packet_id; }
+    void set_next_packet_id(uint16_t id) { next_packet_id = id; }
+    /// @brief The broker has accepted the session and the connection has not been closed since
+    [[nodiscard]] bool get_connected() const { return connected; }
+
+private:
+    // A topic as a plain string, or pre-encoded with its length prefix at compile time
+    struct Topic {
+        std::string_view name;
+        std::span<const std::byte> encoded; // Empty for plain strings
+    };
+
+    struct InFlight {
+        bool used = false;
+        uint16_t packet_id = 0;
+        uint32_t sent_ms = 0;
+        Topic topic;
+        std::array<std::byte, max_qos1_payload_size> payload {};
+        size_t payload_size = 0;
+    };
+
+    Socket socket;
+    const IRTOS& rtos;
+    size_t window;
+    std::array<InFlight, max_in_flight> in_flight {};
+    uint16_t next_packet_id = 1;
+    uint32_t retransmit_count = 0;
+    SimpleMQTT::Decoder<max_rx_packet_size> decoder;
+    bool connack_received = false;
+    bool connected = false;
+
+    // Keep-alive
+    static constexpr uint32_t max_poll_interval_ms = 60'000;
+    static constexpr uint32_t min_ping_margin_ms = 1'000;
+    uint32_t keep_alive_ms = 0;
+    uint32_t last_sent_ms = 0;
+    bool ping_outstanding = false;
+    uint32_t ping_sent_ms = 0;
+    std::optional<uint32_t> ping_latency_ms;
+    std::optional<uint32_t> max_ping_latency_ms;
+
+    utils::ErrorCode connect_with(
+        std::span<const std::byte> connect_packet, std::string_view host, std::string_view port, uint16_t keep_alive_s)
     {
+        // A reconnect would otherwise take another link id, the ESP8266 has only 5
+        if (socket.is_open()) {
+            (void)socket.close();
+        }
+
         // TCP connect
         if (socket.connect(SocketType::TCP, host, port) != utils::ErrorCode::OK) {
             return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
         }
 
-        // MQTT CONNECT calls
-        std::array<std::byte, 256> buffer = {};
-        const auto len = SimpleMQTT::make_connect_packet(buffer, client_id);
-        if (len == 0) {
-            return utils::ErrorCode::MEMORY_ERROR; // Buffer too small
+        // Nothing survives a new clean session
+        in_flight = {};
+        decoder.reset();
+        connected = false;
+        connack_received = false;
+        keep_alive_ms = keep_alive_s * 1000U;
+        ping_outstanding = false;
+
+        if (const auto res = send_packet(connect_packet); res != utils::ErrorCode::OK) {
+            return res;
         }
 
-        return send_packet(std::span<std::byte>(buffer.data(), len));
+        // The broker accepts or refuses the session with a CONNACK
+        const uint32_t start_ms = rtos.get_time_ms();
+        while (!connack_received) {
+            const uint32_t elapsed_ms = rtos.get_time_ms() - start_ms;
+            if (elapsed_ms >= connack_timeout_ms) {
+                utils::logger.error("No CONNACK from the MQTT broker!\n");
+                return utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR;
+            }
+            if (const auto res = poll(connack_timeout_ms - elapsed_ms); res != utils::ErrorCode::OK) {
+                return res;
+            }
+        }
+        return connected ? utils::ErrorCode::OK : utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
     }
 
-    utils::ErrorCode publish(std::string_view topic, std::span<const std::byte> payload)
+    utils::ErrorCode publish_to(Topic topic, std::span<const std::byte> payload, bool qos1)
     {
-        std::array<std::byte, 256> buffer = {};
-        const auto len = SimpleMQTT::make_publish_packet(buffer, topic, payload);
+        if (!qos1) {
+            return send_publish(topic, payload, std::nullopt, false);
+        }
+        if (payload.size() > max_qos1_payload_size) {
+            return utils::ErrorCode::MEMORY_ERROR;
+        }
+
+        // Back-pressure: the broker hasn't kept up, wait for it to acknowledge something
+        const uint32_t start_ms = rtos.get_time_ms();
+        while (get_in_flight() >= window) {
+            const uint32_t elapsed_ms = rtos.get_time_ms() - start_ms;
+            if (elapsed_ms >= retransmit_ms) {
+                utils::logger.error("MQTT in-flight window full!\n");
+                return utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR;
+            }
+            if (const auto res = poll(retransmit_ms - elapsed_ms); res != utils::ErrorCode::OK) {
+                return res;
+            }
+        }
+
+        auto* slot = std::ranges::find_if(in_flight, [](const InFlight& entry) { return !entry.used; });
+        slot->used = true;
+        slot->packet_id = allocate_packet_id();
+        slot->topic = topic;
+        slot->payload_size = payload.size();
+        std::ranges::copy(payload, slot->payload.begin());
+        // The caller learns that it didn't go out and decides, a retransmission would only hide a dead connection
+        const auto res = send_in_flight(*slot, false);
+        if (res != utils::ErrorCode::OK) {
+            slot->used = false;
+        }
+        return res;
+    }
+
+    utils::ErrorCode send_packet(std::span<const std::byte> packet)
+    {
+        last_sent_ms = rtos.get_time_ms();
+        return socket.send(packet);
+    }
+
+    utils::ErrorCode keep_alive(uint32_t now_ms)
+    {
+        if (!connected || keep_alive_ms == 0) {
+            return utils::ErrorCode::OK;
+        }
+        if (ping_outstanding) {
+            if (now_ms - ping_sent_ms >= pingresp_timeout_ms) {
+                utils::logger.error("No PINGRESP from the MQTT broker!\n");
+                connected = false;
+                ping_outstanding = false;
+                return utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR;
+            }
+            return utils::ErrorCode::OK;
+        }
+        // Any other packet we send keeps the session alive just as well
+        if (now_ms - last_sent_ms < get_ping_interval_ms()) {
+            return utils::ErrorCode::OK;
+        }
+        std::array<std::byte, SimpleMQTT::pingreq_packet_size> packet {};
+        (void)SimpleMQTT::make_pingreq_packet(packet);
+        ping_outstanding = true;
+        ping_sent_ms = now_ms;
+        return send_packet(packet);
+    }
+
+    utils::ErrorCode send_publish(
+        Topic topic, std::span<const std::byte> payload, std::optional<uint16_t> packet_id, bool dup)
+    {
+        // Only the header is built here, the topic and the payload are sent straight from where they are
+        std::array<std::byte, SimpleMQTT::max_publish_header_size> header = {};
+        unsigned int len = 0;
+        std::span<const std::byte> topic_bytes;
+        if (!topic.encoded.empty()) {
+            // Topic length is part of the encoded topic, just the fixed header is left to build
+            const size_t remaining_length = topic.encoded.size() + (packet_id ? 2 : 0) + payload.size();
+            len = SimpleMQTT::make_publish_fixed_header(header, remaining_length, packet_id.has_value(), dup);
+            topic_bytes = topic.encoded;
+        } else {
+            len = SimpleMQTT::make_publish_header(header, topic.name, payload.size(), packet_id.has_value(), dup);
+            topic_bytes = std::as_bytes(std::span(topic.name));
+        }
         if (len == 0) {
             return utils::ErrorCode::MEMORY_ERROR; // Buffer too small
         }
-        return send_packet(std::span<std::byte>(buffer.data(), len));
+        const auto id = SimpleMQTT::make_packet_id(packet_id.value_or(0));
+        const std::array<std::span<const std::byte>, 4> segments = {
+            std::span<const std::byte>(header.data(), len),
+            topic_bytes,
+            packet_id ? std::span<const std::byte>(id) : std::span<const std::byte>(),
+            payload,
+        };
+        last_sent_ms = rtos.get_time_ms();
+        return socket.send(segments);
     }
 
-private:
-    Socket socket;
+    utils::ErrorCode send_in_flight(InFlight& entry, bool dup)
+    {
+        entry.sent_ms = rtos.get_time_ms();
+        return send_publish(entry.topic, std::span<const std::byte>(entry.payload.data(), entry.payload_size),
+            entry.packet_id, dup);
+    }
+
+    // Next free non-zero packet id, skips the ones still waiting for an acknowledgement
+    uint16_t allocate_packet_id()
+    {
+        auto in_use = [this](uint16_t id) {
+            return std::ranges::any_of(in_flight, [id](const InFlight& e) { return e.used && e.packet_id == id; });
+        };
+        while (next_packet_id == 0 || in_use(next_packet_id)) {
+            ++next_packet_id;
+        }
+        return next_packet_id++;
+    }
 
-    utils::ErrorCode send_packet(std::span<const std::byte> packet) { return socket.send(packet); }
+    void packet_received(const SimpleMQTT::Packet& packet)
+    {
+        switch (packet.type) {
+        case SimpleMQTT::PacketType::CONNACK:
+            connack_received = true;
+            connected = packet.return_code == 0;
+            if (!connected) {
+                utils::logger.error("MQTT broker refused the connection: %u\n",
+                    static_cast<unsigned int>(packet.return_code));
+            }
+            break;
+        case SimpleMQTT::PacketType::PINGRESP:
+            if (ping_outstanding) {
+                ping_outstanding = false;
+                ping_latency_ms = rtos.get_time_ms() - ping_sent_ms;
+                max_ping_latency_ms = std::max(max_ping_latency_ms.value_or(0), *ping_latency_ms);
+            }
+            break;
+        case SimpleMQTT::PacketType::PUBACK:
+            for (auto& entry : in_flight) {
+                if (entry.used && entry.packet_id == packet.packet_id) {
+                    entry.used = false;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
 };
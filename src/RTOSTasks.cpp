@@ -1,9 +1,13 @@
+#include <algorithm>
 #include <cinttypes>
+#include <optional>
 
 #include <FreeRTOS.h>
 #include <queue.h>
 #include <task.h>
 
+#include "BackupState.h"
+#include "LowPower.h"
 #include "MQTTClient.h"
 #include "RTOSTasks.h"
 #include "interfaces/ILED.h"
@@ -19,6 +23,120 @@
 #define SERVER_PORT "666"
 #endif // !SERVER_PORT
 
+namespace {
+
+static_assert(batch_max_payload_size <= MQTTClient::max_qos1_payload_size);
+
+template <SimpleMQTT::FixedString topic, typename Batch> void publish_batch(MQTTClient& mqtt_client, Batch& batch)
+{
+    if (mqtt_client.publish<topic>(batch.get_payload(), true) == utils::ErrorCode::OK) {
+        utils::logger.info("Readings sent!\n");
+    } else {
+        // Kept, it would fall out of lockstep with the other quantities. The reconnect is up to the caller.
+        utils::logger.error("Failed to publish readings, dropped %u samples!\n", static_cast<unsigned>(batch.size()));
+    }
+    batch.clear();
+}
+
+/// @brief One batch per quantity, filled in lockstep as every measurement has all of them
+/// They share the timestamps, so they all start and get published together.
+struct EnvironmentBatches {
+    CompressedSampleBatch<batch_max_payload_size> temperature;
+    // Whole pascals
+    CompressedSampleBatch<batch_max_payload_size, 0> pressure;
+    CompressedSampleBatch<batch_max_payload_size> humidity;
+
+    [[nodiscard]] size_t size() const { return temperature.size(); }
+    [[nodiscard]] bool empty() const { return temperature.empty(); }
+    [[nodiscard]] bool full() const { return temperature.full() || pressure.full() || humidity.full(); }
+    [[nodiscard]] uint32_t get_base_time_ms() const { return temperature.get_base_time_ms(); }
+
+    /// @return false if any of the batches is full -> publish and start over
+    [[nodiscard]] bool add(const Measurement& measurement)
+    {
+        if (full()) {
+            return false;
+        }
+        // None of them is full, so none of these fails
+        const uint32_t time_ms = measurement.time_ms;
+        (void)temperature.add({ .time_ms = time_ms, .value = measurement.reading.temperature });
+        (void)pressure.add({ .time_ms = time_ms, .value = static_cast<int32_t>(measurement.reading.pressure) });
+        (void)humidity.add({ .time_ms = time_ms, .value = static_cast<int32_t>(measurement.reading.humidity) });
+        return true;
+    }
+
+    void publish(MQTTClient& mqtt_client)
+    {
+        utils::logger.info("Sending readings...\n");
+        publish_batch<"sensors/temperature">(mqtt_client, temperature);
+        publish_batch<"sensors/pressure">(mqtt_client, pressure);
+        publish_batch<"sensors/humidity">(mqtt_client, humidity);
+    }
+};
+
+// Nothing retransmits what the broker hasn't acknowledged once the ESP8266 sleeps
+void wait_for_acks(MQTTClient& mqtt_client, const IRTOS& rtos)
+{
+    const uint32_t start_ms = rtos.get_time_ms();
+    while (mqtt_client.get_in_flight() > 0) {
+        const uint32_t elapsed_ms = rtos.get_time_ms() - start_ms;
+        if (elapsed_ms >= duty_cycle_ack_timeout_ms
+            || mqtt_client.poll(duty_cycle_ack_timeout_ms - elapsed_ms) != utils::ErrorCode::OK) {
+            utils::logger.error("Readings not acknowledged!\n");
+            return;
+        }
+    }
+}
+
+/// @brief Publishes the readings kept over Standby and the latest measurement
+/// @param measurement_in_state it has been added to the state already
+void publish_from_standby(MQTTClient& mqtt_client, const BackupState& state,
+    const std::optional<Measurement>& measurement, bool measurement_in_state)
+{
+    // Three readings and the latest one fit any batch
+    EnvironmentBatches batches;
+    for (size_t i = 0; i < state.size(); ++i) {
+        if (const auto reading = state.get(i)) {
+            (void)batches.add({ .time_ms = state.get_time_ms(i), .reading = *reading });
+        }
+    }
+    if (measurement && !measurement_in_state) {
+        (void)batches.add(*measurement);
+    }
+
+    if (!batches.empty()) {
+        batches.publish(mqtt_client);
+    }
+}
+
+/// @brief Brings the ESP8266 up, publishes and puts it back to sleep
+/// Whatever goes wrong, the samples are dropped, retrying until it works would drain the battery.
+void publish_and_sleep(const DutyCycleTaskArgs& args, const BackupState& state,
+    const std::optional<Measurement>& measurement, bool measurement_in_state)
+{
+    args.network->set_warm_hint(state.get_network_hint());
+    utils::logger.info("Setting up network\n");
+    if (args.network->init() == utils::ErrorCode::OK) {
+        MQTTClient mqtt_client(*args.network, *args.rtos);
+        mqtt_client.set_next_packet_id(state.get_next_packet_id());
+        if (mqtt_client.connect<"chili-sensor">(SERVER_IP, SERVER_PORT) == utils::ErrorCode::OK) {
+            publish_from_standby(mqtt_client, state, measurement, measurement_in_state);
+            wait_for_acks(mqtt_client, *args.rtos);
+        } else {
+            utils::logger.error("Failed to connect to MQTT broker!\n");
+        }
+        state.set_next_packet_id(mqtt_client.get_next_packet_id());
+    } else {
+        utils::logger.error("Failed to initialize network\n");
+    }
+    state.set_network_hint(args.network->get_warm_hint());
+    if (args.network->deep_sleep() != utils::ErrorCode::OK) {
+        utils::logger.error("ESP8266 didn't go to sleep!\n");
+    }
+}
+
+} // namespace
+
 static void setup_network(INetwork& network)
 {
     utils::logger.info("Setting up network\n");
@@ -50,7 +168,7 @@ void led_task(void* a)
 
 void temperature_task(void* a)
 {
-    constexpr auto measurement_delay = pdMS_TO_TICKS(10'000);
+    constexpr auto measurement_delay = pdMS_TO_TICKS(measurement_period_ms);
 
     // We should always have the notification already waiting as the setup task has higher priority
     if (pdTRUE != xTaskNotifyWait(0, 0, nullptr, portMAX_DELAY)) {
@@ -59,12 +177,22 @@ void temperature_task(void* a)
     }
 
     auto args = static_cast<TemperatureTaskArgs*>(a);
+    TickType_t calibrated_at = xTaskGetTickCount();
     while (true) {
         auto wake_time = xTaskGetTickCount();
-        auto temperature_reading = args->temperature->read();
-        // Read & send temperature
-        if (temperature_reading) {
-            xQueueSendToBack(args->measurement_queue, &(temperature_reading.value()), 0);
+        // The tickless idle steps the tick count by the RTC
+        if (wake_time - calibrated_at >= pdMS_TO_TICKS(bluepill::power::RTC_RECALIBRATION_PERIOD_MS)) {
+            bluepill::power::recalibrate();
+            calibrated_at = wake_time;
+        }
+        // Read & send temperature, pressure and humidity
+        // The sensor converts on its own, the network task gets the CPU to drain the queue meanwhile
+        if (args->temperature->start_conversion() == utils::ErrorCode::OK) {
+            bluepill::async_wait_ms(args->temperature->get_conversion_time_ms());
+            if (const auto reading = args->temperature->read_environment()) {
+                const Measurement measurement { .time_ms = wake_time * portTICK_PERIOD_MS, .reading = *reading };
+                xQueueSendToBack(args->measurement_queue, &measurement, 0);
+            }
         }
         xTaskDelayUntil(&wake_time, measurement_delay);
     }
@@ -80,29 +208,119 @@ void network_task(void* a)
 
     const auto args = static_cast<NetworkTaskArgs*>(a);
 
-    MQTTClient mqtt_client(*(args->network));
+    MQTTClient mqtt_client(*(args->network), *(args->rtos));
 
     // Connect to MQTT broker
-    // Retry indefinitely until connected
-    while (mqtt_client.connect("chili-sensor", SERVER_IP, SERVER_PORT) != utils::ErrorCode::OK) {
-        utils::logger.error("Failed to connect to MQTT broker, retrying...\n");
-        bluepill::async_wait_ms(1000);
+    // Retry indefinitely, backing off while the broker stays unreachable
+    uint32_t reconnect_backoff_ms = mqtt_reconnect_min_backoff_ms;
+    uint32_t reconnect_at_ms = 0;
+    const auto until_reconnect_ms = [&] {
+        const uint32_t now_ms = args->rtos->get_time_ms();
+        return (static_cast<int32_t>(reconnect_at_ms - now_ms) > 0) ? reconnect_at_ms - now_ms : 0;
+    };
+    const auto try_connect = [&] {
+        if (mqtt_client.connect<"chili-sensor">(SERVER_IP, SERVER_PORT) == utils::ErrorCode::OK) {
+            utils::logger.info("Connected to MQTT broker!\n");
+            reconnect_backoff_ms = mqtt_reconnect_min_backoff_ms;
+            return true;
+        }
+        utils::logger.error("Failed to connect to MQTT broker, retrying in %u ms...\n",
+            static_cast<unsigned>(reconnect_backoff_ms));
+        reconnect_at_ms = args->rtos->get_time_ms() + reconnect_backoff_ms;
+        reconnect_backoff_ms = std::min(2 * reconnect_backoff_ms, mqtt_reconnect_max_backoff_ms);
+        return false;
+    };
+    while (!try_connect()) {
+        bluepill::async_wait_ms(until_reconnect_ms());
     }
-    utils::logger.info("Connected to MQTT broker!\n");
+    // Nothing to publish yet, the radio only costs power until the first window
+    if (args->network->sleep_radio(batch_max_latency_ms) != utils::ErrorCode::OK) {
+        utils::logger.error("Failed to put the ESP8266 radio to sleep!\n");
+    }
+
+    EnvironmentBatches batches;
+    // The radio is at full power from just before a flush until the broker has acknowledged it
+    bool publish_window = false;
+    // What the window costs, a full batch can be flushed again before it closes
+    uint32_t window_radio_on_ms = 0;
+    uint32_t window_samples = 0;
+    const auto flush = [&] {
+        if (!publish_window) {
+            window_radio_on_ms = args->network->get_radio_on_ms();
+            window_samples = 0;
+        }
+        if (args->network->wake_radio() != utils::ErrorCode::OK) {
+            utils::logger.error("Failed to wake up the ESP8266 radio!\n");
+        }
+        publish_window = true;
+        window_samples += batches.size();
+        batches.publish(mqtt_client);
+    };
+    const auto add_measurement = [&](const Measurement& measurement) {
+        if (batches.add(measurement)) {
+            return;
+        }
+        // Publishing without a connection would only throw the batch away. The newest reading is dropped instead, the
+        // delta encoded batches can't let go of their oldest one.
+        if (!mqtt_client.get_connected()) {
+            utils::logger.error("Batch full while disconnected, dropping the reading at %u ms!\n",
+                static_cast<unsigned>(measurement.time_ms));
+            return;
+        }
+        flush();
+        (void)batches.add(measurement); // Always fits in empty batches
+    };
+    // Until the oldest batched reading is due, minus the time the radio takes to wake up for it
+    const auto until_flush_ms = [&] {
+        if (batches.empty()) {
+            return batch_max_latency_ms;
+        }
+        const uint32_t age_ms = args->rtos->get_time_ms() - batches.get_base_time_ms();
+        const uint32_t due_ms = batch_max_latency_ms - std::min(age_ms, batch_max_latency_ms);
+        return due_ms - std::min(due_ms, args->network->get_radio_wake_latency_ms());
+    };
 
     while (true) {
-        double reading = 0;
-        if (xQueueReceive(args->measurement_queue, &reading, portMAX_DELAY) != errQUEUE_EMPTY) {
-            utils::logger.info("Sending reading...\n");
+        // Wake up without readings only when the MQTT client has something to do (retransmissions, keep-alive) or
+        // the oldest batched reading is due. Without a connection only the next attempt is, the readings keep
+        // batching until it is back.
+        const bool connected = mqtt_client.get_connected();
+        const uint32_t wait_ms
+            = connected ? std::min(mqtt_client.get_poll_interval_ms(), until_flush_ms()) : until_reconnect_ms();
 
-            std::span<const std::byte> payload_span(reinterpret_cast<const std::byte*>(&reading), sizeof(reading));
+        // In a publish window it's the acknowledgements that are waited for, the readings queue up meanwhile
+        const TickType_t queue_wait = publish_window ? 0 : pdMS_TO_TICKS(wait_ms);
+        Measurement measurement {};
+        if (xQueueReceive(args->measurement_queue, &measurement, queue_wait) != errQUEUE_EMPTY) {
+            add_measurement(measurement);
+            // Take everything that piled up so it goes out in one PUBLISH per quantity
+            while (!batches.full() && xQueueReceive(args->measurement_queue, &measurement, 0) != errQUEUE_EMPTY) {
+                add_measurement(measurement);
+            }
+        }
 
-            if (mqtt_client.publish("sensors/temperature", payload_span) == utils::ErrorCode::OK) {
-                utils::logger.info("Reading sent!\n");
-            } else {
-                utils::logger.error("Failed to publish reading!\n");
-                // TODO: Try to reconnect?
+        if (connected && !batches.empty() && (batches.full() || until_flush_ms() == 0)) {
+            flush();
+        }
+        if (!connected) {
+            if (until_reconnect_ms() == 0) {
+                (void)try_connect();
             }
+        } else if (mqtt_client.poll(publish_window ? mqtt_client.get_poll_interval_ms() : 0) != utils::ErrorCode::OK) {
+            utils::logger.error("MQTT connection lost!\n");
+            reconnect_at_ms = args->rtos->get_time_ms() + reconnect_backoff_ms;
+        }
+
+        // A lost connection has nothing more to acknowledge either
+        if (publish_window && (mqtt_client.get_in_flight() == 0 || !mqtt_client.get_connected())) {
+            publish_window = false;
+            if (args->network->sleep_radio(until_flush_ms()) != utils::ErrorCode::OK) {
+                utils::logger.error("Failed to put the ESP8266 radio to sleep!\n");
+            }
+            const uint32_t radio_on_ms = args->network->get_radio_on_ms() - window_radio_on_ms;
+            utils::logger.info("Radio on %u ms for %u samples, %u ms per sample\n", static_cast<unsigned>(radio_on_ms),
+                static_cast<unsigned>(window_samples),
+                static_cast<unsigned>(radio_on_ms / std::max<uint32_t>(window_samples, 1)));
         }
     }
 }
@@ -119,6 +337,43 @@ void setup_task(void* a)
     }
 }
 
+void duty_cycle_task(void* a)
+{
+    using namespace bluepill;
+
+    const auto args = static_cast<DutyCycleTaskArgs*>(a);
+    const BackupState state(*args->backup, duty_cycle_period_ms);
+    while (true) {
+        const uint32_t wake_ms = power::get_time_ms();
+        // Nothing to carry on from after a power loss, publish right away to show that we're up
+        const bool cold = !state.load();
+        utils::logger.info(power::woke_from_standby() ? "Woke up from Standby\n" : "Started\n");
+
+        // The sensor kept its settings, but its calibration is gone with the RAM
+        std::optional<Measurement> measurement;
+        if (args->temperature->init() == utils::ErrorCode::OK
+            && args->temperature->start_conversion() == utils::ErrorCode::OK) {
+            async_wait_ms(args->temperature->get_conversion_time_ms());
+            if (const auto reading = args->temperature->read_environment()) {
+                measurement = Measurement { .time_ms = wake_ms, .reading = *reading };
+            }
+        }
+
+        const bool stored = !cold && measurement && state.add(wake_ms, measurement->reading);
+        const bool overdue = !state.empty() && (wake_ms - state.get_first_time_ms() >= batch_max_latency_ms);
+        if (cold || (measurement && !stored) || state.full() || overdue) {
+            publish_and_sleep(*args, state, measurement, stored);
+            state.clear();
+            // Next to the ESP8266 being up, the ~64 ms don't matter
+            power::recalibrate();
+        }
+
+        // The next sample is due at the next period boundary, a wake-up that took longer than a period skips the ones
+        // it overran, their slots stay missing
+        power::enter_standby(power::until_next_period_ms(wake_ms, power::get_time_ms(), duty_cycle_period_ms));
+    }
+}
+
 void vApplicationStackOverflowHook(TaskHandle_t xTask, char* pcTaskName)
 {
     while (true) {
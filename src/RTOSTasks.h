@@ -5,15 +5,48 @@
 #include <task.h>
 
 #include "BlinkyLED.h"
+#include "CompressedSampleBatch.h"
+#include "interfaces/IBackupRegisters.h"
 #include "interfaces/INetwork.h"
+#include "interfaces/IRTOS.h"
 #include "interfaces/ITemperatureSensor.h"
 
+// Stack depths in words
+constexpr uint16_t setup_task_stack_words = 256;
+constexpr uint16_t temperature_task_stack_words = 256;
+// The MQTT client keeps a copy of every unacknowledged batch for retransmission
+constexpr uint16_t network_task_stack_words = 768;
+constexpr uint16_t led_task_stack_words = configMINIMAL_STACK_SIZE;
+// Measures and publishes with CHILI_STANDBY_DUTY_CYCLE, as much as the network task
+constexpr uint16_t duty_cycle_task_stack_words = network_task_stack_words;
+
+constexpr uint32_t measurement_period_ms = 10'000;
+// With CHILI_STANDBY_DUTY_CYCLE the backup registers hold 3 samples, so every third wake-up brings the ESP8266 up.
+// That takes it ~4 s at ~80 mA, against ~20 mA with it always on: at 10 s it would save next to nothing, at 60 s a
+// publish every 3 minutes averages below 2 mA.
+constexpr uint32_t duty_cycle_period_ms = 60'000;
+
 constexpr unsigned int measurement_queue_size = 10;
+// Readings are published in compressed batches of up to this many bytes...
+constexpr size_t batch_max_payload_size = 64;
+// ...but the oldest one never waits longer than this, a longer batch compresses better
+constexpr uint32_t batch_max_latency_ms = 300'000;
+// A lost MQTT connection is retried after this, doubling up to the maximum while the broker stays unreachable
+constexpr uint32_t mqtt_reconnect_min_backoff_ms = 1'000;
+constexpr uint32_t mqtt_reconnect_max_backoff_ms = 64'000;
+// Before the ESP8266 goes back to sleep, nothing retransmits what the broker hasn't acknowledged after that
+constexpr uint32_t duty_cycle_ack_timeout_ms = 5'000;
+
+/// @brief What the temperature task queues for the network task
+struct Measurement {
+    uint32_t time_ms;
+    EnvironmentReading reading;
+};
 
 struct LedTaskArgs {
     const ILED* led;
 
-    explicit LedTaskArgs(const ILED* led_ptr)
+    constexpr explicit LedTaskArgs(const ILED* led_ptr)
         : led(led_ptr)
     {
     }
@@ -29,6 +62,7 @@ void temperature_task(void* a);
 struct NetworkTaskArgs {
     QueueHandle_t measurement_queue;
     INetwork* network;
+    const IRTOS* rtos;
 };
 void network_task(void* a);
 
@@ -39,4 +73,13 @@ struct SetupTaskArgs {
     const ITemperatureSensor* temperature;
     INetwork* network;
 };
-void setup_task(void* a);
\ No newline at end of file
+void setup_task(void* a);
+
+struct DutyCycleTaskArgs {
+    const ITemperatureSensor* temperature;
+    INetwork* network;
+    const IRTOS* rtos;
+    const IBackupRegisters* backup;
+};
+/// @brief Everything CHILI_STANDBY_DUTY_CYCLE does between two Standbys: measure, publish now and then, sleep
+void duty_cycle_task(void* a);
\ No newline at end of file
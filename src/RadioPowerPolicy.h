@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+/// @brief The AT+SLEEP modes of the ESP8266 that this board can use, light sleep (1) isn't one of them
+enum class RadioSleepMode : uint8_t { NONE = 0, MODEM = 2 };
+
+/// @brief Decides when the ESP8266 radio sleeps and keeps track of how long it was at full power
+///
+/// The radio runs at full power only for a publish window, from just before a batch is flushed until the broker has
+/// acknowledged it. In between it is in modem sleep: still associated with the AP, waking up for the beacons and for
+/// whatever is sent, ~15 mA instead of ~70 mA. Light sleep would save more, but it stops the UART and needs a wake-up
+/// GPIO that this board doesn't wire.
+/// Waking up isn't instant, the publish scheduler opens the window early by the measured latency.
+class RadioPowerPolicy {
+public:
+    // Shorter gaps aren't worth two AT command round trips
+    static constexpr uint32_t min_sleep_ms = 1'000;
+    // Until measured, about one beacon interval
+    static constexpr uint32_t default_wake_latency_ms = 100;
+
+    /// @return the mode for a gap of idle_ms until the next publish window
+    [[nodiscard]] static constexpr RadioSleepMode choose(uint32_t idle_ms)
+    {
+        return (idle_ms >= min_sleep_ms) ? RadioSleepMode::MODEM : RadioSleepMode::NONE;
+    }
+
+    [[nodiscard]] bool get_awake() const { return awake; }
+    [[nodiscard]] uint32_t get_wake_latency_ms() const { return wake_latency_ms; }
+
+    /// @brief The module has been reset, it comes up at full power
+    void powered_up(uint32_t now_ms)
+    {
+        if (!awake) {
+            awake = true;
+            awake_since_ms = now_ms;
+        }
+    }
+
+    /// @brief The radio is at full power from now on, waking it up took latency_ms
+    void woke(uint32_t now_ms, uint32_t latency_ms)
+    {
+        if (!awake) {
+            awake = true;
+            awake_since_ms = now_ms - latency_ms;
+        }
+        // A slower wake-up is taken as is, a faster one only slowly, an early window is cheaper than a late one
+        wake_latency_ms = (latency_ms > wake_latency_ms) ? latency_ms : (3 * wake_latency_ms + latency_ms) / 4;
+    }
+
+    /// @brief The radio sleeps from now on
+    void slept(uint32_t now_ms)
+    {
+        if (awake) {
+            on_ms += now_ms - awake_since_ms;
+            awake = false;
+        }
+    }
+
+    /// @return the time at full power, the current window included
+    [[nodiscard]] uint32_t get_on_ms(uint32_t now_ms) const { return on_ms + (awake ? now_ms - awake_since_ms : 0); }
+
+private:
+    // Full power from the reset until told otherwise
+    bool awake = true;
+    uint32_t awake_since_ms = 0;
+    uint32_t on_ms = 0;
+    uint32_t wake_latency_ms = default_wake_latency_ms;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+/// @brief Received bytes of one socket waiting for the reader
+///
+/// Filled straight from the RX DMA ring by the response parser and emptied by receive_socket(), both run in the
+/// network task so no locking is needed. When the reader falls behind the newest bytes are dropped and counted.
+template <size_t capacity> class SocketRxQueue {
+    static_assert((capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    /// @return Number of bytes that fit, the rest is dropped
+    size_t push(std::span<const volatile char> data)
+    {
+        const size_t count = std::min(data.size(), capacity - size());
+        for (size_t i = 0; i < count; ++i) {
+            buf[(head + i) % capacity] = static_cast<std::byte>(data[i]);
+        }
+        head += count;
+        dropped += data.size() - count;
+        return count;
+    }
+
+    /// @return Number of bytes copied to the buffer
+    size_t read(std::span<std::byte> buffer)
+    {
+        const size_t count = std::min(buffer.size(), size());
+        for (size_t i = 0; i < count; ++i) {
+            buffer[i] = buf[(tail + i) % capacity];
+        }
+        tail += count;
+        return count;
+    }
+
+    void clear()
+    {
+        tail = head;
+        dropped = 0;
+    }
+
+    [[nodiscard]] size_t size() const { return head - tail; }
+    [[nodiscard]] bool empty() const { return head == tail; }
+    /// @brief Bytes lost because the queue was full
+    [[nodiscard]] uint32_t get_dropped() const { return dropped; }
+
+private:
+    std::array<std::byte, capacity> buf {};
+    // Free running indices, the slot is index % capacity
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    uint32_t dropped = 0;
+};
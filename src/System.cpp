@@ -8,6 +8,7 @@
 #include "GPIO.h"
 #include "I2C.h"
 #include "Logger.h"
+#include "LowPower.h"
 #include "System.h"
 #include "USART.h"
 #include "interrupts.h"
@@ -39,6 +40,7 @@ namespace peripherals {
             .error_flag = &dma1_channel6_flags.dma_error,
             .half_flag = &dma1_channel6_flags.dma_half,
             .complete_flag = &dma1_channel6_flags.dma_complete,
+            .half_count = &dma1_channel6_flags.half_count,
           },
           .tx_channel = {
             .channel = BluePillDMAChannel::_7,
@@ -48,7 +50,9 @@ namespace peripherals {
           }
         }
     };
-    I2C i2c1 { BluePillI2C::_1, RCC_I2C1, RST_I2C1 };
+    I2C i2c1 {
+        BluePillI2C::_1, RCC_I2C1, RST_I2C1, I2C1_FAST_MODE ? I2CSpeed::FAST_400K : I2CSpeed::STANDARD_100K
+    };
 }
 
 void nop(unsigned int n)
@@ -68,9 +72,20 @@ static void peripheral_setup()
     peripherals::gpio_a.setup_pins(LOGGER_TX_PIN_NRO | NETWORK_TX_PIN_NRO, GPIOMode::OUTPUT_50_MHZ,
         GPIOFunction::OUTPUT_ALTFN_PUSHPULL); // A9 USART1 & A2 USART2 TX
     peripherals::gpio_a.setup_pins(NETWORK_RX_PIN_NRO, GPIOMode::INPUT, GPIOFunction::INPUT_FLOAT); // A3 USART2 RX
+    if constexpr (NETWORK_FLOW_CONTROL) {
+        peripherals::gpio_a.setup_pins(NETWORK_RTS_PIN_NRO, GPIOMode::OUTPUT_50_MHZ,
+            GPIOFunction::OUTPUT_ALTFN_PUSHPULL); // A1 USART2 RTS
+        // A0 USART2 CTS, the ESP8266 RTS (GPIO15) is pulled low at boot -> clear to send until it takes over
+        peripherals::gpio_a.setup_pins(NETWORK_CTS_PIN_NRO, GPIOMode::INPUT, GPIOFunction::INPUT_FLOAT);
+    }
     peripherals::gpio_b.setup_pins(I2C1_SCL_PIN_NRO | I2C1_SDA_PIN_NRO, GPIOMode::OUTPUT_50_MHZ,
         GPIOFunction::OUTPUT_ALTFN_OPENDRAIN); // B6 SCL, B7 SDA
     peripherals::gpio_c.setup_pins(LED_PIN_NRO, GPIOMode::OUTPUT_2_MHZ, GPIOFunction::OUTPUT_PUSHPULL); // C13 LED
+    // With the Standby duty cycle released until the network init pulses it, a sleeping ESP8266 would wake up from a
+    // low pin. Otherwise held in reset until then, as before.
+    if constexpr (STANDBY_DUTY_CYCLE) {
+        peripherals::gpio_c.set_pins(ESP_RESET_PIN_NRO);
+    }
     peripherals::gpio_c.setup_pins(ESP_RESET_PIN_NRO, GPIOMode::OUTPUT_2_MHZ, GPIOFunction::OUTPUT_OPENDRAIN);
 
     // USART
@@ -85,7 +100,7 @@ static void peripheral_setup()
         USARTParity::NONE, USARTFlowControl::NONE);
     utils::logger.info("Starting sensor node...\n"); // We can use the logger now
     usart_setup_helper(peripherals::usart2, NETWORK_BAUDRATE, NETWORK_DATABITS, USARTStopBits::_1, USARTMode::TX_RX,
-        USARTParity::NONE, USARTFlowControl::NONE);
+        USARTParity::NONE, NETWORK_FLOW_CONTROL ? USARTFlowControl::RTS_CTS : USARTFlowControl::NONE);
 
     // DMA
     peripherals::dma1.disable();
@@ -118,6 +133,7 @@ static void systick_setup()
 {
     systick_set_reload(SYSTICK_RELOAD_VALUE);
     systick_counter_enable();
+    dwt_enable_cycle_counter();
     utils::logger.info("Systick counters setup!\n");
 }
 
@@ -126,6 +142,8 @@ static void interrupt_setup()
     nvic_enable_irq(NVIC_DMA1_CHANNEL6_IRQ); // DMA1 Channel 6, USART2 RX uses this channel
     nvic_enable_irq(NVIC_DMA1_CHANNEL7_IRQ); // DMA1 Channel 7, USART2 TX uses this channel
     nvic_enable_irq(NVIC_USART2_IRQ); // USART2 interrupts
+    nvic_enable_irq(NVIC_I2C1_EV_IRQ); // I2C1 transfer events
+    nvic_enable_irq(NVIC_I2C1_ER_IRQ); // I2C1 NACK and bus errors
     utils::logger.info("Interrupts setup!\n");
 }
 
@@ -135,6 +153,7 @@ void setup()
     peripheral_setup();
     interrupt_setup();
     systick_setup();
+    power::setup();
 }
 
 static uint32_t systick_delta(uint32_t start, uint32_t end)
@@ -163,4 +182,6 @@ void busy_wait_ms(unsigned int ms) { busy_wait(ms_to_ticks(ms)); }
 void async_wait(uint32_t ticks) { vTaskDelay(ticks); }
 
 void async_wait_ms(unsigned int ms) { async_wait(ms_to_ticks(ms)); }
+
+uint32_t cycle_count() { return dwt_read_cycle_counter(); }
 }
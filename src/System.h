@@ -1,7 +1,9 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
@@ -34,6 +36,8 @@ void sleep(uint32_t ticks);
 void busy_wait_ms(unsigned int ms);
 void async_wait(uint32_t ticks);
 void async_wait_ms(unsigned int ms);
+// CPU clock cycles, wraps every ~60 s at 72 MHz, only for measuring short code paths
+uint32_t cycle_count();
 
 // Time related constants
 // These are actually programmed into the CSRs in
@@ -52,14 +56,45 @@ constexpr unsigned int ESP_RESET_PIN_NRO = GPIO15;
 constexpr unsigned int LOGGER_TX_PIN_NRO = GPIO_USART1_TX;
 constexpr unsigned int NETWORK_TX_PIN_NRO = GPIO_USART2_TX;
 constexpr unsigned int NETWORK_RX_PIN_NRO = GPIO_USART2_RX;
+constexpr unsigned int NETWORK_CTS_PIN_NRO = GPIO_USART2_CTS;
+constexpr unsigned int NETWORK_RTS_PIN_NRO = GPIO_USART2_RTS;
 constexpr unsigned int I2C1_SCL_PIN_NRO = GPIO_I2C1_SCL;
 constexpr unsigned int I2C1_SDA_PIN_NRO = GPIO_I2C1_SDA;
 
 // USART parameters
 constexpr unsigned int LOGGER_BAUDRATE = 38400;
 constexpr unsigned int LOGGER_DATABITS = 8;
-constexpr unsigned int NETWORK_BAUDRATE = 115200;
+constexpr unsigned int NETWORK_BAUDRATE = 115200; // ESP8266 default after reset
 constexpr unsigned int NETWORK_DATABITS = 8;
+// Highest baud rate the ESP8266 link is escalated to at runtime (AT+UART_CUR), depends on the wiring of the board
+// Give it to the preprocessor with -D, NETWORK_BAUDRATE disables the escalation
+#ifndef CHILI_NETWORK_MAX_BAUDRATE
+#define CHILI_NETWORK_MAX_BAUDRATE 921600
+#endif // !CHILI_NETWORK_MAX_BAUDRATE
+constexpr unsigned int NETWORK_MAX_BAUDRATE = CHILI_NETWORK_MAX_BAUDRATE;
+// RTS/CTS between USART2 (A0 CTS, A1 RTS) and the ESP8266 (GPIO15 RTS, GPIO13 CTS), only if the board has them wired
+// The tickless idle (CHILI_TICKLESS_IDLE) only enters STOP with it, RTS holds the ESP8266 back while USART2 has no
+// clock. Without it, the default, the idle only reaches Sleep.
+// Give it to the preprocessor with -D
+#ifndef CHILI_NETWORK_FLOW_CONTROL
+#define CHILI_NETWORK_FLOW_CONTROL 0
+#endif // !CHILI_NETWORK_FLOW_CONTROL
+constexpr bool NETWORK_FLOW_CONTROL = CHILI_NETWORK_FLOW_CONTROL != 0;
+// Tried from the fastest down, USART2 runs from the 36 MHz APB1 clock -> max 2.25 Mbaud
+constexpr std::array<unsigned int, 4> NETWORK_BAUDRATE_CANDIDATES = { 2'000'000, 921'600, 460'800, 230'400 };
+// I2C1 runs in 400 kHz Fast mode unless the boot self-test drops it to 100 kHz, 0 starts from 100 kHz
+// Give it to the preprocessor with -D
+#ifndef CHILI_I2C1_FAST_MODE
+#define CHILI_I2C1_FAST_MODE 1
+#endif // !CHILI_I2C1_FAST_MODE
+constexpr bool I2C1_FAST_MODE = CHILI_I2C1_FAST_MODE != 0;
+// 1 spends the time between samples in Standby and brings the ESP8266 up only to publish, every wake-up is a reset
+// that carries on from the backup registers. Needs CHILI_TICKLESS_IDLE for the RTC.
+// Give it to the preprocessor with -D
+#ifndef CHILI_STANDBY_DUTY_CYCLE
+#define CHILI_STANDBY_DUTY_CYCLE 0
+#endif // !CHILI_STANDBY_DUTY_CYCLE
+constexpr bool STANDBY_DUTY_CYCLE = CHILI_STANDBY_DUTY_CYCLE != 0;
 
 namespace peripherals {
     extern GPIOPort gpio_a;
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "USART.h"
 #include "interrupts.h"
 
@@ -82,7 +84,7 @@ void USART::idle_line_received_interrupt(bool set) const
 
 bool USART::get_is_setup() const { return is_setup; }
 
-void USARTWithDMA::enable_rx_dma(uint32_t dest_addr, unsigned int number_of_data, bool error_interrupt,
+void USARTWithDMA::enable_rx_dma(uintptr_t dest_addr, unsigned int number_of_data, bool error_interrupt,
     bool half_interrupt, bool complete_interrupt, bool circular) const
 {
     reset_rx_dma();
@@ -90,7 +92,7 @@ void USARTWithDMA::enable_rx_dma(uint32_t dest_addr, unsigned int number_of_data
         dma_channels.rx_channel.channel, // channel
         (uint32_t)(uintptr_t)&USART_DR(usart), // source address
         BluePillDMAPeripheralWordSize::BYTE, // source word size
-        dest_addr,
+        static_cast<uint32_t>(dest_addr),
         BluePillDMAMemWordSize::BYTE, // destination word size
         BluePillDMAPriority::VERY_HIGH, // priority
         number_of_data, false, true, error_interrupt, half_interrupt, complete_interrupt, circular);
@@ -99,7 +101,7 @@ void USARTWithDMA::enable_rx_dma(uint32_t dest_addr, unsigned int number_of_data
     dma_channels.dma->enable(dma_channels.rx_channel.channel);
 }
 
-void USARTWithDMA::enable_tx_dma(uint32_t source_addr, unsigned int number_of_data, bool error_interrupt,
+void USARTWithDMA::enable_tx_dma(uintptr_t source_addr, unsigned int number_of_data, bool error_interrupt,
     bool half_interrupt, bool complete_interrupt) const
 {
     reset_tx_dma();
@@ -107,7 +109,7 @@ void USARTWithDMA::enable_tx_dma(uint32_t source_addr, unsigned int number_of_da
         dma_channels.tx_channel.channel, // channel
         (uint32_t)(uintptr_t)&USART_DR(usart), // destination address
         BluePillDMAPeripheralWordSize::BYTE, // destination word size
-        source_addr,
+        static_cast<uint32_t>(source_addr),
         BluePillDMAMemWordSize::BYTE, // source word size
         BluePillDMAPriority::VERY_HIGH, // priority
         number_of_data, false, true, error_interrupt, half_interrupt, complete_interrupt, false);
@@ -117,6 +119,57 @@ void USARTWithDMA::enable_tx_dma(uint32_t source_addr, unsigned int number_of_da
     dma_channels.dma->enable(dma_channels.tx_channel.channel);
 }
 
+std::optional<TxToken> USARTWithDMA::send_async(const TxRequest& request) const
+{
+    // Nothing to send means no transfer complete interrupt either
+    if (request.data.empty()) {
+        return std::nullopt;
+    }
+    TxToken token = 0;
+    if (!tx_queue.push(request, token)) {
+        return std::nullopt;
+    }
+    if (const auto* next = tx_queue.claim()) {
+        start_tx(*next);
+    }
+    return token;
+}
+
+std::optional<TxToken> USARTWithDMA::send_gather_async(std::span<const TxRequest> requests) const
+{
+    if (std::ranges::any_of(requests, [](const auto& request) { return request.data.empty(); })) {
+        return std::nullopt;
+    }
+    TxToken token = 0;
+    if (!tx_queue.push(requests, token)) {
+        return std::nullopt;
+    }
+    if (const auto* next = tx_queue.claim()) {
+        start_tx(*next);
+    }
+    return token;
+}
+
+void USARTWithDMA::cancel_tx() const
+{
+    disable_tx_dma();
+    tx_queue.clear();
+}
+
+void USARTWithDMA::tx_complete_isr() const
+{
+    if (const auto* next = tx_queue.complete()) {
+        start_tx(*next);
+    } else {
+        disable_tx_dma();
+    }
+}
+
+void USARTWithDMA::start_tx(const TxRequest& request) const
+{
+    enable_tx_dma(reinterpret_cast<uintptr_t>(request.data.data()), request.data.size(), true, false, false);
+}
+
 void USARTWithDMA::disable_rx_dma() const
 {
     usart_disable_rx_dma(usart);
@@ -144,6 +197,9 @@ void USARTWithDMA::reset_rx_dma() const
     *(dma_channels.rx_channel.error_flag) = false;
     *(dma_channels.rx_channel.half_flag) = false;
     *(dma_channels.rx_channel.complete_flag) = false;
+    if (dma_channels.rx_channel.half_count != nullptr) {
+        *(dma_channels.rx_channel.half_count) = 0;
+    }
     usart2_overrun_error = false;
 }
 
@@ -158,4 +214,9 @@ void USARTWithDMA::reset_tx_dma() const
 unsigned int USARTWithDMA::get_dma_count() const
 {
     return dma_channels.dma->get_count(dma_channels.rx_channel.channel);
-}
\ No newline at end of file
+}
+
+uint32_t USARTWithDMA::get_rx_dma_half_count() const
+{
+    return (dma_channels.rx_channel.half_count != nullptr) ? dma_channels.rx_channel.half_count->load() : 0;
+}
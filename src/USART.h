@@ -11,6 +11,7 @@
 #include "interfaces/ISerial.h"
 
 #include "DMA.h"
+#include "DmaTxQueue.h"
 #include "Peripheral.h"
 
 enum class BluePillUSART : uint32_t { _1 = USART1, _2 = USART2, _3 = USART3 };
@@ -93,6 +94,7 @@ struct DMAChannelAndFlags {
     volatile std::atomic_bool* error_flag;
     volatile std::atomic_bool* half_flag;
     volatile std::atomic_bool* complete_flag;
+    volatile std::atomic_uint32_t* half_count = nullptr;
 };
 
 struct USARTDMA {
@@ -111,15 +113,23 @@ public:
     {
     }
 
-    void enable_rx_dma(uint32_t dest_addr, unsigned int number_of_data, bool error_interrupt, bool half_interrupt,
+    void enable_rx_dma(uintptr_t dest_addr, unsigned int number_of_data, bool error_interrupt, bool half_interrupt,
         bool complete_interrupt, bool circular) const;
-    void enable_tx_dma(uint32_t source_addr, unsigned int number_of_data, bool error_interrupt, bool half_interrupt,
+    void enable_tx_dma(uintptr_t source_addr, unsigned int number_of_data, bool error_interrupt, bool half_interrupt,
         bool complete_interrupt) const;
+    [[nodiscard]] std::optional<TxToken> send_async(const TxRequest& request) const override;
+    [[nodiscard]] std::optional<TxToken> send_gather_async(std::span<const TxRequest> requests) const override;
+    [[nodiscard]] bool get_tx_done(TxToken token) const override { return tx_queue.is_done(token); }
+    [[nodiscard]] bool get_tx_busy() const { return tx_queue.is_busy(); }
+    void cancel_tx() const override;
+    // Call from the USART transfer complete interrupt, starts the next queued transmission
+    void tx_complete_isr() const;
     void disable_rx_dma() const;
     void disable_tx_dma() const;
     void reset_rx_dma() const;
     void reset_tx_dma() const;
     [[nodiscard]] unsigned int get_dma_count() const;
+    [[nodiscard]] uint32_t get_rx_dma_half_count() const;
     [[nodiscard]] bool get_rx_dma_complete_flag() const { return *(dma_channels.rx_channel.complete_flag); }
     [[nodiscard]] bool get_tx_dma_complete_flag() const { return *(dma_channels.tx_channel.complete_flag); }
     [[nodiscard]] bool get_rx_dma_error_flag() const { return *(dma_channels.rx_channel.error_flag); }
@@ -128,8 +138,10 @@ public:
     void clear_tx_dma_complete_flag() const override { *(dma_channels.tx_channel.complete_flag) = false; }
 
     // IDmaSerial implementation (forwarding to USART or local methods)
+    void set_baudrate(unsigned int baudrate) const override { USART::set_baudrate(baudrate); }
     void tx_complete_interrupt(bool set) const override { USART::tx_complete_interrupt(set); }
     void error_interrupt(bool set) const override { USART::error_interrupt(set); }
+    void idle_line_received_interrupt(bool set) const override { USART::idle_line_received_interrupt(set); }
     bool get_tx_transfer_complete_flag() const override { return USART::get_tx_transfer_complete_flag(); }
     bool get_overrun_error_flag() const override { return USART::get_overrun_error_flag(); }
     void clear_tx_transfer_complete_flag() const override { USART::clear_tx_transfer_complete_flag(); }
@@ -142,4 +154,8 @@ public:
 
 private:
     USARTDMA dma_channels;
+    static constexpr size_t tx_queue_size = 8;
+    mutable DmaTxQueue<tx_queue_size> tx_queue;
+
+    void start_tx(const TxRequest& request) const;
 };
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// @brief 16-bit registers that keep their value in Standby and through resets, but not through a power loss
+class IBackupRegisters {
+public:
+    virtual ~IBackupRegisters() = default;
+    [[nodiscard]] virtual size_t size() const = 0;
+    [[nodiscard]] virtual uint16_t read(size_t index) const = 0;
+    virtual void write(size_t index, uint16_t value) const = 0;
+};
@@ -1,23 +1,39 @@
 #pragma once
 
 #include <cstdint>
+#include <optional>
+#include <span>
+
+#include "DmaTxQueue.h"
 
 class IDmaSerial {
 public:
     virtual ~IDmaSerial() = default;
 
-    virtual void enable_rx_dma(uint32_t dest_addr, unsigned int number_of_data, bool error_interrupt,
+    virtual void enable_rx_dma(uintptr_t dest_addr, unsigned int number_of_data, bool error_interrupt,
         bool half_interrupt, bool complete_interrupt, bool circular) const
         = 0;
-    virtual void enable_tx_dma(uint32_t source_addr, unsigned int number_of_data, bool error_interrupt,
+    virtual void enable_tx_dma(uintptr_t source_addr, unsigned int number_of_data, bool error_interrupt,
         bool half_interrupt, bool complete_interrupt) const
         = 0;
 
+    // Queue a transmission, starts right away if the transmitter is idle
+    // Returns a token for get_tx_done(), nothing if the queue is full
+    [[nodiscard]] virtual std::optional<TxToken> send_async(const TxRequest& request) const = 0;
+    // Scatter-gather, the requests go out back to back in the given order without copying them together
+    // Returns the token of the last request, nothing if they don't all fit in the queue
+    [[nodiscard]] virtual std::optional<TxToken> send_gather_async(std::span<const TxRequest> requests) const = 0;
+    [[nodiscard]] virtual bool get_tx_done(TxToken token) const = 0;
+    // Stop the running transmission and drop everything queued
+    virtual void cancel_tx() const = 0;
+
     virtual void disable_rx_dma() const = 0;
     virtual void disable_tx_dma() const = 0;
 
+    virtual void set_baudrate(unsigned int baudrate) const = 0;
     virtual void tx_complete_interrupt(bool set) const = 0;
     virtual void error_interrupt(bool set) const = 0;
+    virtual void idle_line_received_interrupt(bool set) const = 0;
 
     [[nodiscard]] virtual bool get_tx_dma_error_flag() const = 0;
     [[nodiscard]] virtual bool get_rx_dma_error_flag() const = 0;
@@ -32,4 +48,5 @@ public:
     virtual void clear_tx_dma_complete_flag() const = 0;
 
     [[nodiscard]] virtual unsigned int get_dma_count() const = 0;
+    [[nodiscard]] virtual uint32_t get_rx_dma_half_count() const = 0;
 };
@@ -11,4 +11,12 @@ public:
 
     [[nodiscard]] virtual utils::ErrorCode write(uint8_t addr, std::span<const uint8_t> data) const = 0;
     [[nodiscard]] virtual utils::ErrorCode read(uint8_t addr, std::span<uint8_t> data) const = 0;
+    // One transaction: write tx, repeated start, read rx, e.g. set a register address and read from it
+    [[nodiscard]] virtual utils::ErrorCode write_read(
+        uint8_t addr, std::span<const uint8_t> tx, std::span<uint8_t> rx) const = 0;
+    // One transaction writing the segments back to back, e.g. a register address followed by the data
+    [[nodiscard]] virtual utils::ErrorCode write_gather(
+        uint8_t addr, std::span<const std::span<const uint8_t>> segments) const = 0;
+    // Checks that the device answers in time at the configured bus speed, the bus may fall back to a slower speed
+    [[nodiscard]] virtual utils::ErrorCode self_test(uint8_t addr) const = 0;
 };
@@ -3,6 +3,7 @@
 #include <array>
 #include <cstdio>
 #include <functional>
+#include <optional>
 #include <string_view>
 
 #include "ATCommand.h"
@@ -16,9 +17,16 @@
 
 enum class SocketType { TCP, UDP };
 
+/// @brief What init() learned about the link, lets the next one after a Standby skip the slow paths
+struct NetworkWarmHint {
+    unsigned int baudrate = 0; // 0 -> nothing learned yet
+    bool ap_joined = false;
+};
+
 class INetwork {
 public:
     virtual ~INetwork() = default;
+    // Leaves the radio at full power, the caller decides when it may sleep
     virtual utils::ErrorCode init() = 0;
     [[nodiscard]] virtual bool get_ap_connected() = 0;
     [[nodiscard]] virtual utils::ErrorCode connect_to_ap() = 0;
@@ -27,7 +35,29 @@ public:
         SocketType sock_type, std::string_view addr, std::string_view port)
         = 0;
     [[nodiscard]] virtual utils::ErrorCode send_socket(unsigned int id, std::span<const std::byte> data) const = 0;
+    // Send the segments as one contiguous stream without copying them together
+    [[nodiscard]] virtual utils::ErrorCode send_socket(
+        unsigned int id, std::span<const std::span<const std::byte>> segments) const
+        = 0;
     [[nodiscard]] virtual utils::ErrorCode close_socket(unsigned int id) = 0;
+    // Read what the socket has received, waits up to timeout_ms for data to arrive (0 just polls)
+    // Returns the number of bytes read, 0 on timeout, nullopt once the socket is closed and everything has been read
+    [[nodiscard]] virtual std::optional<size_t> receive_socket(
+        unsigned int id, std::span<std::byte> buffer, unsigned int timeout_ms)
+        = 0;
+    // Full radio power for a publish window, the AP and the sockets stay up in between
+    [[nodiscard]] virtual utils::ErrorCode wake_radio() = 0;
+    // End of the window, idle_ms until the next one decides how deep the radio may sleep
+    [[nodiscard]] virtual utils::ErrorCode sleep_radio(uint32_t idle_ms) = 0;
+    // How much earlier than a window wake_radio() has to be called
+    [[nodiscard]] virtual uint32_t get_radio_wake_latency_ms() const = 0;
+    // Time spent at full radio power since the start
+    [[nodiscard]] virtual uint32_t get_radio_on_ms() const = 0;
+    // Power the module down until the next init(), the AP and all sockets are gone after that
+    [[nodiscard]] virtual utils::ErrorCode deep_sleep() = 0;
+    [[nodiscard]] virtual NetworkWarmHint get_warm_hint() const = 0;
+    // Call before init()
+    virtual void set_warm_hint(const NetworkWarmHint& hint) = 0;
 };
 
 class Socket {
@@ -50,15 +80,19 @@ public:
         return res;
     }
 
-    [[nodiscard]] utils::ErrorCode close() const
+    // Frees the link id even if the network has already lost the connection
+    [[nodiscard]] utils::ErrorCode close()
     {
         auto res = utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
         if (id) {
             res = network->close_socket(id.value());
+            id.reset();
         }
         return res;
     }
 
+    [[nodiscard]] bool is_open() const { return id.has_value(); }
+
     [[nodiscard]] utils::ErrorCode send(std::span<const std::byte> data) const
     {
         auto res = utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
@@ -68,6 +102,23 @@ public:
         return res;
     }
 
+    [[nodiscard]] utils::ErrorCode send(std::span<const std::span<const std::byte>> segments) const
+    {
+        auto res = utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
+        if (id) {
+            res = network->send_socket(id.value(), segments);
+        }
+        return res;
+    }
+
+    [[nodiscard]] std::optional<size_t> receive(std::span<std::byte> buffer, unsigned int timeout_ms) const
+    {
+        if (id) {
+            return network->receive_socket(id.value(), buffer, timeout_ms);
+        }
+        return std::nullopt;
+    }
+
 private:
     INetwork* network;
     std::optional<int> id;
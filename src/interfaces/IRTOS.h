@@ -8,6 +8,7 @@ public:
 
     virtual void delay(uint32_t ms) const = 0;
     [[nodiscard]] virtual uint32_t get_tick_count() const = 0;
+    [[nodiscard]] virtual uint32_t get_time_ms() const = 0;
 
     // Returns true if notification received, false if timeout
     [[nodiscard]] virtual bool task_notify_wait(uint32_t timeout_ms) const = 0;
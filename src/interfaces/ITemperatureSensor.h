@@ -1,11 +1,31 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
 
 #include "utils.h"
 
+// Sensor readings are fixed point integers all the way to the payload, the Cortex-M3 has no FPU
+using centi_celsius_t = int32_t; // 0.01 degC
+using pascal_t = uint32_t; // 1 Pa
+using centi_percent_rh_t = uint32_t; // 0.01 %RH
+
+/// @brief All quantities of one measurement, taken at the same time
+struct EnvironmentReading {
+    centi_celsius_t temperature;
+    pascal_t pressure;
+    centi_percent_rh_t humidity;
+};
+
 class ITemperatureSensor {
 public:
     [[nodiscard]] virtual utils::ErrorCode init() const = 0;
-    [[nodiscard]] virtual std::optional<double> read() const = 0;
-};
\ No newline at end of file
+    /// @brief Starts a conversion, waits for it and reads the temperature
+    [[nodiscard]] virtual std::optional<centi_celsius_t> read() const = 0;
+
+    // Split-phase measurement: start_conversion() returns right away, the sensor is busy for get_conversion_time_ms()
+    // and the caller is free to do something else meanwhile, then read_environment() fetches the results
+    [[nodiscard]] virtual utils::ErrorCode start_conversion() const = 0;
+    [[nodiscard]] virtual uint32_t get_conversion_time_ms() const = 0;
+    [[nodiscard]] virtual std::optional<EnvironmentReading> read_environment() const = 0;
+};
@@ -8,9 +8,14 @@
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/rtc.h>
 #include <libopencm3/stm32/usart.h>
 
+#include "I2C.h"
 #include "Logger.h"
+#include "System.h"
+#include "USART.h"
 #include "interrupts.h"
 #include "utils.h"
 
@@ -55,8 +60,10 @@ static void dma_channel_isr(uint32_t dma, uint8_t channel, DMAISRFlags& flags)
 
     BaseType_t higher_prio_task_woken = pdFALSE;
 
-    std::function notify_network_task = [channel, &higher_prio_task_woken](TaskHandle_t task) {
-        if (task != nullptr && channel == DMA_CHANNEL7) {
+    // USART2 RX is on channel 6 and TX on channel 7
+    TaskHandle_t const network_task = (channel == DMA_CHANNEL6) ? network_rx_dma_task : network_tx_dma_task;
+    std::function notify_network_task = [&higher_prio_task_woken](TaskHandle_t task) {
+        if (task != nullptr) {
             xTaskNotifyFromISR(task, 0, eNoAction, &higher_prio_task_woken);
         }
     };
@@ -64,18 +71,22 @@ static void dma_channel_isr(uint32_t dma, uint8_t channel, DMAISRFlags& flags)
     if (transfer_error_interrupt) {
         dma_clear_interrupt_flags(dma, channel, DMA_TEIF);
         flags.dma_error = true;
-        notify_network_task(network_rx_dma_task);
-        notify_network_task(network_tx_dma_task);
+        notify_network_task(network_task);
     }
 
     if (half_interrupt) {
         dma_clear_interrupt_flags(dma, channel, DMA_HTIF);
         flags.dma_half = true;
+        flags.half_count++;
+        // A half of the RX ring is full, let the network task parse it before the DMA comes back around
+        notify_network_task(network_task);
     }
 
     if (transfer_complete_interrupt) {
         dma_clear_interrupt_flags(dma, channel, DMA_TCIF);
         flags.dma_complete = true;
+        flags.half_count++;
+        notify_network_task(network_task);
     }
 
     portYIELD_FROM_ISR(higher_prio_task_woken);
@@ -98,6 +109,8 @@ void usart2_isr(void)
         = ((USART_CR3(USART2) & USART_CR3_EIE) != 0) && ((USART_SR(USART2) & USART_SR_ORE) != 0);
     bool transfer_complete_interrupt
         = ((USART_CR1(USART2) & USART_CR1_TCIE) != 0) && ((USART_SR(USART2) & USART_SR_TC) != 0);
+    bool idle_line_interrupt
+        = ((USART_CR1(USART2) & USART_CR1_IDLEIE) != 0) && ((USART_SR(USART2) & USART_SR_IDLE) != 0);
 
     BaseType_t higher_prio_task_woken = pdFALSE;
 
@@ -115,6 +128,19 @@ void usart2_isr(void)
             USART_SR(USART2) &= ~USART_SR_TC;
         }
         usart2_tx_transfer_complete = true;
+        // Start the next queued transmission straight from here, no need to wait for the task
+        bluepill::peripherals::usart2.tx_complete_isr();
+        if (network_usart2_task != nullptr) {
+            xTaskNotifyFromISR(network_usart2_task, 0, eNoAction, &higher_prio_task_woken);
+        }
+    }
+
+    if (idle_line_interrupt) {
+        // The IDLE bit is cleared by reading SR followed by DR
+        // The RX DMA has already moved the last received byte out of DR, so the dummy read doesn't lose any data
+        (void)USART_SR(USART2);
+        (void)USART_DR(USART2);
+        // The ESP8266 stopped sending, let the network task parse what has arrived so far
         if (network_usart2_task != nullptr) {
             xTaskNotifyFromISR(network_usart2_task, 0, eNoAction, &higher_prio_task_woken);
         }
@@ -123,6 +149,31 @@ void usart2_isr(void)
     portYIELD_FROM_ISR(higher_prio_task_woken);
 }
 
+namespace {
+TaskHandle_t i2c1_task = nullptr;
+}
+void set_task_handle_for_i2c1_interrupts(TaskHandle_t task) { i2c1_task = task; }
+
+static void i2c1_transfer_isr(bool transfer_done)
+{
+    BaseType_t higher_prio_task_woken = pdFALSE;
+    if (transfer_done && i2c1_task != nullptr) {
+        xTaskNotifyFromISR(i2c1_task, 0, eNoAction, &higher_prio_task_woken);
+    }
+    portYIELD_FROM_ISR(higher_prio_task_woken);
+}
+
+void i2c1_ev_isr(void) { i2c1_transfer_isr(bluepill::peripherals::i2c1.event_isr()); }
+
+void i2c1_er_isr(void) { i2c1_transfer_isr(bluepill::peripherals::i2c1.error_isr()); }
+
+// Only there to wake the CPU from the tickless idle, LowPower.cpp reads the RTC counter itself
+void rtc_alarm_isr(void)
+{
+    rtc_clear_flag(RTC_ALR);
+    exti_reset_request(EXTI17);
+}
+
 void hard_fault_handler(void)
 {
     utils::logger.error("HARD FAULT!!!\n");
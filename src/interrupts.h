@@ -9,6 +9,9 @@ struct DMAISRFlags {
     volatile std::atomic_bool dma_complete = false;
     volatile std::atomic_bool dma_half = false;
     volatile std::atomic_bool dma_error = false;
+    // Number of half and complete transfer events since the channel was (re)started
+    // In circular mode every event means that one more half of the buffer has been filled
+    volatile std::atomic_uint32_t half_count = 0;
 };
 
 extern DMAISRFlags dma1_channel6_flags;
@@ -21,4 +24,5 @@ extern volatile std::atomic_uint32_t systick_counter;
 
 void set_network_task_handle_for_tx_dma_interrupts(TaskHandle_t task);
 void set_network_task_handle_for_rx_dma_interrupts(TaskHandle_t task);
-void set_network_task_handle_for_usart2_interrupts(TaskHandle_t task);
\ No newline at end of file
+void set_network_task_handle_for_usart2_interrupts(TaskHandle_t task);
+void set_task_handle_for_i2c1_interrupts(TaskHandle_t task);
\ No newline at end of file
@@ -2,9 +2,9 @@
 
 #include <algorithm>
 #include <array>
-#include <bit>
 #include <cstdint>
 #include <cstring>
+#include <optional>
 #include <span>
 #include <string_view>
 
@@ -50,30 +50,31 @@ enum class PacketType : uint8_t {
  */
 
 namespace {
-    void write_byte(std::span<std::byte> buffer, unsigned int& offset, const std::byte byte)
+    // The writers are constexpr so that constant packets can be built at compile time
+
+    constexpr void write_byte(std::span<std::byte> buffer, unsigned int& offset, const std::byte byte)
     {
         buffer[offset++] = byte;
     }
 
-    void write_bytes(std::span<std::byte> buffer, unsigned int& offset, std::span<const std::byte> data)
+    constexpr void write_bytes(std::span<std::byte> buffer, unsigned int& offset, std::span<const std::byte> data)
     {
         std::ranges::copy(data, buffer.begin() + offset);
         offset += data.size();
     }
 
-    void write_u16_be(std::span<std::byte> buffer, unsigned int& offset, uint16_t value)
+    constexpr void write_u16_be(std::span<std::byte> buffer, unsigned int& offset, uint16_t value)
     {
-        if constexpr (std::endian::native == std::endian::little) {
-            value = std::byteswap(value);
-        }
-        write_bytes(buffer, offset, std::span<const std::byte>(reinterpret_cast<const std::byte*>(&value), 2));
+        write_byte(buffer, offset, static_cast<std::byte>(value >> 8));
+        write_byte(buffer, offset, static_cast<std::byte>(value & 0xFF));
     }
 
-    void write_string(std::span<std::byte> buffer, unsigned int& offset, std::string_view str)
+    constexpr void write_string(std::span<std::byte> buffer, unsigned int& offset, std::string_view str)
     {
         write_u16_be(buffer, offset, static_cast<uint16_t>(str.size()));
-        write_bytes(
-            buffer, offset, std::span<const std::byte>(reinterpret_cast<const std::byte*>(str.data()), str.size()));
+        for (const char c : str) {
+            write_byte(buffer, offset, static_cast<std::byte>(c));
+        }
     }
 
     struct RemainingLengthEncoding {
@@ -105,7 +106,7 @@ namespace {
     }
 } // Anonymous namespace
 
-inline unsigned int make_connect_packet(
+constexpr unsigned int make_connect_packet(
     std::span<std::byte> buffer, std::string_view client_id, uint16_t keep_alive = 60)
 {
     /* Connect Variable Header:
@@ -177,8 +178,85 @@ inline unsigned int make_connect_packet(
     return offset;
 }
 
-inline unsigned int make_publish_packet(
-    std::span<std::byte> buffer, std::string_view topic, std::span<const std::byte> payload, bool qos1 = false)
+constexpr unsigned int pingreq_packet_size = 2;
+
+/// @brief PINGREQ keeps the session alive when there is nothing else to send
+inline unsigned int make_pingreq_packet(std::span<std::byte> buffer)
+{
+    if (buffer.size() < pingreq_packet_size) {
+        return 0; // Buffer too small
+    }
+    unsigned int offset = 0;
+    write_byte(buffer, offset, static_cast<std::byte>(PacketType::PINGREQ));
+    write_byte(buffer, offset, std::byte { 0 }); // No variable header or payload
+    return offset;
+}
+
+/// @brief Size of the CONNECT packet make_connect_packet() writes
+constexpr unsigned int connect_packet_size(size_t client_id_size)
+{
+    // Variable header (10) + client id (2 + len)
+    const unsigned int remaining_length = 10 + 2 + client_id_size;
+    return 1 + get_remaining_length_encoding(remaining_length).size + remaining_length;
+}
+
+// Fixed header (1 + up to 4 remaining length bytes)
+constexpr unsigned int max_publish_fixed_header_size = 5;
+// Fixed header + topic length (2)
+constexpr unsigned int max_publish_header_size = max_publish_fixed_header_size + 2;
+
+/// @brief Write the fixed header of a PUBLISH packet
+/// @param remaining_length Size of the variable header (topic, packet id) and the payload
+constexpr unsigned int make_publish_fixed_header(
+    std::span<std::byte> buffer, size_t remaining_length, bool qos1 = false, bool dup = false)
+{
+    // Determine bytes needed for Remaining Length encoding (1-4 bytes)
+    const auto length_encoding = get_remaining_length_encoding(remaining_length);
+    if (1 + length_encoding.size > buffer.size()) {
+        return 0; // Buffer too small
+    }
+
+    unsigned int offset = 0;
+    auto first_byte = static_cast<std::byte>(PacketType::PUBLISH);
+    if (qos1) {
+        first_byte |= std::byte { 0x02 }; // QoS 1
+        if (dup) {
+            first_byte |= std::byte { 0x08 };
+        }
+    }
+    write_byte(buffer, offset, first_byte);
+    write_bytes(buffer, offset, std::span<const std::byte>(length_encoding.bytes.data(), length_encoding.size));
+    return offset;
+}
+
+/// @brief Write everything of a PUBLISH packet that comes before the topic name
+/// The rest of the packet (topic, packet id if QoS 1 and payload) can then be sent straight from where it lives
+/// @param dup Set when a QoS 1 packet is sent again because it was not acknowledged in time
+inline unsigned int make_publish_header(
+    std::span<std::byte> buffer, std::string_view topic, size_t payload_size, bool qos1 = false, bool dup = false)
+{
+    // Calculate Remaining Length
+    // Variable Header: Topic Name (2 + len) + Packet ID (2 if QoS > 0)
+    unsigned int variable_header_size = 2 + topic.size();
+    if (qos1) {
+        variable_header_size += 2;
+    }
+    const unsigned int remaining_length = variable_header_size + payload_size;
+
+    // Fixed Header
+    unsigned int offset = make_publish_fixed_header(buffer, remaining_length, qos1, dup);
+    if (offset == 0 || offset + 2 > buffer.size()) {
+        return 0; // Buffer too small
+    }
+
+    // Topic Name length, the name itself follows
+    write_u16_be(buffer, offset, static_cast<uint16_t>(topic.size()));
+
+    return offset;
+}
+
+inline unsigned int make_publish_packet(std::span<std::byte> buffer, std::string_view topic,
+    std::span<const std::byte> payload, bool qos1 = false, uint16_t packet_id = 1, bool dup = false)
 {
     /* Publish Variable Header:
      *      Bit   7   6   5   4   3   2   1   0
@@ -203,42 +281,27 @@ inline unsigned int make_publish_packet(
      *          +---+---+---+---+---+---+---+---+
      */
 
-    // Calculate Remaining Length
-    // Variable Header: Topic Name (2 + len) + Packet ID (2 if QoS > 0)
-    unsigned int variable_header_size = 2 + topic.size();
-    if (qos1) {
-        variable_header_size += 2;
-    }
-    const unsigned int payload_size = payload.size();
-    const unsigned int remaining_length = variable_header_size + payload_size;
-
-    // Determine bytes needed for Remaining Length encoding (1-4 bytes)
-    const auto length_encoding = get_remaining_length_encoding(remaining_length);
+    std::array<std::byte, max_publish_header_size> header = {};
+    const unsigned int header_size = make_publish_header(header, topic, payload.size(), qos1, dup);
 
     // Does our data fit in the allocated buffer?
-    const unsigned int total_size = 1 + length_encoding.size + remaining_length;
+    const unsigned int total_size = header_size + topic.size() + (qos1 ? 2 : 0) + payload.size();
     if (total_size > buffer.size()) {
         return 0; // Buffer too small
     }
 
     unsigned int offset = 0;
 
-    // Fixed Header
-    auto first_byte = static_cast<std::byte>(PacketType::PUBLISH);
-    if (qos1) {
-        first_byte |= std::byte { 0x02 }; // QoS 1
-    }
-    write_byte(buffer, offset, first_byte);
-    write_bytes(buffer, offset, std::span<const std::byte>(length_encoding.bytes.data(), length_encoding.size));
+    // Fixed Header and Topic Name length
+    write_bytes(buffer, offset, std::span<const std::byte>(header.data(), header_size));
 
-    // Variable Header
     // Topic Name
-    write_string(buffer, offset, topic);
+    write_bytes(
+        buffer, offset, std::span<const std::byte>(reinterpret_cast<const std::byte*>(topic.data()), topic.size()));
 
     // Packet Identifier (only if QoS > 0)
     if (qos1) {
-        // Just use a dummy ID for now
-        write_u16_be(buffer, offset, 1);
+        write_u16_be(buffer, offset, packet_id);
     }
 
     // Payload
@@ -247,4 +310,207 @@ inline unsigned int make_publish_packet(
     return offset;
 }
 
+// ========== Compile-time packet templates ==========
+
+/// @brief String literal usable as a template argument, e.g. encoded_topic<"sensors/temperature">
+template <size_t N> struct FixedString {
+    std::array<char, N - 1> chars {};
+
+    constexpr FixedString(const char (&str)[N]) { std::copy_n(str, N - 1, chars.begin()); }
+    [[nodiscard]] constexpr std::string_view view() const { return { chars.data(), chars.size() }; }
+};
+
+/// @brief Topic name with its length prefix, encoded at compile time and kept in flash
+/// Sent as it is after the PUBLISH fixed header, only the fixed header and the packet id are built per publish.
+template <FixedString name> inline constexpr auto encoded_topic = [] {
+    static_assert(name.chars.size() <= UINT16_MAX, "Topic name too long");
+    std::array<std::byte, name.chars.size() + 2> topic {};
+    unsigned int offset = 0;
+    write_string(topic, offset, name.view());
+    return topic;
+}();
+
+/// @brief Complete CONNECT packet for a constant client id, encoded at compile time and kept in flash
+template <FixedString client_id, uint16_t keep_alive = 60> inline constexpr auto connect_packet = [] {
+    std::array<std::byte, connect_packet_size(client_id.chars.size())> packet {};
+    make_connect_packet(packet, client_id.view(), keep_alive);
+    return packet;
+}();
+
+/// @brief Packet identifier in the big endian wire format, sent right after the topic of a QoS 1 PUBLISH
+inline std::array<std::byte, 2> make_packet_id(uint16_t packet_id)
+{
+    return { static_cast<std::byte>(packet_id >> 8), static_cast<std::byte>(packet_id & 0xFF) };
+}
+
+/// @brief A packet from the broker
+/// The topic and the payload point into the data given to the decoder or into its own buffer, they are valid only
+/// during the handler call.
+struct Packet {
+    PacketType type = PacketType::PINGRESP;
+    uint8_t flags = 0; // Lower nibble of the fixed header, DUP/QoS/RETAIN for PUBLISH
+    uint16_t packet_id = 0; // PUBACK, PUBREC, PUBREL, PUBCOMP, SUBACK, UNSUBACK and PUBLISH with QoS > 0
+    uint8_t return_code = 0; // CONNACK return code, the first return code of a SUBACK
+    bool session_present = false; // CONNACK
+    std::string_view topic; // PUBLISH
+    std::span<const std::byte> payload; // PUBLISH
+};
+
+namespace {
+    uint16_t read_u16_be(std::span<const std::byte> data)
+    {
+        return static_cast<uint16_t>((std::to_integer<uint16_t>(data[0]) << 8) | std::to_integer<uint16_t>(data[1]));
+    }
+
+    // Decode the variable header and the payload of a complete packet, nullopt if it is malformed
+    std::optional<Packet> parse_packet(std::byte fixed_header, std::span<const std::byte> body)
+    {
+        Packet packet;
+        packet.type = static_cast<PacketType>(fixed_header & std::byte { 0xF0 });
+        packet.flags = std::to_integer<uint8_t>(fixed_header & std::byte { 0x0F });
+
+        switch (packet.type) {
+        case PacketType::CONNACK:
+            if (body.size() != 2) {
+                return std::nullopt;
+            }
+            packet.session_present = (body[0] & std::byte { 0x01 }) != std::byte { 0 };
+            packet.return_code = std::to_integer<uint8_t>(body[1]);
+            break;
+        case PacketType::PUBACK:
+        case PacketType::PUBREC:
+        case PacketType::PUBREL:
+        case PacketType::PUBCOMP:
+        case PacketType::UNSUBACK:
+            if (body.size() != 2) {
+                return std::nullopt;
+            }
+            packet.packet_id = read_u16_be(body);
+            break;
+        case PacketType::SUBACK:
+            if (body.size() < 3) {
+                return std::nullopt;
+            }
+            packet.packet_id = read_u16_be(body);
+            packet.return_code = std::to_integer<uint8_t>(body[2]);
+            break;
+        case PacketType::PUBLISH: {
+            if (body.size() < 2) {
+                return std::nullopt;
+            }
+            const size_t topic_size = read_u16_be(body);
+            const bool has_id = (packet.flags & 0x06) != 0; // QoS > 0
+            const size_t variable_header_size = 2 + topic_size + (has_id ? 2 : 0);
+            if (body.size() < variable_header_size) {
+                return std::nullopt;
+            }
+            packet.topic = std::string_view(reinterpret_cast<const char*>(body.data() + 2), topic_size);
+            if (has_id) {
+                packet.packet_id = read_u16_be(body.subspan(2 + topic_size));
+            }
+            packet.payload = body.subspan(variable_header_size);
+            break;
+        }
+        default:
+            // PINGRESP has no body, the rest are not sent by a broker
+            break;
+        }
+        return packet;
+    }
+} // Anonymous namespace
+
+/// @brief Incremental decoder for the packets from the broker
+///
+/// Give it the received bytes in whatever chunks they come, it calls the handler for every complete packet.
+/// A packet that is complete within one chunk is decoded in place, only packets split across chunks are collected
+/// into the internal buffer. Packets that don't fit the buffer are skipped and counted.
+template <size_t capacity> class Decoder {
+public:
+    /// @param handler Called as handler(const Packet&) for every complete packet
+    template <typename Handler> void feed(std::span<const std::byte> data, Handler&& handler)
+    {
+        size_t i = 0;
+        while (i < data.size()) {
+            switch (state) {
+            case State::TYPE:
+                fixed_header = data[i++];
+                remaining = 0;
+                length_bytes = 0;
+                state = State::LENGTH;
+                break;
+            case State::LENGTH: {
+                const std::byte byte = data[i++];
+                remaining |= std::to_integer<size_t>(byte & std::byte { 0x7F }) << (7 * length_bytes);
+                if ((byte & std::byte { 0x80 }) != std::byte { 0 }) {
+                    if (++length_bytes == 4) {
+                        // Remaining length is at most 4 bytes, we have lost the packet boundaries
+                        ++malformed;
+                        state = State::TYPE;
+                    }
+                    break;
+                }
+                buffered = 0;
+                state = State::BODY;
+                if (remaining == 0) {
+                    packet_done(std::span<const std::byte>(), handler);
+                }
+                break;
+            }
+            case State::BODY: {
+                const size_t count = std::min(remaining - buffered, data.size() - i);
+                if (buffered == 0 && count == remaining) {
+                    // The whole body is in this chunk, no need to copy it
+                    packet_done(data.subspan(i, count), handler);
+                } else if (remaining > buffer.size()) {
+                    // Too big for us, skip it
+                    buffered += count;
+                    if (buffered == remaining) {
+                        ++dropped;
+                        state = State::TYPE;
+                    }
+                } else {
+                    std::ranges::copy(data.subspan(i, count), buffer.begin() + buffered);
+                    buffered += count;
+                    if (buffered == remaining) {
+                        packet_done(std::span<const std::byte>(buffer.data(), remaining), handler);
+                    }
+                }
+                i += count;
+                break;
+            }
+            }
+        }
+    }
+
+    /// @brief Forget any partial packet, e.g. after a reconnect
+    void reset() { state = State::TYPE; }
+
+    /// @brief Packets skipped because they didn't fit the buffer
+    [[nodiscard]] uint32_t get_dropped() const { return dropped; }
+    /// @brief Packets that could not be decoded
+    [[nodiscard]] uint32_t get_malformed() const { return malformed; }
+
+private:
+    enum class State : uint8_t { TYPE, LENGTH, BODY };
+
+    std::array<std::byte, capacity> buffer {};
+    State state = State::TYPE;
+    std::byte fixed_header {};
+    size_t remaining = 0;
+    unsigned int length_bytes = 0;
+    size_t buffered = 0;
+    uint32_t dropped = 0;
+    uint32_t malformed = 0;
+
+    template <typename Handler> void packet_done(std::span<const std::byte> body, Handler& handler)
+    {
+        state = State::TYPE;
+        if (const auto packet = parse_packet(fixed_header, body)) {
+            handler(*packet);
+        } else {
+            ++malformed;
+        }
+    }
+};
+
 } // namespace SimpleMQTT
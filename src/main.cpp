@@ -1,3 +1,5 @@
+#include <array>
+#include <cstddef>
 #include <memory>
 
 #include <FreeRTOS.h>
@@ -19,6 +21,93 @@
 extern "C" void initialise_monitor_handles(void);
 #endif
 
+#if CHILI_STATIC_ALLOCATION
+template <uint16_t stack_words> struct StaticTaskMemory {
+    StaticTask_t tcb;
+    std::array<StackType_t, stack_words> stack;
+};
+
+// Everything the tasks need, zeroed in .bss, so nothing can fail to allocate at boot
+static StaticTaskMemory<configMINIMAL_STACK_SIZE> idle_task_memory;
+static StaticTaskMemory<configTIMER_TASK_STACK_DEPTH> timer_task_memory;
+#if CHILI_STANDBY_DUTY_CYCLE
+static_assert(configUSE_TICKLESS_IDLE, "The Standby duty cycle wakes up with the RTC of the tickless idle");
+static StaticTaskMemory<duty_cycle_task_stack_words> duty_cycle_task_memory;
+static constinit DutyCycleTaskArgs duty_cycle_args_storage { &static_devices::temperature, &static_devices::network,
+    &static_devices::rtos, &static_devices::backup };
+#else // CHILI_STANDBY_DUTY_CYCLE -> !CHILI_STANDBY_DUTY_CYCLE
+static StaticTaskMemory<setup_task_stack_words> setup_task_memory;
+static StaticTaskMemory<temperature_task_stack_words> temperature_task_memory;
+static StaticTaskMemory<network_task_stack_words> network_task_memory;
+static StaticTaskMemory<led_task_stack_words> led_task_memory;
+
+static StaticQueue_t measurement_queue_memory;
+static std::array<uint8_t, measurement_queue_size * sizeof(Measurement)> measurement_queue_storage;
+
+static SetupTaskArgs setup_args_storage;
+static TemperatureTaskArgs temperature_args_storage;
+static NetworkTaskArgs network_args_storage;
+static constinit LedTaskArgs led_args_storage(&static_devices::led);
+#endif // CHILI_STANDBY_DUTY_CYCLE
+
+struct RamBudgetEntry {
+    const char* name;
+    size_t bytes;
+};
+
+// What the static allocation mode may take of the 20 KB SRAM, the rest is for the .data and .bss of the drivers,
+// newlib's heap (printf) and the ISR stack. The linker map has the final word.
+static constexpr size_t ram_budget_bytes = 16 * 1024;
+static constexpr std::array ram_budget = {
+#if CHILI_STANDBY_DUTY_CYCLE
+    RamBudgetEntry { "DUTY CYCLE", sizeof(duty_cycle_task_memory) },
+#else // CHILI_STANDBY_DUTY_CYCLE -> !CHILI_STANDBY_DUTY_CYCLE
+    RamBudgetEntry { "SETUP", sizeof(setup_task_memory) },
+    RamBudgetEntry { "TEMPERATURE", sizeof(temperature_task_memory) },
+    RamBudgetEntry { "NETWORK", sizeof(network_task_memory) },
+    RamBudgetEntry { "LED", sizeof(led_task_memory) },
+#endif // CHILI_STANDBY_DUTY_CYCLE
+    RamBudgetEntry { "IDLE", sizeof(idle_task_memory) },
+    RamBudgetEntry { "TIMER", sizeof(timer_task_memory) },
+#if CHILI_STANDBY_DUTY_CYCLE
+    RamBudgetEntry { "task args", sizeof(duty_cycle_args_storage) },
+#else // CHILI_STANDBY_DUTY_CYCLE -> !CHILI_STANDBY_DUTY_CYCLE
+    RamBudgetEntry { "queue", sizeof(measurement_queue_memory) + sizeof(measurement_queue_storage) },
+    RamBudgetEntry { "task args",
+        sizeof(setup_args_storage) + sizeof(temperature_args_storage) + sizeof(network_args_storage)
+            + sizeof(led_args_storage) },
+#endif // CHILI_STANDBY_DUTY_CYCLE
+    RamBudgetEntry { "devices",
+        sizeof(static_devices::rtos) + sizeof(static_devices::temperature) + sizeof(static_devices::network)
+            + sizeof(static_devices::led) + sizeof(static_devices::backup) },
+};
+static constexpr size_t ram_budget_used = [] {
+    size_t bytes = 0;
+    for (const auto& entry : ram_budget) {
+        bytes += entry.bytes;
+    }
+    return bytes;
+}();
+static_assert(ram_budget_used <= ram_budget_bytes, "Static allocations are over the RAM budget");
+
+// FreeRTOS asks for the memory of the tasks it creates itself
+extern "C" void vApplicationGetIdleTaskMemory(
+    StaticTask_t** tcb, StackType_t** stack, uint32_t* stack_words)
+{
+    *tcb = &idle_task_memory.tcb;
+    *stack = idle_task_memory.stack.data();
+    *stack_words = idle_task_memory.stack.size();
+}
+
+extern "C" void vApplicationGetTimerTaskMemory(
+    StaticTask_t** tcb, StackType_t** stack, uint32_t* stack_words)
+{
+    *tcb = &timer_task_memory.tcb;
+    *stack = timer_task_memory.stack.data();
+    *stack_words = timer_task_memory.stack.size();
+}
+#else // CHILI_STATIC_ALLOCATION -> !CHILI_STATIC_ALLOCATION
+static_assert(!CHILI_STANDBY_DUTY_CYCLE, "The Standby duty cycle is only set up with CHILI_STATIC_ALLOCATION");
 // Use static objects to ensure they live forever and are not clobbered by stack reuse
 static std::unique_ptr<ITemperatureSensor> temperature;
 static std::unique_ptr<IRTOS> rtos_adapter;
@@ -29,8 +118,11 @@ static std::unique_ptr<SetupTaskArgs> setup_args;
 static std::unique_ptr<TemperatureTaskArgs> temperature_args;
 static std::unique_ptr<NetworkTaskArgs> network_args;
 static std::unique_ptr<LedTaskArgs> led_args;
+#endif // CHILI_STATIC_ALLOCATION
 
+#if !CHILI_STANDBY_DUTY_CYCLE
 static QueueHandle_t measurement_queue = nullptr;
+#endif // !CHILI_STANDBY_DUTY_CYCLE
 
 int main()
 {
@@ -43,29 +135,68 @@ int main()
     bluepill::setup();
     utils::logger.info("Board setup OK!\n");
 
+#if CHILI_STATIC_ALLOCATION
+    for (const auto& entry : ram_budget) {
+        utils::logger.info("RAM budget: %s %u bytes\n", entry.name, static_cast<unsigned>(entry.bytes));
+    }
+    utils::logger.info("RAM budget: %u of %u bytes\n", static_cast<unsigned>(ram_budget_used),
+        static_cast<unsigned>(ram_budget_bytes));
+
+    static_devices::setup();
+
+#if CHILI_STANDBY_DUTY_CYCLE
+    // One task measures, publishes now and then and goes to Standby, waking up starts over from here
+    xTaskCreateStatic(duty_cycle_task, "DUTY CYCLE", duty_cycle_task_stack_words, &duty_cycle_args_storage,
+        configMAX_PRIORITIES - 1, duty_cycle_task_memory.stack.data(), &duty_cycle_task_memory.tcb);
+#else // CHILI_STANDBY_DUTY_CYCLE -> !CHILI_STANDBY_DUTY_CYCLE
+    // FreeRTOS queue for the the temperature measurements
+    // Temperature task writes to the queue, network task reads from the queue
+    measurement_queue = xQueueCreateStatic(
+        measurement_queue_size, sizeof(Measurement), measurement_queue_storage.data(), &measurement_queue_memory);
+
+    // Fill in the argument structs for the tasks
+    setup_args_storage = { nullptr, nullptr, nullptr, &static_devices::temperature, &static_devices::network };
+    temperature_args_storage = { measurement_queue, &static_devices::temperature };
+    network_args_storage = { measurement_queue, &static_devices::network, &static_devices::rtos };
+
+    // Register tasks to FreeRTOS
+    setup_args_storage.self = xTaskCreateStatic(setup_task, "SETUP", setup_task_stack_words, &setup_args_storage,
+        configMAX_PRIORITIES - 1, setup_task_memory.stack.data(), &setup_task_memory.tcb);
+    setup_args_storage.temperature_task = xTaskCreateStatic(temperature_task, "TEMPERATURE",
+        temperature_task_stack_words, &temperature_args_storage, configMAX_PRIORITIES - 2,
+        temperature_task_memory.stack.data(), &temperature_task_memory.tcb);
+    setup_args_storage.network_task = xTaskCreateStatic(network_task, "NETWORK", network_task_stack_words,
+        &network_args_storage, configMAX_PRIORITIES - 3, network_task_memory.stack.data(), &network_task_memory.tcb);
+    xTaskCreateStatic(led_task, "LED", led_task_stack_words, &led_args_storage, configMAX_PRIORITIES - 4,
+        led_task_memory.stack.data(), &led_task_memory.tcb);
+#endif // CHILI_STANDBY_DUTY_CYCLE
+#else // CHILI_STATIC_ALLOCATION -> !CHILI_STATIC_ALLOCATION
     // FreeRTOS queue for the the temperature measurements
     // Temperature task writes to the queue, network task reads from the queue
-    measurement_queue = xQueueCreate(measurement_queue_size, sizeof(double));
+    measurement_queue = xQueueCreate(measurement_queue_size, sizeof(Measurement));
 
     // Initialize globals
-    temperature = createTemperatureSensor();
     rtos_adapter = createRTOS();
+    temperature = createTemperatureSensor(rtos_adapter.get());
     network = createNetwork(rtos_adapter.get());
     led = createLED();
 
     // Build the argument structs for the tasks
     setup_args = std::make_unique<SetupTaskArgs>(nullptr, nullptr, nullptr, temperature.get(), network.get());
     temperature_args = std::make_unique<TemperatureTaskArgs>(measurement_queue, temperature.get());
-    network_args = std::make_unique<NetworkTaskArgs>(measurement_queue, network.get());
+    network_args = std::make_unique<NetworkTaskArgs>(measurement_queue, network.get(), rtos_adapter.get());
     led_args = std::make_unique<LedTaskArgs>(led.get());
 
     // Register tasks to FreeRTOS
     // We pass the addresses in setup_args directly to xTaskCreate
-    xTaskCreate(setup_task, "SETUP", 256, setup_args.get(), configMAX_PRIORITIES - 1, &setup_args->self);
-    xTaskCreate(temperature_task, "TEMPERATURE", 256, temperature_args.get(), configMAX_PRIORITIES - 2,
-        &setup_args->temperature_task);
-    xTaskCreate(network_task, "NETWORK", 256, network_args.get(), configMAX_PRIORITIES - 3, &setup_args->network_task);
-    xTaskCreate(led_task, "LED", configMINIMAL_STACK_SIZE, led_args.get(), configMAX_PRIORITIES - 4, nullptr);
+    xTaskCreate(setup_task, "SETUP", setup_task_stack_words, setup_args.get(), configMAX_PRIORITIES - 1,
+        &setup_args->self);
+    xTaskCreate(temperature_task, "TEMPERATURE", temperature_task_stack_words, temperature_args.get(),
+        configMAX_PRIORITIES - 2, &setup_args->temperature_task);
+    xTaskCreate(network_task, "NETWORK", network_task_stack_words, network_args.get(), configMAX_PRIORITIES - 3,
+        &setup_args->network_task);
+    xTaskCreate(led_task, "LED", led_task_stack_words, led_args.get(), configMAX_PRIORITIES - 4, nullptr);
+#endif // CHILI_STATIC_ALLOCATION
 
     // Start the FreeRTOS scheduler
     utils::logger.info("Staring RTOS scheduler...\n");
@@ -77,4 +208,4 @@ int main()
     }
 
     return -1; // This will never be reached
-}
\ No newline at end of file
+}
@@ -30,12 +30,17 @@ template <unsigned int bits> constexpr inline uint8_t mask8()
 enum class ErrorCode : uint8_t {
     OK = 0,
     TEMPERATURE_INIT_ERROR = 1,
+    TEMPERATURE_READ_ERROR = 2,
     USART_NOT_SETUP_ERROR = 10,
     NETWORK_RESPONSE_NOT_OK_ERROR = 20,
     NETWORK_RESPONSE_OVERRUN_ERROR = 21,
     NETWORK_RESPONSE_TIMEOUT_ERROR = 22,
     NETWORK_RESPONSE_DMA_ERROR = 23,
+    NETWORK_RESPONSE_RX_OVERFLOW_ERROR = 24,
     MEMORY_ERROR = 30,
+    I2C_NACK_ERROR = 40,
+    I2C_BUS_ERROR = 41,
+    I2C_TIMEOUT_ERROR = 42,
     UNEXPECTED_ERROR = 255
 };
 
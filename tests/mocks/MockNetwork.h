@@ -47,6 +47,19 @@ public:
         return utils::ErrorCode::OK;
     }
 
+    [[nodiscard]] utils::ErrorCode send_socket(
+        unsigned int id, std::span<const std::span<const std::byte>> segments) const override
+    {
+        (void)id;
+        size_t size = 0;
+        for (const auto& segment : segments) {
+            size += segment.size();
+        }
+        utils::logger.info("MockNetwork: send_socket(%u segments, %u bytes) -> OK\n",
+            static_cast<unsigned>(segments.size()), static_cast<unsigned>(size));
+        return utils::ErrorCode::OK;
+    }
+
     [[nodiscard]] utils::ErrorCode close_socket(unsigned int id) override
     {
         (void)id;
@@ -55,7 +68,47 @@ public:
         return utils::ErrorCode::OK;
     }
 
+    [[nodiscard]] std::optional<size_t> receive_socket(
+        unsigned int id, std::span<std::byte> buffer, unsigned int timeout_ms) override
+    {
+        (void)id;
+        (void)buffer;
+        (void)timeout_ms;
+        // Nothing ever arrives
+        if (!socket_connected) {
+            return std::nullopt;
+        }
+        return 0;
+    }
+
+    [[nodiscard]] utils::ErrorCode wake_radio() override
+    {
+        utils::logger.info("MockNetwork: wake_radio() -> OK\n");
+        return utils::ErrorCode::OK;
+    }
+
+    [[nodiscard]] utils::ErrorCode sleep_radio(uint32_t idle_ms) override
+    {
+        utils::logger.info("MockNetwork: sleep_radio(%u ms) -> OK\n", static_cast<unsigned>(idle_ms));
+        return utils::ErrorCode::OK;
+    }
+
+    [[nodiscard]] uint32_t get_radio_wake_latency_ms() const override { return 0; }
+    [[nodiscard]] uint32_t get_radio_on_ms() const override { return 0; }
+
+    [[nodiscard]] utils::ErrorCode deep_sleep() override
+    {
+        utils::logger.info("MockNetwork: deep_sleep() -> OK\n");
+        ap_connected = false;
+        socket_connected = false;
+        return utils::ErrorCode::OK;
+    }
+
+    [[nodiscard]] NetworkWarmHint get_warm_hint() const override { return hint; }
+    void set_warm_hint(const NetworkWarmHint& warm_hint) override { hint = warm_hint; }
+
 private:
+    NetworkWarmHint hint {};
     bool ap_connected = false;
     bool socket_connected = false;
 };
@@ -8,14 +8,22 @@ public:
     mutable std::vector<uint32_t> delays;
     mutable std::vector<uint32_t> notify_waits;
     mutable bool next_notify_wait_result = true;
+    mutable uint32_t time_ms = 0;
 
-    void delay(uint32_t ms) const override { delays.push_back(ms); }
+    void delay(uint32_t ms) const override
+    {
+        delays.push_back(ms);
+        time_ms += ms;
+    }
 
-    uint32_t get_tick_count() const override { return 0; }
+    uint32_t get_tick_count() const override { return time_ms; }
+    uint32_t get_time_ms() const override { return time_ms; }
 
     bool task_notify_wait(uint32_t timeout_ms) const override
     {
         notify_waits.push_back(timeout_ms);
+        // Time passes while waiting, a timeout consumes the whole wait
+        time_ms += next_notify_wait_result ? 1 : timeout_ms;
         return next_notify_wait_result;
     }
 
@@ -8,5 +8,11 @@
 class MockTemperatureSensor final : public ITemperatureSensor {
 public:
     utils::ErrorCode init() const override { return utils::ErrorCode::OK; }
-    std::optional<double> read() const override { return 20.0; }
+    std::optional<centi_celsius_t> read() const override { return 2000; }
+    utils::ErrorCode start_conversion() const override { return utils::ErrorCode::OK; }
+    uint32_t get_conversion_time_ms() const override { return 10; }
+    std::optional<EnvironmentReading> read_environment() const override
+    {
+        return EnvironmentReading { .temperature = 2000, .pressure = 101'325, .humidity = 4500 };
+    }
 };
\ No newline at end of file
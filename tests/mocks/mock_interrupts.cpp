@@ -11,3 +11,4 @@ volatile std::atomic_uint32_t systick_counter = 0;
 void set_network_task_handle_for_tx_dma_interrupts(TaskHandle_t task) { }
 void set_network_task_handle_for_rx_dma_interrupts(TaskHandle_t task) { }
 void set_network_task_handle_for_usart2_interrupts(TaskHandle_t task) { }
+void set_task_handle_for_i2c1_interrupts(TaskHandle_t task) { }
@@ -26,6 +26,7 @@ template <typename T, typename U> static void push_bounded(std::vector<T>& vec,
 // --- Shared Trial Vectors (C++ types, cannot be extern "C") ---
 
 std::vector<MockI2CCall> mock_i2c_calls;
+MockI2CDataRegister mock_i2c_dr;
 std::vector<uint16_t> mock_usart_send_bytes;
 std::vector<MockDMANumberCall> mock_dma_number_calls;
 std::vector<MockDMAAddressCall> mock_dma_periph_addr_calls;
@@ -37,11 +38,16 @@ int mock_usart_recv_blocking_count = 0;
 int mock_dma_enable_channel_count = 0;
 int mock_dma_disable_channel_count = 0;
 uint32_t mock_dma_cndtr = 0;
+uint32_t mock_dwt_cycle_counter = 0;
 
 volatile uint32_t mock_usart_dr = 0;
 volatile uint32_t mock_usart_sr = 0x80; // TXE by default
 volatile uint32_t mock_usart_cr3 = 0;
 volatile uint32_t mock_i2c_cr1 = 0;
+enum i2c_speeds mock_i2c_speed = i2c_speed_sm_100k;
+volatile uint32_t mock_i2c_cr2 = 0;
+volatile uint32_t mock_i2c_sr1 = 0;
+volatile uint32_t mock_i2c_sr2 = 0;
 volatile uint32_t mock_dma_ccr = 0;
 
 uint32_t rcc_apb1_frequency = 36000000;
@@ -65,6 +71,12 @@ const struct rcc_clock_scale rcc_hse_configs[] = { { .pll_mul = 9,
 void mock_libopencm3_reset()
 {
     mock_i2c_calls.clear();
+    mock_i2c_cr1 = 0;
+    mock_i2c_speed = i2c_speed_sm_100k;
+    mock_i2c_cr2 = 0;
+    mock_i2c_sr1 = 0;
+    mock_i2c_sr2 = 0;
+    mock_i2c_dr = MockI2CDataRegister {};
     mock_usart_send_bytes.clear();
     mock_usart_recv_blocking_count = 0;
     mock_dma_number_calls.clear();
@@ -73,6 +85,7 @@ void mock_libopencm3_reset()
     mock_dma_enable_channel_count = 0;
     mock_dma_disable_channel_count = 0;
     mock_dma_cndtr = 0;
+    mock_dwt_cycle_counter = 0;
     mock_usart_sr = 0x80;
 }
 
@@ -119,6 +132,9 @@ void systick_clear() { }
 void systick_counter_enable() { }
 void systick_interrupt_enable() { }
 
+bool dwt_enable_cycle_counter() { return true; }
+uint32_t dwt_read_cycle_counter() { return mock_dwt_cycle_counter; }
+
 void nvic_enable_irq(uint8_t irqn) { (void)irqn; }
 void nvic_set_priority(uint8_t irqn, uint8_t priority)
 {
@@ -132,13 +148,21 @@ void i2c_peripheral_enable(uint32_t i2c) { (void)i2c; }
 void i2c_set_speed(uint32_t i2c, enum i2c_speeds speed, uint32_t clock)
 {
     (void)i2c;
-    (void)speed;
     (void)clock;
+    mock_i2c_speed = speed;
 }
 
 void i2c_reset(uint32_t i2c) { (void)i2c; }
-void i2c_send_start(uint32_t i2c) { (void)i2c; }
-void i2c_send_stop(uint32_t i2c) { (void)i2c; }
+void i2c_send_start(uint32_t i2c)
+{
+    (void)i2c;
+    mock_i2c_cr1 |= I2C_CR1_START;
+}
+void i2c_send_stop(uint32_t i2c)
+{
+    (void)i2c;
+    mock_i2c_cr1 |= I2C_CR1_STOP;
+}
 void i2c_send_data(uint32_t i2c, uint8_t data)
 {
     (void)i2c;
@@ -149,8 +173,16 @@ uint8_t i2c_get_data(uint32_t i2c)
     (void)i2c;
     return 0;
 }
-void i2c_enable_ack(uint32_t i2c) { (void)i2c; }
-void i2c_disable_ack(uint32_t i2c) { (void)i2c; }
+void i2c_enable_ack(uint32_t i2c)
+{
+    (void)i2c;
+    mock_i2c_cr1 |= I2C_CR1_ACK;
+}
+void i2c_disable_ack(uint32_t i2c)
+{
+    (void)i2c;
+    mock_i2c_cr1 &= ~I2C_CR1_ACK;
+}
 void i2c_set_own_7bit_slave_address(uint32_t i2c, uint8_t slave)
 {
     (void)i2c;
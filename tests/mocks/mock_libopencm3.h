@@ -41,6 +41,8 @@ extern "C" {
 extern int mock_dma_enable_channel_count;
 extern int mock_dma_disable_channel_count;
 extern uint32_t mock_dma_cndtr;
+// What dwt_read_cycle_counter() returns, advanced by the tests
+extern uint32_t mock_dwt_cycle_counter;
 #ifdef __cplusplus
 }
 #endif
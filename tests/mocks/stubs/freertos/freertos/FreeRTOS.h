@@ -30,4 +30,5 @@ void vTaskDelay(const TickType_t xTicksToDelay);
 void vTaskDelayUntil(TickType_t* const pxPreviousWakeTime, const TickType_t xTimeIncrement);
 TickType_t xTaskGetTickCount(void);
 void vTaskSuspendAll(void);
+BaseType_t xTaskResumeAll(void);
 void vTaskSuspend(TaskHandle_t xTaskToSuspend);
@@ -36,6 +36,8 @@ TickType_t xTaskGetTickCount(void)
 
 void vTaskSuspendAll(void) { }
 
+BaseType_t xTaskResumeAll(void) { return pdFALSE; }
+
 void vTaskSuspend(TaskHandle_t xTaskToSuspend) { (void)xTaskToSuspend; }
 
 BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char* const pcName, const uint16_t usStackDepth,
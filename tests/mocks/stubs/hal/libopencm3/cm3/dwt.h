@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+bool dwt_enable_cycle_counter();
+uint32_t dwt_read_cycle_counter();
+#ifdef __cplusplus
+}
+#endif
@@ -2,6 +2,8 @@
 
 #include <cstdint>
 
+#define NVIC_I2C1_EV_IRQ 31
+#define NVIC_I2C1_ER_IRQ 32
 #define NVIC_USART1_IRQ 37
 #define NVIC_USART2_IRQ 38
 #define NVIC_DMA1_CHANNEL4_IRQ 14
@@ -40,6 +40,8 @@
 #define GPIO_USART1_RX GPIO10
 #define GPIO_USART2_TX GPIO2
 #define GPIO_USART2_RX GPIO3
+#define GPIO_USART2_CTS GPIO0
+#define GPIO_USART2_RTS GPIO1
 #define GPIO_I2C1_SCL GPIO6
 #define GPIO_I2C1_SDA GPIO7
 
@@ -1,7 +1,5 @@
 #pragma once
 
-#pragma once
-
 #include <cstddef>
 #include <cstdint>
 
@@ -12,12 +10,23 @@
 #define I2C_CR1_ACK (1 << 10)
 #define I2C_CR1_STOP (1 << 9)
 #define I2C_CR1_START (1 << 8)
+#define I2C_CR1_POS (1 << 11)
+#define I2C_CR1_SWRST (1 << 15)
+
+#define I2C_CR2_ITERREN (1 << 8)
+#define I2C_CR2_ITEVTEN (1 << 9)
+#define I2C_CR2_ITBUFEN (1 << 10)
 
 #define I2C_SR1_SB (1 << 0)
 #define I2C_SR1_ADDR (1 << 1)
 #define I2C_SR1_BTF (1 << 2)
 #define I2C_SR1_RxNE (1 << 6)
 #define I2C_SR1_TxE (1 << 7)
+#define I2C_SR1_BERR (1 << 8)
+#define I2C_SR1_ARLO (1 << 9)
+#define I2C_SR1_AF (1 << 10)
+#define I2C_SR1_OVR (1 << 11)
+#define I2C_SR1_TIMEOUT (1 << 14)
 
 #define I2C_SR2_MSL (1 << 0)
 #define I2C_SR2_BUSY (1 << 1)
@@ -43,8 +52,44 @@ void i2c_disable_ack(uint32_t i2c);
 }
 #endif
 
+// The mocks include this inside extern "C"
+extern "C++" {
+#include <deque>
+#include <vector>
+
+// Bytes the driver writes to DR are recorded, reads take the next byte the test queued (0 when empty)
+struct MockI2CDataRegister {
+    std::vector<uint8_t> written;
+    std::deque<uint8_t> to_read;
+
+    MockI2CDataRegister& operator=(uint8_t byte)
+    {
+        written.push_back(byte);
+        return *this;
+    }
+    operator uint8_t()
+    {
+        if (to_read.empty()) {
+            return 0;
+        }
+        const uint8_t byte = to_read.front();
+        to_read.pop_front();
+        return byte;
+    }
+};
+}
+
 extern volatile uint32_t mock_i2c_cr1;
+extern enum i2c_speeds mock_i2c_speed;
+extern volatile uint32_t mock_i2c_cr2;
+extern volatile uint32_t mock_i2c_sr1;
+extern volatile uint32_t mock_i2c_sr2;
+extern MockI2CDataRegister mock_i2c_dr;
 #define I2C_CR1(x) (mock_i2c_cr1)
+#define I2C_CR2(x) (mock_i2c_cr2)
+#define I2C_SR1(x) (mock_i2c_sr1)
+#define I2C_SR2(x) (mock_i2c_sr2)
+#define I2C_DR(x) (mock_i2c_dr)
 
 #ifdef __cplusplus
 extern "C" {
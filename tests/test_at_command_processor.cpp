@@ -2,7 +2,9 @@
 #include "interfaces/IDmaSerial.h"
 #include "mocks/MockRTOS.h"
 #include <doctest/doctest.h>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 // Simple Stub for IDmaSerial
@@ -11,16 +13,89 @@ public:
     mutable std::vector<std::string> log;
 
     // ISerial methods not used by AtCommandProcessor
-    void enable_rx_dma(uint32_t, unsigned int, bool, bool, bool, bool) const override
+    void enable_rx_dma(uintptr_t dest_addr, unsigned int number_of_data, bool, bool half_interrupt,
+        bool complete_interrupt, bool) const override
     {
         log.push_back("enable_rx_dma");
+        rx_buf = reinterpret_cast<volatile char*>(dest_addr);
+        rx_size = number_of_data;
+        rx_count = number_of_data;
+        rx_total = 0;
+        rx_half_and_complete_interrupts = half_interrupt && complete_interrupt;
     }
-    void enable_tx_dma(uint32_t, unsigned int, bool, bool, bool) const override { log.push_back("enable_tx_dma"); }
+    void enable_tx_dma(uintptr_t, unsigned int, bool, bool, bool) const override { }
+    std::optional<TxToken> send_async(const TxRequest& request) const override
+    {
+        log.push_back("send_async");
+        if (queue_full_count > 0) {
+            --queue_full_count;
+            return std::nullopt;
+        }
+        const TxToken token = tx_sent++;
+        // The transfer is done right away, unless the test wants it stuck
+        if (tx_complete) {
+            tx_done_count = tx_sent;
+            if (request.callback != nullptr) {
+                request.callback(request.context);
+            }
+            // The "modem" answers right away
+            receive(reply);
+        }
+        return token;
+    }
+    std::optional<TxToken> send_gather_async(std::span<const TxRequest> requests) const override
+    {
+        log.push_back("send_gather_async");
+        gathered.clear();
+        for (const auto& request : requests) {
+            gathered.append(reinterpret_cast<const char*>(request.data.data()), request.data.size());
+        }
+        tx_sent += requests.size();
+        tx_done_count = tx_sent;
+        return tx_sent - 1;
+    }
+    mutable std::string gathered;
+    bool get_tx_done(TxToken token) const override { return token < tx_done_count; }
+    void cancel_tx() const override
+    {
+        log.push_back("cancel_tx");
+        tx_done_count = tx_sent;
+    }
+    mutable int queue_full_count = 0;
+    mutable TxToken tx_sent = 0;
+    mutable TxToken tx_done_count = 0;
     void disable_rx_dma() const override { }
-    void disable_tx_dma() const override { log.push_back("disable_tx_dma"); }
+    void disable_tx_dma() const override { }
+    void set_baudrate(unsigned int) const override { }
     void tx_complete_interrupt(bool) const override { }
     void error_interrupt(bool) const override { }
-    unsigned int get_dma_count() const override { return 0; }
+    void idle_line_received_interrupt(bool) const override { log.push_back("idle_line_received_interrupt"); }
+    unsigned int get_dma_count() const override
+    {
+        const unsigned int count = rx_count;
+        // More data right after the count was read, as if the DMA interrupt came in between
+        receive(std::exchange(data_after_count_read, {}));
+        return count;
+    }
+    mutable std::string data_after_count_read;
+    uint32_t get_rx_dma_half_count() const override { return rx_total / (rx_size / 2); }
+
+    // Simulated circular RX DMA, the count register counts down and reloads
+    mutable volatile char* rx_buf = nullptr;
+    mutable unsigned int rx_size = 0;
+    mutable unsigned int rx_count = 0;
+    mutable uint32_t rx_total = 0;
+    mutable bool rx_half_and_complete_interrupts = false;
+    mutable std::string reply;
+
+    void receive(std::string_view data) const
+    {
+        for (char c : data) {
+            rx_buf[rx_size - rx_count] = c;
+            rx_count = (rx_count == 1) ? rx_size : rx_count - 1;
+            ++rx_total;
+        }
+    }
 
     // Flags control
     mutable bool tx_complete = true;
@@ -50,21 +125,208 @@ TEST_CASE("AtCommandProcessor interactions")
     SUBCASE("init enables rx dma")
     {
         processor.start_rx_dma();
+        CHECK(serial.log.size() == 2);
+        CHECK(serial.log[0] == "idle_line_received_interrupt");
+        CHECK(serial.log[1] == "enable_rx_dma");
+        CHECK(serial.rx_half_and_complete_interrupts);
+    }
+
+    SUBCASE("send_raw queues the data and returns when it has gone out")
+    {
+        std::string cmd_str = "AT\r\n";
+        std::span<const std::byte> cmd(reinterpret_cast<const std::byte*>(cmd_str.data()), cmd_str.size());
+        CHECK(processor.send_raw(cmd) == utils::ErrorCode::OK);
+
         CHECK(serial.log.size() == 1);
-        CHECK(serial.log[0] == "enable_rx_dma");
+        CHECK(serial.log[0] == "send_async");
+        // Already done, no need to wait
+        CHECK(rtos.notify_waits.empty());
     }
 
-    SUBCASE("send_raw enables tx dma and waits for notification")
+    SUBCASE("send_raw waits for the transfer and cancels it on timeout")
     {
+        serial.tx_complete = false;
         std::string cmd_str = "AT\r\n";
         std::span<const std::byte> cmd(reinterpret_cast<const std::byte*>(cmd_str.data()), cmd_str.size());
-        processor.send_raw(cmd);
+        CHECK(processor.send_raw(cmd) == utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR);
 
         CHECK(serial.log.size() == 2);
-        CHECK(serial.log[0] == "enable_tx_dma");
-        CHECK(serial.log[1] == "disable_tx_dma"); // disabled after wait
+        CHECK(serial.log[1] == "cancel_tx");
+        REQUIRE(rtos.notify_waits.size() >= 1);
+        // Default slack + 4 bytes at 115200 baud (+ the time the ESP8266 may hold us off with CTS)
+        const unsigned int timeout_ms = 11 + (bluepill::NETWORK_FLOW_CONTROL ? 1000 : 0);
+        CHECK(rtos.notify_waits[0] == timeout_ms);
+        CHECK(rtos.time_ms >= timeout_ms);
+    }
+
+    SUBCASE("send_raw waits for room in a full TX queue")
+    {
+        serial.queue_full_count = 2;
+        std::string cmd_str = "AT\r\n";
+        CHECK(processor.send_raw(std::as_bytes(std::span(cmd_str))) == utils::ErrorCode::OK);
+        CHECK(serial.log.size() == 3);
+        CHECK(serial.tx_sent == 1);
+        CHECK(rtos.notify_waits.size() == 2);
+    }
+
+    SUBCASE("a lost command is reported")
+    {
+        processor.start_rx_dma();
+        serial.queue_full_count = 1'000;
+        std::string cmd_str = "AT\r\n";
+        CHECK(processor.send_raw(std::as_bytes(std::span(cmd_str))) == utils::ErrorCode::MEMORY_ERROR);
+        CHECK(serial.tx_sent == 0);
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::MEMORY_ERROR);
+    }
+
+    SUBCASE("send_gather sends the segments in one go")
+    {
+        std::string header = "head";
+        std::string payload = "payload";
+        const std::array<std::span<const std::byte>, 3> segments
+            = { std::as_bytes(std::span(header)), std::span<const std::byte>(), std::as_bytes(std::span(payload)) };
+        CHECK(processor.send_gather(segments, 100) == utils::ErrorCode::OK);
+        CHECK(serial.log.size() == 1);
+        CHECK(serial.log[0] == "send_gather_async");
+        // Empty segments are skipped
+        CHECK(serial.gathered == "headpayload");
+
+        const std::array<std::span<const std::byte>, 5> too_many = { segments[0], segments[0], segments[0],
+            segments[0], segments[0] };
+        CHECK(processor.send_gather(too_many, 100) == utils::ErrorCode::MEMORY_ERROR);
+    }
+
+    SUBCASE("send_async returns a token and calls the callback")
+    {
+        std::string data = "payload";
+        int calls = 0;
+        auto token = processor.send_async(
+            std::as_bytes(std::span(data)), [](void* context) { ++*static_cast<int*>(context); }, &calls);
+        REQUIRE(token.has_value());
+        CHECK(processor.get_tx_done(*token));
+        CHECK(calls == 1);
+    }
+}
+
+TEST_CASE("AtCommandProcessor send_command response detection")
+{
+    StubDmaSerial serial;
+    MockRTOS rtos;
+    AtCommandProcessor processor(&serial, &rtos);
+    processor.start_rx_dma();
+
+    SUBCASE("returns as soon as the final result code has arrived")
+    {
+        serial.reply = "AT\r\n\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+        // The transfer was done and the response was already there, no waiting at all
+        CHECK(rtos.notify_waits.empty());
+        CHECK(rtos.time_ms < 1000);
+    }
+
+    SUBCASE("error result code ends the response early")
+    {
+        serial.reply = "\r\nERROR\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        CHECK(rtos.time_ms < 1000);
+    }
+
+    SUBCASE("expected line before the final result code")
+    {
+        serial.reply = "+CWJAP_DEF:\"AP\"\r\n";
+        CHECK(processor.send_command(esp8266::commands::QUERY_AP_DEF, "+CWJAP_DEF:\"AP\"") == utils::ErrorCode::OK);
+        // Matched, but waited for the final result code until the timeout
+        CHECK(rtos.time_ms >= 1000);
+    }
+
+    SUBCASE("OK before the expected line does not end the response")
+    {
+        serial.reply = "OK\r\n garbage \r\nready\r\n";
+        CHECK(processor.send_command(esp8266::commands::RESET, "ready", 10'000) == utils::ErrorCode::OK);
+        CHECK(rtos.time_ms < 10'000);
+    }
+
+    SUBCASE("no response times out")
+    {
+        rtos.next_notify_wait_result = false;
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        CHECK(rtos.time_ms >= 1000);
+    }
+
+    SUBCASE("response split across the end of the RX buffer")
+    {
+        // Move the DMA write position close to the end of the ring
+        serial.reply = std::string(2040, 'x') + "\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+        serial.reply = "\r\nSEND OK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "SEND OK") == utils::ErrorCode::OK);
+    }
+
+    SUBCASE("high water mark tracks the largest unparsed burst")
+    {
+        serial.reply = "AT\r\n\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+        CHECK(processor.get_rx_high_water_mark() == serial.reply.size());
+        // Each wrap of the ring is counted through the half/complete transfer events
+        for (int i = 0; i < 4; ++i) {
+            serial.reply = std::string(1500, 'x') + "\r\nOK\r\n";
+            CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+        }
+        CHECK(processor.get_rx_high_water_mark() == 1506);
+    }
+
+    SUBCASE("a half transfer interrupt while the DMA position is read doesn't count a whole ring")
+    {
+        // Just short of the middle of the ring
+        serial.reply = std::string(1010, 'x') + "\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+        serial.reply = "\r\nOK\r\n";
+        serial.data_after_count_read = std::string(40, 'x');
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+        CHECK(processor.get_rx_high_water_mark() < 2048);
+        serial.reply = "\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+    }
+
+    SUBCASE("burst larger than the RX buffer is detected")
+    {
+        serial.reply = std::string(3000, 'x') + "\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK")
+            == utils::ErrorCode::NETWORK_RESPONSE_RX_OVERFLOW_ERROR);
+        CHECK(processor.get_rx_high_water_mark() == 3006);
+        // Back in sync afterwards
+        serial.reply = "\r\nOK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "OK") == utils::ErrorCode::OK);
+    }
+}
+
+TEST_CASE("AtCommandProcessor +IPD data")
+{
+    StubDmaSerial serial;
+    MockRTOS rtos;
+    AtCommandProcessor processor(&serial, &rtos);
+    std::string received;
+    processor.set_ipd_handler(
+        [](void* context, unsigned int, std::span<const volatile char> data) {
+            for (char c : data) {
+                static_cast<std::string*>(context)->push_back(c);
+            }
+        },
+        &received);
+    processor.start_rx_dma();
 
-        CHECK(rtos.notify_waits.size() == 1);
-        CHECK(rtos.notify_waits[0] == 10); // default timeout
+    SUBCASE("pump routes data that arrived between commands")
+    {
+        // CONNACK
+        serial.receive(std::string_view("\r\n+IPD,0,4:\x20\x02\x00\x00", 15));
+        processor.pump();
+        CHECK(received == std::string("\x20\x02\x00\x00", 4));
+    }
+
+    SUBCASE("data in the middle of a response does not disturb it")
+    {
+        serial.reply = "\r\n+IPD,1,6:ERROR\n\r\nSEND OK\r\n";
+        CHECK(processor.send_command(esp8266::commands::TEST, "SEND OK") == utils::ErrorCode::OK);
+        CHECK(received == "ERROR\n");
     }
 }
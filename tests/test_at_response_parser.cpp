@@ -0,0 +1,214 @@
+#include "AtResponseParser.h"
+#include <array>
+#include <doctest/doctest.h>
+#include <string>
+#include <string_view>
+
+using esp8266::AtResponseParser;
+using esp8266::LineType;
+using esp8266::ResultCode;
+
+namespace {
+
+// Minimal circular buffer, written like the RX DMA would
+struct Received {
+    unsigned int link_id = 0;
+    std::string data;
+    int chunks = 0;
+};
+
+void collect_ipd(void* context, unsigned int link_id, std::span<const volatile char> data)
+{
+    auto* received = static_cast<Received*>(context);
+    received->link_id = link_id;
+    for (char c : data) {
+        received->data.push_back(c);
+    }
+    ++received->chunks;
+}
+
+struct Ring {
+    std::array<volatile char, 32> buf {};
+    size_t write_idx = 0;
+
+    void write(std::string_view data)
+    {
+        for (char c : data) {
+            buf[write_idx] = c;
+            write_idx = (write_idx + 1) % buf.size();
+        }
+    }
+};
+
+}
+
+TEST_CASE("AtResponseParser")
+{
+    Ring ring;
+    AtResponseParser parser(std::span<const volatile char>(ring.buf.data(), ring.buf.size()));
+    parser.reset();
+
+    SUBCASE("OK response")
+    {
+        parser.expect("OK");
+        ring.write("AT\r\n\r\nOK\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_done());
+        CHECK(parser.get_matched());
+        CHECK_FALSE(parser.get_error());
+        CHECK(parser.get_result() == ResultCode::OK);
+        CHECK(parser.get_last_line_type() == LineType::FINAL_RESULT);
+    }
+
+    SUBCASE("ERROR response")
+    {
+        parser.expect("OK");
+        ring.write("AT+FOO\r\nERROR\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_done());
+        CHECK_FALSE(parser.get_matched());
+        CHECK(parser.get_error());
+        CHECK(parser.get_result() == ResultCode::ERROR);
+    }
+
+    SUBCASE("Final result before the expected line does not end the response")
+    {
+        parser.expect("ready");
+        ring.write("AT+RST\r\n\r\nOK\r\n");
+        parser.consume(ring.write_idx);
+        CHECK_FALSE(parser.get_done());
+        ring.write("junk\r\nready\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_done());
+        CHECK(parser.get_result() == ResultCode::READY);
+    }
+
+    SUBCASE("Lines wrapping around the end of the buffer")
+    {
+        parser.expect("GOT IP");
+        // Move the write position close to the end of the buffer
+        ring.write("AT+CWJAP=\"a\",\"b\"\r\n\r\nWIF");
+        parser.consume(ring.write_idx);
+        ring.write("I GOT IP\r\n\r\nOK\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_done());
+        CHECK(parser.get_matched());
+        CHECK(parser.get_result() == ResultCode::OK);
+        CHECK(parser.get_unsolicited_count() == 1);
+    }
+
+    SUBCASE("Byte by byte consumption and overlapping match")
+    {
+        parser.expect("aab");
+        for (char c : std::string_view("aaab\r\nOK\r\n")) {
+            ring.write(std::string_view(&c, 1));
+            parser.consume(ring.write_idx);
+        }
+        CHECK(parser.get_done());
+        CHECK(parser.get_matched());
+        CHECK(parser.get_read_index() == ring.write_idx);
+    }
+
+    SUBCASE("Partial line counts as a match")
+    {
+        parser.expect(">");
+        ring.write("AT+CIPSEND=4\r\n\r\nOK\r\n>");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_matched());
+        CHECK_FALSE(parser.get_error());
+    }
+
+    SUBCASE("Unsolicited lines are classified")
+    {
+        parser.expect("OK");
+        ring.write("CLOSED\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_last_line_type() == LineType::UNSOLICITED);
+        ring.write("+CWJAP:x\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_last_line_type() == LineType::DATA);
+        CHECK(parser.get_unsolicited_count() == 1);
+        CHECK_FALSE(parser.get_done());
+    }
+
+    SUBCASE("+IPD payload goes to the handler and is not parsed as lines")
+    {
+        Received received;
+        parser.set_ipd_handler(collect_ipd, &received);
+        parser.expect("SEND OK");
+        // The payload wraps around the end of the ring and looks like a final result code
+        ring.write(std::string(20, 'x') + "\r\n");
+        parser.consume(ring.write_idx);
+        ring.write("+IPD,3,6:OK\r\nab\r\nSEND OK\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(received.link_id == 3);
+        CHECK(received.data == "OK\r\nab");
+        CHECK(received.chunks == 2);
+        CHECK_FALSE(parser.get_in_ipd_data());
+        CHECK(parser.get_done());
+        CHECK(parser.get_result() == ResultCode::SEND_OK);
+    }
+
+    SUBCASE("+IPD payload split across consume calls")
+    {
+        Received received;
+        parser.set_ipd_handler(collect_ipd, &received);
+        parser.expect("OK");
+        ring.write("+IPD,4:ab");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_in_ipd_data());
+        ring.write("cd\r\nOK\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(received.link_id == 0);
+        CHECK(received.data == "abcd");
+        CHECK(parser.get_done());
+    }
+
+    SUBCASE("Link status lines")
+    {
+        parser.expect("OK");
+        ring.write("0,CONNECT\r\n2,CLOSED\r\n");
+        parser.consume(ring.write_idx);
+        ring.write("4,CONNECT FAIL\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_unsolicited_count() == 3);
+        CHECK_FALSE(parser.get_done());
+        CHECK(parser.take_closed_links() == ((1U << 2) | (1U << 4)));
+        CHECK(parser.take_closed_links() == 0);
+    }
+
+    SUBCASE("An expected line longer than the limit fails instead of matching a truncated one")
+    {
+        const std::string too_long(AtResponseParser::max_expected_size + 1, 'x');
+        parser.expect(too_long);
+        CHECK(parser.get_done());
+        CHECK(parser.get_error());
+        ring.write("xxxx\r\nOK\r\n");
+        parser.consume(ring.write_idx);
+        CHECK_FALSE(parser.get_matched());
+        CHECK(parser.get_error());
+        parser.expect(too_long.substr(1));
+        CHECK_FALSE(parser.get_done());
+    }
+
+    SUBCASE("UNLINK is remembered until the next command")
+    {
+        parser.expect("OK");
+        ring.write("UNLINK\r\n\r\nERROR\r\n");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_error());
+        CHECK(parser.get_unlinked());
+        parser.expect("OK");
+        CHECK_FALSE(parser.get_unlinked());
+    }
+
+    SUBCASE("Send prompt ends the response")
+    {
+        parser.expect(">");
+        ring.write("AT+CIPSEND=0,5\r\n\r\nOK\r\n> ");
+        parser.consume(ring.write_idx);
+        CHECK(parser.get_done());
+        CHECK(parser.get_matched());
+        CHECK(parser.get_result() == ResultCode::PROMPT);
+    }
+}
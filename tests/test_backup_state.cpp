@@ -0,0 +1,132 @@
+#include "BackupState.h"
+#include <array>
+#include <cstdint>
+#include <doctest/doctest.h>
+
+namespace {
+
+// The 10 registers of the STM32F103 minus the one for the RTC calibration
+class FakeBackupRegisters final : public IBackupRegisters {
+public:
+    mutable std::array<uint16_t, 9> values {};
+
+    [[nodiscard]] size_t size() const override { return values.size(); }
+    [[nodiscard]] uint16_t read(size_t index) const override { return values.at(index); }
+    void write(size_t index, uint16_t value) const override { values.at(index) = value; }
+};
+
+constexpr uint32_t period_ms = 10'000;
+
+} // namespace
+
+TEST_CASE("BackupState")
+{
+    FakeBackupRegisters registers;
+    const BackupState state(registers, period_ms);
+
+    REQUIRE_FALSE(state.load());
+    REQUIRE(state.capacity() == 3);
+
+    SUBCASE("power loss starts over")
+    {
+        registers.values.fill(0xABCD);
+        CHECK_FALSE(state.load());
+        CHECK(state.empty());
+        CHECK(state.get_next_packet_id() == 0);
+        CHECK(state.get_network_hint().baudrate == 0);
+        CHECK_FALSE(state.get_network_hint().ap_joined);
+        CHECK(state.load());
+    }
+
+    SUBCASE("readings survive another instance, as after a wake-up")
+    {
+        CHECK(state.add(100'000, { .temperature = 2150, .pressure = 101'325, .humidity = 4'567 }));
+        CHECK(state.add(110'003, { .temperature = 2119, .pressure = 101'356, .humidity = 4'504 }));
+        const BackupState woken(registers, period_ms);
+        CHECK(woken.load());
+        REQUIRE(woken.size() == 2);
+        CHECK(woken.get_first_time_ms() == 100'000);
+        CHECK(woken.get(0)->temperature == 2150);
+        CHECK(woken.get(0)->pressure == 101'325);
+        CHECK(woken.get(0)->humidity == 4'567);
+        CHECK(woken.get_time_ms(1) == 110'000);
+        CHECK(woken.get(1)->temperature == 2119);
+        CHECK(woken.get(1)->pressure == 101'356);
+        CHECK(woken.get(1)->humidity == 4'504);
+        CHECK_FALSE(woken.get(2));
+    }
+
+    SUBCASE("a wake-up without a reading leaves a gap")
+    {
+        CHECK(state.add(0xFFFF'0000, { .temperature = -2000, .pressure = 90'000, .humidity = 10'000 }));
+        const EnvironmentReading later { .temperature = -1990, .pressure = 89'990, .humidity = 9'990 };
+        CHECK(state.add(0xFFFF'0000 + 2 * period_ms - 5, later));
+        CHECK(state.full());
+        CHECK_FALSE(state.get(1));
+        CHECK(state.get_time_ms(2) == 0xFFFF'0000 + 2 * period_ms);
+        // The deltas skip the missing slot
+        CHECK(state.get(2)->temperature == -1990);
+        CHECK(state.get(2)->pressure == 89'990);
+        CHECK(state.get(2)->humidity == 9'990);
+    }
+
+    SUBCASE("full until cleared")
+    {
+        const EnvironmentReading reading { .temperature = 2000, .pressure = 100'000, .humidity = 5'000 };
+        for (uint32_t i = 0; i < 3; ++i) {
+            CHECK(state.add(i * period_ms, reading));
+        }
+        CHECK_FALSE(state.add(3 * period_ms, reading));
+        CHECK_FALSE(state.add(4 * period_ms, reading));
+        state.clear();
+        CHECK(state.empty());
+        CHECK(state.add(4 * period_ms, reading));
+        CHECK(state.get_first_time_ms() == 4 * period_ms);
+    }
+
+    SUBCASE("a reading too far from the previous one doesn't fit")
+    {
+        const EnvironmentReading first { .temperature = 2000, .pressure = 100'000, .humidity = 5'000 };
+        CHECK(state.add(0, first));
+        CHECK_FALSE(state.add(period_ms, { .temperature = 2032, .pressure = 100'000, .humidity = 5'000 }));
+        CHECK_FALSE(state.add(period_ms, { .temperature = 1968, .pressure = 100'000, .humidity = 5'000 }));
+        CHECK_FALSE(state.add(period_ms, { .temperature = 2000, .pressure = 100'032, .humidity = 5'000 }));
+        CHECK_FALSE(state.add(period_ms, { .temperature = 2000, .pressure = 100'000, .humidity = 4'935 }));
+        CHECK(state.size() == 1);
+        CHECK(state.add(period_ms, { .temperature = 2031, .pressure = 99'968, .humidity = 5'063 }));
+        CHECK(state.get(1)->temperature == 2031);
+        CHECK(state.get(1)->pressure == 99'968);
+        CHECK(state.get(1)->humidity == 5'063);
+    }
+
+    SUBCASE("out of range first readings are clamped")
+    {
+        CHECK(state.add(0, { .temperature = 40'000, .pressure = 200'000, .humidity = 20'000 }));
+        CHECK(state.get(0)->temperature == INT16_MAX);
+        CHECK(state.get(0)->pressure == (1U << 17) - 1);
+        CHECK(state.get(0)->humidity == (1U << 14) - 1);
+        state.clear();
+        CHECK(state.add(0, { .temperature = -40'000, .pressure = 0, .humidity = 0 }));
+        CHECK(state.get(0)->temperature == INT16_MIN);
+    }
+
+    SUBCASE("packet id and network hint are independent of the samples")
+    {
+        state.set_next_packet_id(0x12FE);
+        state.set_network_hint({ .baudrate = 2'000'000, .ap_joined = true });
+        CHECK(state.add(0, { .temperature = 2000, .pressure = 100'000, .humidity = 5'000 }));
+        state.clear();
+        // Past the block the last wake-up used
+        CHECK(state.get_next_packet_id() == 0x1300);
+        CHECK(state.get_network_hint().baudrate == 2'000'000);
+        CHECK(state.get_network_hint().ap_joined);
+        state.set_network_hint({ .baudrate = bluepill::NETWORK_BAUDRATE, .ap_joined = false });
+        CHECK(state.get_network_hint().baudrate == bluepill::NETWORK_BAUDRATE);
+        CHECK_FALSE(state.get_network_hint().ap_joined);
+        // Not one that's ever negotiated
+        state.set_network_hint({ .baudrate = 9'600, .ap_joined = true });
+        CHECK(state.get_network_hint().baudrate == 0);
+        state.set_next_packet_id(0xFF01);
+        CHECK(state.get_next_packet_id() == 0);
+    }
+}
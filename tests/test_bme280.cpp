@@ -1,25 +1,43 @@
 #include "BME280TemperatureSensor.h"
 #include "I2C.h"
 #include "doctest.h"
+#include "mock_libopencm3.h"
 #include "test_events.h"
 
 #include <array>
 #include <optional>
+#include <vector>
 
 TEST_CASE("BME280TemperatureSensor read/write register via I2C")
 {
+    mock_libopencm3_reset();
     I2C i2c1(BluePillI2C::_1, RCC_I2C1, RST_I2C1);
     BME280TemperatureSensor sensor(&i2c1, BME280I2CBusAddr::PRIMARY);
 
-    // Exercise write_reg/read_reg which use the I2C wrapper. The underlying
-    // libopencm3 calls are simulated, so these should be no-ops and not crash.
-    std::array<uint8_t, 2> w = { 0xAA, 0xBB };
-    sensor.write_reg(0x10, w);
+    // Register address and data go out in one transaction
+    std::array<uint8_t, 3> w = { 0xAA, 0xF5, 0xBB };
+    CHECK(sensor.write_reg(0xF4, w) == utils::ErrorCode::OK);
+    REQUIRE(mock_i2c_calls.size() == 1);
+    CHECK(mock_i2c_calls[0].addr == BME280_I2C_ADDR_PRIM);
+    CHECK(mock_i2c_calls[0].wdata == std::vector<uint8_t> { 0xF4, 0xAA, 0xF5, 0xBB });
+    CHECK(mock_i2c_calls[0].rlen == 0);
 
-    std::array<uint8_t, 2> r = {};
-    sensor.read_reg(0x10, r);
+    // Register address, repeated start and the read in one transaction
+    std::array<uint8_t, 8> r = {};
+    CHECK(sensor.read_reg(0xF7, r) == utils::ErrorCode::OK);
+    REQUIRE(mock_i2c_calls.size() == 2);
+    CHECK(mock_i2c_calls[1].wdata == std::vector<uint8_t> { 0xF7 });
+    CHECK(mock_i2c_calls[1].rlen == r.size());
+}
 
-    // We don't expect any meaningful data from the backend, just that
-    // the calls complete without error.
-    CHECK(true);
-}
\ No newline at end of file
+TEST_CASE("BME280TemperatureSensor starts a forced conversion with one register write")
+{
+    mock_libopencm3_reset();
+    I2C i2c1(BluePillI2C::_1, RCC_I2C1, RST_I2C1);
+    BME280TemperatureSensor sensor(&i2c1, BME280I2CBusAddr::PRIMARY);
+
+    CHECK(sensor.start_conversion() == utils::ErrorCode::OK);
+    // The driver may read ctrl_meas first, the conversion starts with the write of the forced mode bits
+    REQUIRE_FALSE(mock_i2c_calls.empty());
+    CHECK(mock_i2c_calls.back().wdata == std::vector<uint8_t> { 0xF4, BME280_POWERMODE_FORCED });
+}
@@ -0,0 +1,99 @@
+#include "DmaTxQueue.h"
+#include <array>
+#include <doctest/doctest.h>
+#include <string_view>
+
+namespace {
+
+std::span<const std::byte> bytes(std::string_view str) { return std::as_bytes(std::span(str)); }
+
+}
+
+TEST_CASE("DmaTxQueue")
+{
+    DmaTxQueue<4> queue;
+    TxToken first = 0;
+    TxToken second = 0;
+
+    SUBCASE("first request claims the idle transmitter")
+    {
+        REQUIRE(queue.push({ .data = bytes("first") }, first));
+        const auto* request = queue.claim();
+        REQUIRE(request != nullptr);
+        CHECK(request->data.size() == 5);
+        CHECK(queue.is_busy());
+        CHECK_FALSE(queue.is_done(first));
+
+        // Transmitter is busy, the second request waits in the queue
+        REQUIRE(queue.push({ .data = bytes("second") }, second));
+        CHECK(queue.claim() == nullptr);
+
+        // The completion of the first starts the second
+        const auto* next = queue.complete();
+        REQUIRE(next != nullptr);
+        CHECK(next->data.size() == 6);
+        CHECK(queue.is_done(first));
+        CHECK_FALSE(queue.is_done(second));
+
+        CHECK(queue.complete() == nullptr);
+        CHECK(queue.is_done(second));
+        CHECK_FALSE(queue.is_busy());
+        CHECK(queue.size() == 0);
+    }
+
+    SUBCASE("callback is called on completion")
+    {
+        int calls = 0;
+        REQUIRE(queue.push(
+            { .data = bytes("x"), .callback = [](void* context) { ++*static_cast<int*>(context); }, .context = &calls },
+            first));
+        REQUIRE(queue.claim() != nullptr);
+        CHECK(calls == 0);
+        (void)queue.complete();
+        CHECK(calls == 1);
+    }
+
+    SUBCASE("full queue rejects requests")
+    {
+        TxToken token = 0;
+        for (int i = 0; i < 4; ++i) {
+            CHECK(queue.push({ .data = bytes("x") }, token));
+        }
+        CHECK_FALSE(queue.push({ .data = bytes("x") }, token));
+        REQUIRE(queue.claim() != nullptr);
+        (void)queue.complete();
+        CHECK(queue.push({ .data = bytes("x") }, token));
+    }
+
+    SUBCASE("gather requests are queued all or nothing")
+    {
+        const std::array<TxRequest, 3> requests
+            = { TxRequest { .data = bytes("a") }, TxRequest { .data = bytes("bb") }, TxRequest { .data = bytes("c") } };
+        REQUIRE(queue.push(requests, first));
+        CHECK(queue.size() == 3);
+        CHECK_FALSE(queue.push(requests, second));
+        CHECK(queue.size() == 3);
+
+        // Chained from completion to completion, the token is done after the last one
+        REQUIRE(queue.claim() != nullptr);
+        const auto* next = queue.complete();
+        REQUIRE(next != nullptr);
+        CHECK(next->data.size() == 2);
+        CHECK_FALSE(queue.is_done(first));
+        REQUIRE(queue.complete() != nullptr);
+        CHECK(queue.complete() == nullptr);
+        CHECK(queue.is_done(first));
+    }
+
+    SUBCASE("clear drops everything")
+    {
+        REQUIRE(queue.push({ .data = bytes("first") }, first));
+        REQUIRE(queue.push({ .data = bytes("second") }, second));
+        REQUIRE(queue.claim() != nullptr);
+        queue.clear();
+        CHECK(queue.is_done(first));
+        CHECK(queue.is_done(second));
+        CHECK_FALSE(queue.is_busy());
+        CHECK(queue.complete() == nullptr);
+    }
+}
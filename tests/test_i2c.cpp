@@ -1,8 +1,12 @@
 #include "I2C.h"
+#include "MockRTOS.h"
+#include "System.h"
 #include "doctest.h"
+#include "mock_libopencm3.h"
 #include "utils.h"
 
 #include <array>
+#include <functional>
 #include <span>
 
 #include "test_events.h"
@@ -53,3 +57,283 @@ TEST_CASE("I2C basic operations")
         CHECK(last.data[1] == 1);
     }
 }
+
+namespace {
+
+// Runs the bus side of a transfer from inside the wait like the interrupts would
+class BusRTOS : public MockRTOS {
+public:
+    std::function<void()> bus;
+
+    bool task_notify_wait(uint32_t timeout_ms) const override
+    {
+        if (bus) {
+            bus();
+        }
+        return MockRTOS::task_notify_wait(timeout_ms);
+    }
+};
+
+bool event(const I2C& i2c, uint32_t sr1)
+{
+    mock_i2c_sr1 = sr1;
+    return i2c.event_isr();
+}
+
+constexpr uint32_t interrupt_enable_bits = I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_ITERREN;
+
+}
+
+TEST_CASE("I2C combined transfers without an RTOS")
+{
+    mock_libopencm3_reset();
+    I2C i2c(BluePillI2C::_1, RCC_I2C1, RST_I2C1);
+
+    const std::array<uint8_t, 1> reg = { 0xD0 };
+    std::array<uint8_t, 2> data = {};
+    CHECK(i2c.write_read(0x76, reg, data) == utils::ErrorCode::OK);
+    REQUIRE(mock_i2c_calls.size() == 1);
+    CHECK(mock_i2c_calls[0].wdata == std::vector<uint8_t> { 0xD0 });
+    CHECK(mock_i2c_calls[0].rlen == 2);
+
+    const std::array<uint8_t, 2> payload = { 0x01, 0x02 };
+    const std::array<std::span<const uint8_t>, 2> segments = { reg, payload };
+    CHECK(i2c.write_gather(0x76, segments) == utils::ErrorCode::OK);
+    REQUIRE(mock_i2c_calls.size() == 2);
+    CHECK(mock_i2c_calls[1].wdata == std::vector<uint8_t> { 0xD0, 0x01, 0x02 });
+
+    const std::array<uint8_t, I2C::max_polling_gather_size> big = {};
+    const std::array<std::span<const uint8_t>, 2> too_much = { reg, big };
+    CHECK(i2c.write_gather(0x76, too_much) == utils::ErrorCode::MEMORY_ERROR);
+    CHECK(mock_i2c_calls.size() == 2);
+}
+
+TEST_CASE("I2C interrupt driven transfers")
+{
+    mock_libopencm3_reset();
+    I2C i2c(BluePillI2C::_1, RCC_I2C1, RST_I2C1);
+    BusRTOS rtos;
+    i2c.set_rtos(&rtos);
+
+    SUBCASE("write")
+    {
+        const std::array<uint8_t, 2> data = { 0x10, 0x20 };
+        rtos.bus = [&] {
+            CHECK((mock_i2c_cr1 & I2C_CR1_START) != 0);
+            CHECK((mock_i2c_cr2 & interrupt_enable_bits) == interrupt_enable_bits);
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            CHECK_FALSE(event(i2c, I2C_SR1_TxE));
+            CHECK_FALSE(event(i2c, I2C_SR1_TxE));
+            // Only BTF after the last byte
+            CHECK((mock_i2c_cr2 & I2C_CR2_ITBUFEN) == 0);
+            CHECK(event(i2c, I2C_SR1_TxE | I2C_SR1_BTF));
+        };
+        CHECK(i2c.write(0x76, data) == utils::ErrorCode::OK);
+        CHECK(mock_i2c_dr.written == std::vector<uint8_t> { 0xEC, 0x10, 0x20 });
+        CHECK((mock_i2c_cr1 & I2C_CR1_STOP) != 0);
+        CHECK((mock_i2c_cr2 & interrupt_enable_bits) == 0);
+        CHECK(rtos.notify_waits.size() == 1);
+        CHECK(mock_i2c_calls.empty());
+    }
+
+    SUBCASE("read one byte")
+    {
+        uint8_t data = 0;
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            mock_i2c_cr1 |= I2C_CR1_ACK;
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            // NACK and STOP are set up before the byte arrives
+            CHECK((mock_i2c_cr1 & I2C_CR1_ACK) == 0);
+            CHECK((mock_i2c_cr1 & I2C_CR1_STOP) != 0);
+            mock_i2c_dr.to_read = { 0x60 };
+            CHECK(event(i2c, I2C_SR1_RxNE));
+        };
+        CHECK(i2c.read(0x76, data) == utils::ErrorCode::OK);
+        CHECK(data == 0x60);
+        CHECK(mock_i2c_dr.written == std::vector<uint8_t> { 0xED });
+    }
+
+    SUBCASE("read two bytes")
+    {
+        std::array<uint8_t, 2> data = {};
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            CHECK((mock_i2c_cr1 & I2C_CR1_POS) != 0);
+            CHECK((mock_i2c_cr1 & I2C_CR1_ACK) == 0);
+            mock_i2c_dr.to_read = { 0x01, 0x02 };
+            CHECK(event(i2c, I2C_SR1_RxNE | I2C_SR1_BTF));
+        };
+        CHECK(i2c.read(0x76, data) == utils::ErrorCode::OK);
+        CHECK(data == std::array<uint8_t, 2> { 0x01, 0x02 });
+        CHECK((mock_i2c_cr1 & I2C_CR1_POS) == 0);
+    }
+
+    SUBCASE("read five bytes")
+    {
+        std::array<uint8_t, 5> data = {};
+        mock_i2c_dr.to_read = { 1, 2, 3, 4, 5 };
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            CHECK((mock_i2c_cr1 & I2C_CR1_ACK) != 0);
+            CHECK_FALSE(event(i2c, I2C_SR1_RxNE));
+            CHECK_FALSE(event(i2c, I2C_SR1_RxNE));
+            CHECK((mock_i2c_cr2 & I2C_CR2_ITBUFEN) == 0);
+            CHECK_FALSE(event(i2c, I2C_SR1_RxNE | I2C_SR1_BTF));
+            CHECK((mock_i2c_cr1 & I2C_CR1_ACK) == 0);
+            CHECK((mock_i2c_cr1 & I2C_CR1_STOP) == 0);
+            CHECK(event(i2c, I2C_SR1_RxNE | I2C_SR1_BTF));
+            CHECK((mock_i2c_cr1 & I2C_CR1_STOP) != 0);
+        };
+        CHECK(i2c.read(0x76, data) == utils::ErrorCode::OK);
+        CHECK(data == std::array<uint8_t, 5> { 1, 2, 3, 4, 5 });
+    }
+
+    SUBCASE("write then read with a repeated start")
+    {
+        const std::array<uint8_t, 1> reg = { 0xF7 };
+        std::array<uint8_t, 1> data = {};
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            CHECK_FALSE(event(i2c, I2C_SR1_TxE));
+            mock_i2c_cr1 &= ~I2C_CR1_START;
+            CHECK_FALSE(event(i2c, I2C_SR1_TxE | I2C_SR1_BTF));
+            // START again instead of STOP
+            CHECK((mock_i2c_cr1 & I2C_CR1_START) != 0);
+            CHECK((mock_i2c_cr1 & I2C_CR1_STOP) == 0);
+            CHECK((mock_i2c_cr2 & I2C_CR2_ITBUFEN) != 0);
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            mock_i2c_dr.to_read = { 0x80 };
+            CHECK(event(i2c, I2C_SR1_RxNE));
+        };
+        CHECK(i2c.write_read(0x76, reg, data) == utils::ErrorCode::OK);
+        CHECK(mock_i2c_dr.written == std::vector<uint8_t> { 0xEC, 0xF7, 0xED });
+        CHECK(data[0] == 0x80);
+        CHECK(rtos.notify_waits.size() == 1);
+    }
+
+    SUBCASE("gather write")
+    {
+        const std::array<uint8_t, 1> reg = { 0xF4 };
+        const std::array<uint8_t, 3> data = { 0x27, 0xF5, 0xA0 };
+        const std::array<std::span<const uint8_t>, 3> segments = { reg, std::span<const uint8_t> {}, data };
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            for (size_t i = 0; i < 4; ++i) {
+                CHECK_FALSE(event(i2c, I2C_SR1_TxE));
+            }
+            CHECK(event(i2c, I2C_SR1_TxE | I2C_SR1_BTF));
+        };
+        CHECK(i2c.write_gather(0x76, segments) == utils::ErrorCode::OK);
+        CHECK(mock_i2c_dr.written == std::vector<uint8_t> { 0xEC, 0xF4, 0x27, 0xF5, 0xA0 });
+    }
+
+    SUBCASE("NACK")
+    {
+        uint8_t data = 0;
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            mock_i2c_sr1 = I2C_SR1_AF;
+            CHECK(i2c.error_isr());
+            CHECK(mock_i2c_sr1 == 0);
+        };
+        CHECK(i2c.read(0x77, data) == utils::ErrorCode::I2C_NACK_ERROR);
+        CHECK((mock_i2c_cr1 & I2C_CR1_STOP) != 0);
+        CHECK((mock_i2c_cr2 & interrupt_enable_bits) == 0);
+    }
+
+    SUBCASE("stuck bus times out")
+    {
+        const std::array<uint8_t, 10> data = {};
+        rtos.next_notify_wait_result = false;
+        CHECK(i2c.write(0x76, data) == utils::ErrorCode::I2C_TIMEOUT_ERROR);
+        REQUIRE(rtos.notify_waits.size() == 1);
+        CHECK(rtos.notify_waits[0] == I2C::timeout_base_ms + (10 / I2C::timeout_bytes_per_ms));
+        CHECK((mock_i2c_cr2 & interrupt_enable_bits) == 0);
+        // A late interrupt doesn't touch the buffers anymore
+        CHECK_FALSE(event(i2c, I2C_SR1_SB));
+        CHECK(mock_i2c_dr.written.empty());
+
+        // The next transfer starts from scratch
+        rtos.next_notify_wait_result = true;
+        uint8_t byte = 0;
+        rtos.bus = [&] {
+            CHECK_FALSE(event(i2c, I2C_SR1_SB));
+            CHECK_FALSE(event(i2c, I2C_SR1_ADDR));
+            mock_i2c_dr.to_read = { 0x42 };
+            CHECK(event(i2c, I2C_SR1_RxNE));
+        };
+        CHECK(i2c.read(0x76, byte) == utils::ErrorCode::OK);
+        CHECK(byte == 0x42);
+    }
+}
+
+TEST_CASE("I2C bus speed self-test")
+{
+    mock_libopencm3_reset();
+    I2C i2c(BluePillI2C::_1, RCC_I2C1, RST_I2C1, I2CSpeed::FAST_400K);
+    i2c.setup();
+    CHECK(mock_i2c_speed == i2c_speed_fm_400k);
+    BusRTOS rtos;
+    i2c.set_rtos(&rtos);
+
+    unsigned int probes = 0;
+    unsigned int nacks = 0;
+    uint32_t bus_cycles = 0;
+    uint32_t task_wakeup_cycles = 0;
+    rtos.bus = [&] {
+        ++probes;
+        CHECK_FALSE(event(i2c, I2C_SR1_SB));
+        mock_dwt_cycle_counter += bus_cycles;
+        if (nacks > 0) {
+            --nacks;
+            mock_i2c_sr1 = I2C_SR1_AF;
+            CHECK(i2c.error_isr());
+        } else {
+            // Address only, done as soon as it's acknowledged
+            CHECK(event(i2c, I2C_SR1_ADDR));
+        }
+        mock_dwt_cycle_counter += task_wakeup_cycles;
+    };
+
+    SUBCASE("fast mode works")
+    {
+        CHECK(i2c.self_test(0x76) == utils::ErrorCode::OK);
+        CHECK(probes == I2C::self_test_probes);
+        CHECK(i2c.get_speed() == I2CSpeed::FAST_400K);
+        CHECK(mock_i2c_dr.written == std::vector<uint8_t>(I2C::self_test_probes, 0xEC));
+    }
+
+    SUBCASE("falls back to standard mode")
+    {
+        nacks = 1;
+        CHECK(i2c.self_test(0x76) == utils::ErrorCode::OK);
+        CHECK(probes == 1 + I2C::self_test_probes);
+        CHECK(i2c.get_speed() == I2CSpeed::STANDARD_100K);
+        CHECK(mock_i2c_speed == i2c_speed_sm_100k);
+    }
+
+    SUBCASE("a slow bus falls back, a late task wake-up doesn't")
+    {
+        // 100 us for what takes 28 us at 400 kHz, but well within the 110 us at 100 kHz
+        bus_cycles = 100 * bluepill::AHB_CLOCK_MHZ;
+        task_wakeup_cycles = 1'000 * bluepill::AHB_CLOCK_MHZ;
+        CHECK(i2c.self_test(0x76) == utils::ErrorCode::OK);
+        CHECK(probes == 1 + I2C::self_test_probes);
+        CHECK(i2c.get_speed() == I2CSpeed::STANDARD_100K);
+    }
+
+    SUBCASE("no device at any speed")
+    {
+        nacks = 2;
+        CHECK(i2c.self_test(0x76) == utils::ErrorCode::I2C_NACK_ERROR);
+        CHECK(probes == 2);
+        CHECK(i2c.get_speed() == I2CSpeed::STANDARD_100K);
+    }
+}
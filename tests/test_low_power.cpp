@@ -0,0 +1,95 @@
+#include "LowPower.h"
+#include <cstdint>
+#include <doctest/doctest.h>
+
+using bluepill::power::RTC_COUNTER_HZ;
+using bluepill::power::SleepClock;
+using bluepill::power::StopModeInhibitor;
+
+TEST_CASE("SleepClock")
+{
+    // A slow LSI, the counts don't divide evenly into milliseconds
+    constexpr uint32_t counter_hz = 1024;
+
+    SUBCASE("alarm is never early")
+    {
+        const SleepClock clock(counter_hz);
+        CHECK(clock.ms_to_counts(0) == 0);
+        CHECK(clock.ms_to_counts(1) == 2); // 1.024 counts
+        CHECK(clock.ms_to_counts(1000) == counter_hz);
+        CHECK(clock.ms_to_counts(10'000) == 10'240);
+        for (uint32_t ms = 1; ms < 1100; ++ms) {
+            const uint64_t counts = clock.ms_to_counts(ms);
+            CHECK(counts * 1000 >= uint64_t { ms } * counter_hz);
+        }
+        CHECK(SleepClock().ms_to_counts(10'000) == 10'000);
+    }
+
+    SUBCASE("an alarm is never set where it could already have passed")
+    {
+        const SleepClock clock(counter_hz);
+        CHECK(clock.alarm_counts(0) == bluepill::power::RTC_MIN_ALARM_COUNTS);
+        CHECK(clock.alarm_counts(1) >= bluepill::power::RTC_MIN_ALARM_COUNTS);
+        CHECK(clock.alarm_counts(1000) == counter_hz);
+    }
+
+    SUBCASE("remainder carries over so short sleeps don't drift")
+    {
+        SleepClock clock(counter_hz);
+        uint32_t total_ms = 0;
+        // 1024 sleeps of 3 counts each = 3 s
+        for (uint32_t i = 0; i < counter_hz; ++i) {
+            total_ms += clock.counts_to_ms(3);
+        }
+        CHECK(total_ms == 3000);
+    }
+
+    SUBCASE("long sleeps don't overflow")
+    {
+        SleepClock clock(counter_hz);
+        CHECK(clock.counts_to_ms(UINT32_MAX) == static_cast<uint32_t>(uint64_t { UINT32_MAX } * 1000 / counter_hz));
+    }
+
+    SUBCASE("calibration against the CPU clock")
+    {
+        constexpr uint32_t cpu_hz = 72'000'000;
+        // 64 counts in 64 ms
+        CHECK(SleepClock::calibrated_hz(64, 4'608'000, cpu_hz) == RTC_COUNTER_HZ);
+        // A fast LSI at ~52 kHz
+        CHECK(SleepClock::calibrated_hz(64, 3'529'412, cpu_hz) == 1306);
+
+        SleepClock clock;
+        (void)clock.counts_to_ms(1);
+        clock.set_counter_hz(1306);
+        CHECK(clock.get_counter_hz() == 1306);
+        CHECK(clock.counts_to_ms(1306) == 1000);
+    }
+}
+
+TEST_CASE("until_next_period_ms")
+{
+    using bluepill::power::until_next_period_ms;
+    constexpr uint32_t period_ms = 10'000;
+
+    CHECK(until_next_period_ms(100'000, 100'300, period_ms) == 9'700);
+    // A wake-up longer than the period: the next boundary after now, not an alarm that is already due
+    CHECK(until_next_period_ms(100'000, 112'000, period_ms) == 8'000);
+    CHECK(until_next_period_ms(100'000, 110'000, period_ms) == period_ms);
+    // Across the wrap of the millisecond counter
+    CHECK(until_next_period_ms(0xFFFF'FF00, 0x100, period_ms) == period_ms - 0x200);
+}
+
+TEST_CASE("StopModeInhibitor")
+{
+    CHECK_FALSE(StopModeInhibitor::any());
+    {
+        const StopModeInhibitor first;
+        CHECK(StopModeInhibitor::any());
+        {
+            const StopModeInhibitor second;
+            CHECK(StopModeInhibitor::any());
+        }
+        CHECK(StopModeInhibitor::any());
+    }
+    CHECK_FALSE(StopModeInhibitor::any());
+}
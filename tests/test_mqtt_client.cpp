@@ -0,0 +1,309 @@
+#include "MQTTClient.h"
+#include "mocks/MockRTOS.h"
+#include <doctest/doctest.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Records what is sent and hands out scripted broker data
+class ScriptedNetwork final : public INetwork {
+public:
+    explicit ScriptedNetwork(MockRTOS& rtos)
+        : rtos(rtos)
+    {
+    }
+
+    MockRTOS& rtos;
+    mutable std::vector<std::string> sent;
+    std::string inbox;
+    bool closed = false;
+    bool send_fails = false;
+    unsigned int open_sockets = 0;
+
+    utils::ErrorCode init() override { return utils::ErrorCode::OK; }
+    [[nodiscard]] bool get_ap_connected() override { return true; }
+    [[nodiscard]] utils::ErrorCode connect_to_ap() override { return utils::ErrorCode::OK; }
+    void disconnect_ap() const override { }
+    [[nodiscard]] std::optional<unsigned int> connect_socket(SocketType, std::string_view, std::string_view) override
+    {
+        closed = false;
+        return open_sockets++;
+    }
+    [[nodiscard]] utils::ErrorCode send_socket(unsigned int, std::span<const std::byte> data) const override
+    {
+        sent.emplace_back(reinterpret_cast<const char*>(data.data()), data.size());
+        return utils::ErrorCode::OK;
+    }
+    [[nodiscard]] utils::ErrorCode send_socket(
+        unsigned int, std::span<const std::span<const std::byte>> segments) const override
+    {
+        std::string packet;
+        for (const auto& segment : segments) {
+            packet.append(reinterpret_cast<const char*>(segment.data()), segment.size());
+        }
+        if (send_fails) {
+            return utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR;
+        }
+        sent.push_back(packet);
+        return utils::ErrorCode::OK;
+    }
+    [[nodiscard]] utils::ErrorCode close_socket(unsigned int) override
+    {
+        --open_sockets;
+        return utils::ErrorCode::OK;
+    }
+    [[nodiscard]] std::optional<size_t> receive_socket(
+        unsigned int, std::span<std::byte> buffer, unsigned int timeout_ms) override
+    {
+        if (inbox.empty() && closed) {
+            return std::nullopt;
+        }
+        if (inbox.empty()) {
+            rtos.time_ms += timeout_ms; // Waited for nothing
+        }
+        const size_t count = std::min(buffer.size(), inbox.size());
+        std::copy_n(reinterpret_cast<const std::byte*>(inbox.data()), count, buffer.begin());
+        inbox.erase(0, count);
+        return count;
+    }
+    [[nodiscard]] utils::ErrorCode wake_radio() override { return utils::ErrorCode::OK; }
+    [[nodiscard]] utils::ErrorCode sleep_radio(uint32_t) override { return utils::ErrorCode::OK; }
+    [[nodiscard]] uint32_t get_radio_wake_latency_ms() const override { return 0; }
+    [[nodiscard]] uint32_t get_radio_on_ms() const override { return 0; }
+    [[nodiscard]] utils::ErrorCode deep_sleep() override { return utils::ErrorCode::OK; }
+    [[nodiscard]] NetworkWarmHint get_warm_hint() const override { return {}; }
+    void set_warm_hint(const NetworkWarmHint&) override { }
+};
+
+std::string connack(uint8_t return_code) { return { '\x20', '\x02', '\x00', static_cast<char>(return_code) }; }
+
+std::string puback(uint16_t packet_id)
+{
+    return { '\x40', '\x02', static_cast<char>(packet_id >> 8), static_cast<char>(packet_id & 0xFF) };
+}
+
+uint16_t packet_id_of(const std::string& publish, size_t topic_size)
+{
+    // Fixed header (2) + topic length (2) + topic
+    const size_t offset = 4 + topic_size;
+    return static_cast<uint16_t>(
+        (static_cast<uint8_t>(publish[offset]) << 8) | static_cast<uint8_t>(publish[offset + 1]));
+}
+
+}
+
+TEST_CASE("MQTTClient QoS 1")
+{
+    MockRTOS rtos;
+    ScriptedNetwork network(rtos);
+    MQTTClient client(network, rtos, 2);
+    network.inbox = connack(0);
+    REQUIRE(client.connect("id", "host", "1883") == utils::ErrorCode::OK);
+    REQUIRE(client.get_connected());
+    network.sent.clear();
+    const std::string payload = "42";
+    const auto payload_bytes = std::as_bytes(std::span(payload));
+
+    SUBCASE("publishes are pipelined up to the window with unique packet ids")
+    {
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 2);
+        CHECK(network.sent[0][0] == '\x32');
+        const uint16_t first = packet_id_of(network.sent[0], 1);
+        const uint16_t second = packet_id_of(network.sent[1], 1);
+        CHECK(first != 0);
+        CHECK(first != second);
+        CHECK(client.get_in_flight() == 2);
+
+        network.inbox = puback(first);
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        CHECK(client.get_in_flight() == 1);
+    }
+
+    SUBCASE("a full window waits for an acknowledgement")
+    {
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        network.inbox = puback(packet_id_of(network.sent[1], 1));
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        CHECK(network.sent.size() == 3);
+        CHECK(client.get_in_flight() == 2);
+
+        // Nothing comes back -> gives up after the retransmission time
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR);
+    }
+
+    SUBCASE("unacknowledged publishes are sent again with the DUP flag")
+    {
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        rtos.time_ms += MQTTClient::retransmit_ms;
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 2);
+        CHECK(network.sent[1][0] == '\x3A');
+        CHECK(packet_id_of(network.sent[1], 1) == packet_id_of(network.sent[0], 1));
+        CHECK(network.sent[1].substr(7) == payload);
+        CHECK(client.get_retransmit_count() == 1);
+    }
+
+    SUBCASE("acknowledgements split across reads and mixed with other packets")
+    {
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        // PINGRESP, then the PUBACK
+        network.inbox = std::string("\xD0\x00", 2) + puback(packet_id_of(network.sent[0], 1)).substr(0, 3);
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        CHECK(client.get_in_flight() == 1);
+        network.inbox = puback(packet_id_of(network.sent[0], 1)).substr(3);
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        CHECK(client.get_in_flight() == 0);
+    }
+
+    SUBCASE("constant topics go out the same as runtime ones")
+    {
+        CHECK(client.publish<"sensors/temperature">(payload_bytes, true) == utils::ErrorCode::OK);
+        CHECK(client.publish("sensors/temperature", payload_bytes, true) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 2);
+        // Same apart from the packet id
+        CHECK(network.sent[0].substr(0, 23) == network.sent[1].substr(0, 23));
+        CHECK(network.sent[0].substr(25) == network.sent[1].substr(25));
+
+        rtos.time_ms += MQTTClient::retransmit_ms;
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 4);
+        CHECK(network.sent[2][0] == '\x3A');
+        CHECK(network.sent[2].substr(1) == network.sent[0].substr(1));
+    }
+
+    SUBCASE("packet ids continue where a previous session left off")
+    {
+        client.set_next_packet_id(0xFFFF);
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 2);
+        CHECK(packet_id_of(network.sent[0], 1) == 0xFFFF);
+        // 0 is not a valid packet id
+        CHECK(packet_id_of(network.sent[1], 1) == 1);
+        CHECK(client.get_next_packet_id() == 2);
+    }
+
+    SUBCASE("closed connection")
+    {
+        network.closed = true;
+        CHECK(client.poll(0) == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        CHECK_FALSE(client.get_connected());
+    }
+
+    SUBCASE("nothing is due while disconnected, even with publishes in flight")
+    {
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        network.closed = true;
+        CHECK(client.poll(0) == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        rtos.time_ms += MQTTClient::retransmit_ms;
+        CHECK(client.get_poll_interval_ms() >= MQTTClient::retransmit_ms);
+        CHECK(network.sent.size() == 1);
+    }
+
+    SUBCASE("a publish that didn't go out is reported and doesn't take a slot")
+    {
+        network.send_fails = true;
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        CHECK(client.get_in_flight() == 0);
+        network.send_fails = false;
+        CHECK(client.publish("t", payload_bytes, true) == utils::ErrorCode::OK);
+        CHECK(client.get_in_flight() == 1);
+    }
+
+    SUBCASE("a reconnect closes the previous socket")
+    {
+        network.closed = true;
+        CHECK(client.poll(0) == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        network.inbox = connack(0);
+        CHECK(client.connect("id", "host", "1883") == utils::ErrorCode::OK);
+        CHECK(network.open_sockets == 1);
+    }
+}
+
+TEST_CASE("MQTTClient connect")
+{
+    MockRTOS rtos;
+    ScriptedNetwork network(rtos);
+    MQTTClient client(network, rtos);
+
+    SUBCASE("refused by the broker")
+    {
+        network.inbox = connack(5); // Not authorized
+        CHECK(client.connect("id", "host", "1883") == utils::ErrorCode::NETWORK_RESPONSE_NOT_OK_ERROR);
+        CHECK_FALSE(client.get_connected());
+    }
+
+    SUBCASE("constant client id")
+    {
+        network.inbox = connack(0);
+        CHECK(client.connect<"id", 10>("host", "1883") == utils::ErrorCode::OK);
+        std::array<std::byte, 64> packet;
+        const size_t len = SimpleMQTT::make_connect_packet(packet, "id", 10);
+        REQUIRE(network.sent.size() == 1);
+        CHECK(network.sent[0] == std::string(reinterpret_cast<const char*>(packet.data()), len));
+    }
+
+    SUBCASE("no CONNACK")
+    {
+        CHECK(client.connect("id", "host", "1883") == utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR);
+        CHECK(rtos.time_ms >= MQTTClient::connack_timeout_ms);
+    }
+}
+
+TEST_CASE("MQTTClient keep-alive")
+{
+    MockRTOS rtos;
+    ScriptedNetwork network(rtos);
+    MQTTClient client(network, rtos);
+    network.inbox = connack(0);
+    REQUIRE(client.connect("id", "host", "1883", 10) == utils::ErrorCode::OK);
+    network.sent.clear();
+    const std::string pingreq("\xC0\x00", 2);
+
+    SUBCASE("PINGREQ only after the connection has been idle")
+    {
+        // No latency measured yet -> ping at half the keep-alive
+        CHECK(client.get_ping_interval_ms() == 5'000);
+        CHECK(client.get_poll_interval_ms() == 5'000);
+        rtos.time_ms += 4'000;
+        // Publishing resets the idle time
+        const std::string payload = "1";
+        CHECK(client.publish("t", std::as_bytes(std::span(payload))) == utils::ErrorCode::OK);
+        rtos.time_ms += 4'000;
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        CHECK(network.sent.size() == 1);
+        rtos.time_ms += 1'000;
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 2);
+        CHECK(network.sent[1] == pingreq);
+    }
+
+    SUBCASE("PINGRESP latency stretches the interval")
+    {
+        rtos.time_ms += 5'000;
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        REQUIRE(network.sent.size() == 1);
+        CHECK(client.get_poll_interval_ms() == MQTTClient::pingresp_timeout_ms);
+        rtos.time_ms += 200;
+        network.inbox = std::string("\xD0\x00", 2);
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        REQUIRE(client.get_ping_latency_ms().has_value());
+        CHECK(*client.get_ping_latency_ms() == 200);
+        // 1 s margin is enough for a 200 ms round trip
+        CHECK(client.get_ping_interval_ms() == 9'000);
+        CHECK(client.get_connected());
+    }
+
+    SUBCASE("no PINGRESP drops the connection")
+    {
+        rtos.time_ms += 5'000;
+        CHECK(client.poll(0) == utils::ErrorCode::OK);
+        rtos.time_ms += MQTTClient::pingresp_timeout_ms;
+        CHECK(client.poll(0) == utils::ErrorCode::NETWORK_RESPONSE_TIMEOUT_ERROR);
+        CHECK_FALSE(client.get_connected());
+    }
+}
@@ -1,7 +1,10 @@
 #include "libs/SimpleMQTT/SimpleMQTT.h"
+#include <algorithm>
 #include <array>
 #include <doctest/doctest.h>
 #include <string>
+#include <string_view>
+#include <vector>
 
 TEST_CASE("MQTT Connect Packet")
 {
@@ -48,6 +51,33 @@ TEST_CASE("MQTT Connect Packet")
     CHECK(client_id_str == "test_client");
 }
 
+TEST_CASE("MQTT Publish Header")
+{
+    std::array<std::byte, SimpleMQTT::max_publish_header_size> header;
+
+    // Remaining length: topic (2 + 10) + payload (200) = 212 -> two length bytes
+    size_t len = SimpleMQTT::make_publish_header(header, "topic/test", 200);
+    CHECK(len == 5);
+    CHECK(header[0] == std::byte { 0x30 });
+    CHECK(header[1] == std::byte { 0xD4 }); // 212 & 0x7F | 0x80
+    CHECK(header[2] == std::byte { 0x01 });
+    CHECK(header[3] == std::byte { 0x00 });
+    CHECK(header[4] == std::byte { 10 });
+
+    // Header + topic + payload is the same as the full packet
+    std::string message = "hello";
+    std::span<const std::byte> payload(reinterpret_cast<const std::byte*>(message.data()), message.size());
+    std::array<std::byte, 128> packet;
+    size_t packet_len = SimpleMQTT::make_publish_packet(packet, "topic/test", payload);
+    len = SimpleMQTT::make_publish_header(header, "topic/test", payload.size());
+    CHECK(packet_len == len + 10 + payload.size());
+    CHECK(std::equal(header.begin(), header.begin() + len, packet.begin()));
+
+    // Doesn't fit
+    std::array<std::byte, 3> small;
+    CHECK(SimpleMQTT::make_publish_header(small, "topic/test", 200) == 0);
+}
+
 TEST_CASE("MQTT Publish Packet QoS 0")
 {
     std::array<std::byte, 128> packet;
@@ -102,7 +132,7 @@ TEST_CASE("MQTT Publish Packet QoS 1")
     CHECK(packet[3] == std::byte { 1 });
     CHECK(packet[4] == std::byte { 't' });
 
-    // Packet ID (Dummy 1)
+    // Packet ID (default 1)
     CHECK(packet[5] == std::byte { 0x00 });
     CHECK(packet[6] == std::byte { 0x01 });
 
@@ -119,3 +149,159 @@ TEST_CASE("MQTT Buffer Overflow protection check")
 
     CHECK(len == 0);
 }
+
+TEST_CASE("MQTT Publish Packet QoS 1 retransmission")
+{
+    std::array<std::byte, 128> packet;
+    std::string message = "m";
+    std::span<const std::byte> payload(reinterpret_cast<const std::byte*>(message.data()), message.size());
+    size_t len = SimpleMQTT::make_publish_packet(packet, "t", payload, true, 0x1234, true);
+
+    CHECK(len == 2 + 6);
+    CHECK(packet[0] == std::byte { 0x3A }); // PUBLISH, DUP, QoS 1 -> 0x30 | 0x08 | 0x02
+
+    // Packet ID
+    CHECK(packet[5] == std::byte { 0x12 });
+    CHECK(packet[6] == std::byte { 0x34 });
+    CHECK(SimpleMQTT::make_packet_id(0x1234) == std::array { std::byte { 0x12 }, std::byte { 0x34 } });
+}
+
+namespace {
+
+std::span<const std::byte> bytes(std::string_view str) { return std::as_bytes(std::span(str)); }
+
+struct DecodedPackets {
+    std::vector<SimpleMQTT::Packet> packets;
+    std::vector<std::string> topics;
+    std::vector<std::string> payloads;
+
+    void operator()(const SimpleMQTT::Packet& packet)
+    {
+        packets.push_back(packet);
+        // The spans are only valid during the call
+        topics.emplace_back(packet.topic);
+        payloads.emplace_back(reinterpret_cast<const char*>(packet.payload.data()), packet.payload.size());
+    }
+};
+
+}
+
+TEST_CASE("MQTT Decoder")
+{
+    SimpleMQTT::Decoder<16> decoder;
+    DecodedPackets decoded;
+    auto handler = [&decoded](const SimpleMQTT::Packet& packet) { decoded(packet); };
+
+    SUBCASE("acknowledgements in one chunk")
+    {
+        using namespace std::string_view_literals;
+        decoder.feed(bytes("\x20\x02\x01\x00" "\x40\x02\x12\x34" "\xD0\x00" "\x90\x03\x00\x07\x01"sv), handler);
+        REQUIRE(decoded.packets.size() == 4);
+        CHECK(decoded.packets[0].type == SimpleMQTT::PacketType::CONNACK);
+        CHECK(decoded.packets[0].session_present);
+        CHECK(decoded.packets[0].return_code == 0);
+        CHECK(decoded.packets[1].type == SimpleMQTT::PacketType::PUBACK);
+        CHECK(decoded.packets[1].packet_id == 0x1234);
+        CHECK(decoded.packets[2].type == SimpleMQTT::PacketType::PINGRESP);
+        CHECK(decoded.packets[3].type == SimpleMQTT::PacketType::SUBACK);
+        CHECK(decoded.packets[3].packet_id == 7);
+        CHECK(decoded.packets[3].return_code == 1);
+    }
+
+    SUBCASE("packet split byte by byte")
+    {
+        using namespace std::string_view_literals;
+        const auto packet = "\x50\x02\x00\x09"sv; // PUBREC
+        for (char c : packet) {
+            decoder.feed(bytes(std::string_view(&c, 1)), handler);
+        }
+        REQUIRE(decoded.packets.size() == 1);
+        CHECK(decoded.packets[0].type == SimpleMQTT::PacketType::PUBREC);
+        CHECK(decoded.packets[0].packet_id == 9);
+    }
+
+    SUBCASE("inbound publish is decoded in place or from the buffer")
+    {
+        std::array<std::byte, 64> packet;
+        const std::string message = "hello";
+        const size_t len = SimpleMQTT::make_publish_packet(packet, "a/b", bytes(message), true, 3);
+        decoder.feed(std::span<const std::byte>(packet.data(), len), handler);
+        decoder.feed(std::span<const std::byte>(packet.data(), 5), handler);
+        decoder.feed(std::span<const std::byte>(packet.data() + 5, len - 5), handler);
+        REQUIRE(decoded.packets.size() == 2);
+        for (size_t i = 0; i < 2; ++i) {
+            CHECK(decoded.packets[i].type == SimpleMQTT::PacketType::PUBLISH);
+            CHECK(decoded.packets[i].flags == 0x02);
+            CHECK(decoded.packets[i].packet_id == 3);
+            CHECK(decoded.topics[i] == "a/b");
+            CHECK(decoded.payloads[i] == "hello");
+        }
+    }
+
+    SUBCASE("remaining length split across chunks and oversized packets skipped")
+    {
+        std::array<std::byte, 256> packet;
+        const std::string message(150, 'x');
+        const size_t len = SimpleMQTT::make_publish_packet(packet, "t", bytes(message));
+        REQUIRE(packet[2] != std::byte { 0 }); // Two length bytes
+        decoder.feed(std::span<const std::byte>(packet.data(), 2), handler);
+        decoder.feed(std::span<const std::byte>(packet.data() + 2, 10), handler);
+        decoder.feed(std::span<const std::byte>(packet.data() + 12, len - 12), handler);
+        CHECK(decoded.packets.empty());
+        CHECK(decoder.get_dropped() == 1);
+
+        // Still in sync
+        decoder.feed(bytes(std::string_view("\xD0\x00", 2)), handler);
+        REQUIRE(decoded.packets.size() == 1);
+        CHECK(decoded.packets[0].type == SimpleMQTT::PacketType::PINGRESP);
+    }
+
+    SUBCASE("malformed packets are counted")
+    {
+        decoder.feed(bytes(std::string_view("\x40\x01\x00", 3)), handler);
+        CHECK(decoded.packets.empty());
+        CHECK(decoder.get_malformed() == 1);
+    }
+}
+
+TEST_CASE("MQTT PINGREQ Packet")
+{
+    std::array<std::byte, 2> packet;
+    CHECK(SimpleMQTT::make_pingreq_packet(packet) == 2);
+    CHECK(packet[0] == std::byte { 0xC0 });
+    CHECK(packet[1] == std::byte { 0x00 });
+    std::array<std::byte, 1> small;
+    CHECK(SimpleMQTT::make_pingreq_packet(small) == 0);
+}
+
+TEST_CASE("MQTT Compile-time Packet Templates")
+{
+    // Built by the compiler
+    static_assert(SimpleMQTT::encoded_topic<"a/b">.size() == 5);
+    static_assert(SimpleMQTT::encoded_topic<"a/b">[1] == std::byte { 3 });
+    static_assert(SimpleMQTT::connect_packet<"test_client", 10>.size() == 2 + 23);
+
+    SUBCASE("CONNECT is the same as the runtime one")
+    {
+        std::array<std::byte, 128> packet;
+        const size_t len = SimpleMQTT::make_connect_packet(packet, "test_client", 10);
+        const auto& constant = SimpleMQTT::connect_packet<"test_client", 10>;
+        REQUIRE(len == constant.size());
+        CHECK(std::equal(constant.begin(), constant.end(), packet.begin()));
+    }
+
+    SUBCASE("fixed header + encoded topic is the same as the runtime header + topic")
+    {
+        std::array<std::byte, SimpleMQTT::max_publish_header_size> header;
+        const size_t header_len = SimpleMQTT::make_publish_header(header, "topic/test", 200, true, true);
+        const auto& topic = SimpleMQTT::encoded_topic<"topic/test">;
+        std::array<std::byte, SimpleMQTT::max_publish_fixed_header_size> fixed_header;
+        const size_t fixed_len
+            = SimpleMQTT::make_publish_fixed_header(fixed_header, topic.size() + 2 + 200, true, true);
+        REQUIRE(fixed_len + 2 == header_len);
+        CHECK(std::equal(fixed_header.begin(), fixed_header.begin() + fixed_len, header.begin()));
+        CHECK(header[fixed_len] == topic[0]);
+        CHECK(header[fixed_len + 1] == topic[1]);
+        CHECK(std::string(reinterpret_cast<const char*>(topic.data() + 2), topic.size() - 2) == "topic/test");
+    }
+}
@@ -0,0 +1,44 @@
+#include "RadioPowerPolicy.h"
+#include <doctest/doctest.h>
+
+TEST_CASE("RadioPowerPolicy")
+{
+    RadioPowerPolicy radio;
+
+    SUBCASE("short gaps stay at full power")
+    {
+        CHECK(RadioPowerPolicy::choose(0) == RadioSleepMode::NONE);
+        CHECK(RadioPowerPolicy::choose(RadioPowerPolicy::min_sleep_ms - 1) == RadioSleepMode::NONE);
+        CHECK(RadioPowerPolicy::choose(RadioPowerPolicy::min_sleep_ms) == RadioSleepMode::MODEM);
+        CHECK(RadioPowerPolicy::choose(300'000) == RadioSleepMode::MODEM);
+    }
+
+    SUBCASE("on time adds up the windows")
+    {
+        CHECK(radio.get_awake());
+        radio.slept(12'000); // Up since the reset
+        CHECK(radio.get_on_ms(20'000) == 12'000);
+
+        radio.woke(30'000, 40);
+        CHECK(radio.get_on_ms(30'000) == 12'040);
+        CHECK(radio.get_on_ms(30'500) == 12'540);
+        radio.slept(31'000);
+        radio.slept(32'000); // Already asleep
+        CHECK(radio.get_on_ms(40'000) == 13'040);
+
+        radio.powered_up(50'000);
+        radio.powered_up(50'100); // Still up
+        CHECK(radio.get_on_ms(51'000) == 14'040);
+    }
+
+    SUBCASE("wake latency follows slow wake-ups at once and fast ones slowly")
+    {
+        CHECK(radio.get_wake_latency_ms() == RadioPowerPolicy::default_wake_latency_ms);
+        radio.slept(0);
+        radio.woke(1000, 300);
+        CHECK(radio.get_wake_latency_ms() == 300);
+        radio.slept(2000);
+        radio.woke(3000, 100);
+        CHECK(radio.get_wake_latency_ms() == 250);
+    }
+}
@@ -0,0 +1,78 @@
+#include "CompressedSampleBatch.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <doctest/doctest.h>
+
+TEST_CASE("CompressedSampleBatch")
+{
+    CompressedSampleBatch<32> batch;
+    std::array<Sample, 6> samples { {
+        { .time_ms = 123'456, .value = 2150 },
+        { .time_ms = 133'456, .value = 2150 },
+        { .time_ms = 143'456, .value = 2151 },
+        { .time_ms = 153'456, .value = 2149 },
+        { .time_ms = 163'456, .value = 2149 },
+        { .time_ms = 173'456, .value = 2200 },
+    } };
+
+    SUBCASE("version 2 layout matches the reference encoder")
+    {
+        CHECK(batch.get_payload().size() == CompressedSampleBatch<32>::header_size);
+        for (const auto& sample : samples) {
+            CHECK(batch.add(sample));
+        }
+        // scripts/esp8266_test/sample_batch.py encode_v2() of the same samples
+        constexpr std::array<uint8_t, 19> expected { 0x02, 0x06, 0x02, 0x40, 0xe2, 0x01, 0x00, 0x66, 0x08, 0x00, 0x00,
+            0xe0, 0x27, 0x10, 0x21, 0x5c, 0x30, 0x19, 0x80 };
+        const auto payload = batch.get_payload();
+        REQUIRE(payload.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            CHECK(static_cast<uint8_t>(payload[i]) == expected[i]);
+        }
+        CHECK(batch.get_base_time_ms() == 123'456);
+    }
+
+    SUBCASE("steady slow signal compresses well")
+    {
+        CompressedSampleBatch<64> long_batch;
+        const int steps[] = { 0, 0, 1, 0, -1, 0, 0, 2, 0, -1 };
+        int32_t centi = 2150;
+        size_t count = 0;
+        while (!long_batch.full()) {
+            centi += steps[count % std::size(steps)];
+            REQUIRE(long_batch.add({ .time_ms = static_cast<uint32_t>(count * 10'000), .value = centi }));
+            ++count;
+        }
+        // Against one raw double per sample
+        CHECK(count * sizeof(double) >= 8 * long_batch.get_payload().size());
+    }
+
+    SUBCASE("full when the worst case sample would not fit")
+    {
+        // The 88 header bits and two worst case samples leave less than 72 of the 256 bits
+        CHECK(batch.add({ .time_ms = 0, .value = 0 }));
+        CHECK(batch.add({ .time_ms = 0x7000'0000, .value = INT32_MAX }));
+        CHECK(batch.add({ .time_ms = 0x1000'0000, .value = INT32_MIN }));
+        CHECK(batch.full());
+        CHECK_FALSE(batch.add({ .time_ms = 0x1000'0001, .value = 0 }));
+        CHECK(batch.size() == 3);
+        batch.clear();
+        CHECK(batch.add({ .time_ms = 1, .value = 100 }));
+        CHECK(batch.get_payload()[2] == std::byte { 2 });
+    }
+
+    SUBCASE("whole pascals without decimals")
+    {
+        CompressedSampleBatch<64, 0> pressure;
+        CHECK(pressure.add({ .time_ms = 0, .value = 101'325 }));
+        CHECK(pressure.add({ .time_ms = 10'000, .value = 101'327 }));
+        const auto payload = pressure.get_payload();
+        const std::vector<uint8_t> expected = { 0x02, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xcd, 0x8b, 0x01, 0x00, 0xe0,
+            0x27, 0x10, 0x88 };
+        REQUIRE(payload.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            CHECK(payload[i] == std::byte { expected[i] });
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#include "SocketRxQueue.h"
+#include <array>
+#include <doctest/doctest.h>
+#include <string>
+#include <string_view>
+
+namespace {
+
+std::span<const volatile char> chars(std::string_view str)
+{
+    return std::span<const volatile char>(str.data(), str.size());
+}
+
+std::string to_string(std::span<const std::byte> data)
+{
+    return std::string(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+}
+
+TEST_CASE("SocketRxQueue")
+{
+    SocketRxQueue<8> queue;
+    std::array<std::byte, 16> buffer {};
+
+    SUBCASE("bytes come out in order")
+    {
+        CHECK(queue.empty());
+        CHECK(queue.push(chars("abc")) == 3);
+        CHECK(queue.push(chars("de")) == 2);
+        CHECK(queue.size() == 5);
+        const size_t count = queue.read(std::span(buffer).first(4));
+        CHECK(to_string(std::span(buffer).first(count)) == "abcd");
+        CHECK(queue.read(buffer) == 1);
+        CHECK(queue.empty());
+    }
+
+    SUBCASE("full queue drops the newest bytes")
+    {
+        CHECK(queue.push(chars("0123456789")) == 8);
+        CHECK(queue.get_dropped() == 2);
+        const size_t count = queue.read(buffer);
+        CHECK(to_string(std::span(buffer).first(count)) == "01234567");
+    }
+
+    SUBCASE("data wraps around the end")
+    {
+        (void)queue.push(chars("012345"));
+        (void)queue.read(std::span(buffer).first(5));
+        CHECK(queue.push(chars("abcdef")) == 6);
+        const size_t count = queue.read(buffer);
+        CHECK(to_string(std::span(buffer).first(count)) == "5abcdef");
+    }
+
+    SUBCASE("clear forgets everything")
+    {
+        (void)queue.push(chars("0123456789"));
+        queue.clear();
+        CHECK(queue.empty());
+        CHECK(queue.get_dropped() == 0);
+    }
+}
@@ -107,3 +107,76 @@ TEST_CASE("USARTWithDMA basic DMA operations")
 
     CHECK(true);
 }
+
+TEST_CASE("USARTWithDMA queued transmissions")
+{
+    DMA dma(BluePillDMAController::_1, RCC_DMA1);
+
+    static volatile std::atomic_bool rx_err_flag(false);
+    static volatile std::atomic_bool rx_half_flag(false);
+    static volatile std::atomic_bool rx_complete_flag(false);
+    static volatile std::atomic_bool tx_err_flag(false);
+    static volatile std::atomic_bool tx_half_flag(false);
+    static volatile std::atomic_bool tx_complete_flag(false);
+    static volatile std::atomic_bool overrun_error_flag(false);
+    static volatile std::atomic_bool tx_transfer_complete_flag(false);
+
+    DMAChannelAndFlags rx_chan { BluePillDMAChannel::_6, &rx_err_flag, &rx_half_flag, &rx_complete_flag };
+    DMAChannelAndFlags tx_chan { BluePillDMAChannel::_7, &tx_err_flag, &tx_half_flag, &tx_complete_flag };
+    USARTDMA udma { &dma, rx_chan, tx_chan };
+    USARTWithDMA usart_dma(
+        BluePillUSART::_2, RCC_USART2, RST_USART2, &overrun_error_flag, &tx_transfer_complete_flag, udma);
+
+    // Lengths of the started DMA transfers
+    auto dma_numbers = [] {
+        std::vector<unsigned int> numbers;
+        for (const auto& e : test_event_get_all()) {
+            if (e.type == TestEventType::DMANumber) {
+                numbers.push_back(e.data[0] | (e.data[1] << 8));
+            }
+        }
+        return numbers;
+    };
+
+    test_event_clear();
+    std::string first = "first";
+    std::string second = "second!";
+
+    auto first_token = usart_dma.send_async({ .data = std::as_bytes(std::span(first)) });
+    auto second_token = usart_dma.send_async({ .data = std::as_bytes(std::span(second)) });
+    REQUIRE(first_token.has_value());
+    REQUIRE(second_token.has_value());
+
+    // Only the first one is started by the task
+    REQUIRE(dma_numbers().size() == 1);
+    CHECK(dma_numbers().back() == first.size());
+
+    // The transfer complete interrupt chains the second one
+    usart_dma.tx_complete_isr();
+    CHECK(usart_dma.get_tx_done(*first_token));
+    CHECK_FALSE(usart_dma.get_tx_done(*second_token));
+    REQUIRE(dma_numbers().size() == 2);
+    CHECK(dma_numbers().back() == second.size());
+
+    usart_dma.tx_complete_isr();
+    CHECK(usart_dma.get_tx_done(*second_token));
+    CHECK(dma_numbers().size() == 2);
+
+    // Nothing to send
+    CHECK_FALSE(usart_dma.send_async({}).has_value());
+
+    // Gather: only the first segment is started by the task, the rest are chained
+    const std::array<TxRequest, 2> segments = {
+        TxRequest { .data = std::as_bytes(std::span(first)) },
+        TxRequest { .data = std::as_bytes(std::span(second)) },
+    };
+    auto gather_token = usart_dma.send_gather_async(segments);
+    REQUIRE(gather_token.has_value());
+    REQUIRE(dma_numbers().size() == 3);
+    CHECK(dma_numbers().back() == first.size());
+    usart_dma.tx_complete_isr();
+    CHECK_FALSE(usart_dma.get_tx_done(*gather_token));
+    CHECK(dma_numbers().back() == second.size());
+    usart_dma.tx_complete_isr();
+    CHECK(usart_dma.get_tx_done(*gather_token));
+}